@@ -0,0 +1,35 @@
+#!/bin/bash
+set -e
+
+# Fire N concurrent llx clients at a running llxd and report wall time.
+# Compare runs against daemons started with different -np values.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 <clients> [prompt] [llx path]"
+    echo "Example: $0 8 \"list files by size\" ./build/llx"
+    exit 1
+fi
+
+CLIENTS=$1
+PROMPT=${2:-"Show disk usage of subdirectories in /usr, sorted by size"}
+LLX=${3:-llx}
+OUT_DIR=$(mktemp -d)
+trap 'rm -rf "${OUT_DIR}"' EXIT
+
+# Make sure the daemon is up so startup is not part of the measurement
+"${LLX}" "echo hello" > /dev/null
+
+START=$(date +%s.%N)
+for i in $(seq 1 "${CLIENTS}"); do
+    "${LLX}" "${PROMPT}" > "${OUT_DIR}/${i}.out" 2>&1 &
+done
+wait
+END=$(date +%s.%N)
+
+BYTES=$(cat "${OUT_DIR}"/*.out | wc -c)
+ELAPSED=$(echo "${END} - ${START}" | bc)
+
+echo "Clients:      ${CLIENTS}"
+echo "Wall time:    ${ELAPSED} s"
+echo "Output bytes: ${BYTES} ($(echo "${BYTES} / ${ELAPSED}" | bc) bytes/sec)"
+echo "Per-batch throughput is printed in the llxd log (Total Metrics)."
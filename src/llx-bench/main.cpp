@@ -0,0 +1,682 @@
+// Load generator and latency benchmark for llxd.
+//
+// Opens concurrent protocol v2 connections to the daemon socket, replays a
+// prompt corpus either in closed loop (each connection keeps a fixed number
+// of requests in flight) or at a fixed arrival rate, and reports latency
+// percentiles, throughput and errors as text and JSON. Prompts are replayed
+// in a seeded order with greedy sampling by default, so runs of the same
+// corpus and model compare across commits.
+
+#include "../llxd/protocol.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+
+#ifndef LLX_VERSION
+#define LLX_VERSION "unknown"
+#endif
+
+namespace {
+
+// Used when no corpus is given, typical llx questions
+const char* const DEFAULT_PROMPTS[] = {
+    "list files sorted by size",
+    "find all python files modified in the last day",
+    "show disk usage of the current directory",
+    "count lines in all .cpp files",
+    "kill the process listening on port 8080",
+    "compress the logs directory into a tarball",
+    "show the 10 largest files under /var",
+    "replace foo with bar in every .txt file",
+};
+
+struct BenchOptions {
+    std::string socket_path = "/tmp/llx.sock";
+    std::string prompts_path;           // One prompt per line, the built-in corpus if empty
+    int n_connections = 4;
+    int n_requests = 100;
+    int n_warmup = 0;                   // Sent first and left out of the results
+    int depth = 1;                      // Closed loop: requests in flight per connection
+    double rate = 0;                    // Open loop: requests per second over all connections
+    int max_tokens = 64;
+    float temperature = 0.0f;           // Greedy, so runs compare
+    std::string model;
+    uint32_t seed = 42;                 // Order the corpus is replayed in
+    bool vary = false;                  // Make every prompt unique to bypass the response cache
+    int timeout_s = 600;
+    std::string json_path;              // "-" for stdout
+};
+
+struct Inflight {
+    bool warmup = false;
+    int64_t t_send = 0;
+    int64_t t_first_token = 0;
+    int64_t t_last_token = 0;
+    llxd_protocol::Usage usage;
+    bool has_usage = false;
+};
+
+// Outcome of one measured request
+struct Sample {
+    llxd_protocol::FinishReason reason = llxd_protocol::FinishReason::ERROR;
+    int64_t t_send = 0;
+    int64_t t_end = 0;
+    double t_first_token = -1;          // ms, negative if nothing was streamed
+    double t_inter_token = -1;          // ms, negative under two tokens
+    double t_total = 0;                 // ms
+    uint32_t generated_tokens = 0;
+    uint32_t prompt_tokens = 0;
+    uint32_t cached_tokens = 0;
+    bool from_cache = false;
+};
+
+struct Connection {
+    int fd = -1;
+    std::string in;
+    std::map<uint32_t, Inflight> inflight;
+    uint32_t next_id = 0;
+};
+
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --socket <path>       daemon socket, default /tmp/llx.sock" << std::endl;
+    std::cerr << "  --prompts <file>      corpus, one prompt per line" << std::endl;
+    std::cerr << "  -c, --connections <n> concurrent connections, default 4" << std::endl;
+    std::cerr << "  -n, --requests <n>    measured requests, default 100" << std::endl;
+    std::cerr << "  --warmup <n>          unmeasured requests sent first, default 0" << std::endl;
+    std::cerr << "  --depth <n>           closed loop requests in flight per connection, default 1" << std::endl;
+    std::cerr << "  --rate <r>            open loop, <r> requests per second instead" << std::endl;
+    std::cerr << "  --max-tokens <n>      default 64" << std::endl;
+    std::cerr << "  --temperature <t>     default 0, greedy" << std::endl;
+    std::cerr << "  --model <id>          model to benchmark, the daemon default otherwise" << std::endl;
+    std::cerr << "  --seed <s>            replay order of the corpus, default 42" << std::endl;
+    std::cerr << "  --vary                make every prompt unique to bypass the response cache" << std::endl;
+    std::cerr << "  --timeout <s>         give up after <s> seconds, default 600" << std::endl;
+    std::cerr << "  --json <file>         also write results as JSON, - for stdout" << std::endl;
+}
+
+bool parse_args(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--socket" && has_value) {
+            options.socket_path = argv[++i];
+        } else if (arg == "--prompts" && has_value) {
+            options.prompts_path = argv[++i];
+        } else if ((arg == "-c" || arg == "--connections") && has_value) {
+            options.n_connections = std::atoi(argv[++i]);
+        } else if ((arg == "-n" || arg == "--requests") && has_value) {
+            options.n_requests = std::atoi(argv[++i]);
+        } else if (arg == "--warmup" && has_value) {
+            options.n_warmup = std::atoi(argv[++i]);
+        } else if (arg == "--depth" && has_value) {
+            options.depth = std::atoi(argv[++i]);
+        } else if (arg == "--rate" && has_value) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--max-tokens" && has_value) {
+            options.max_tokens = std::atoi(argv[++i]);
+        } else if (arg == "--temperature" && has_value) {
+            options.temperature = std::atof(argv[++i]);
+        } else if (arg == "--model" && has_value) {
+            options.model = argv[++i];
+        } else if (arg == "--seed" && has_value) {
+            options.seed = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--vary") {
+            options.vary = true;
+        } else if (arg == "--timeout" && has_value) {
+            options.timeout_s = std::atoi(argv[++i]);
+        } else if (arg == "--json" && has_value) {
+            options.json_path = argv[++i];
+        } else if (arg == "--version") {
+            std::cout << "llx-bench version " << LLX_VERSION << std::endl;
+            exit(0);
+        } else {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if (options.n_connections < 1 || options.n_requests < 1 || options.depth < 1 || options.n_warmup < 0 ||
+        options.rate < 0) {
+        std::cerr << "Connections, requests and depth must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool load_prompts(const std::string& path, std::vector<std::string>& prompts) {
+    if (path.empty()) {
+        prompts.assign(std::begin(DEFAULT_PROMPTS), std::end(DEFAULT_PROMPTS));
+        return true;
+    }
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open prompts: " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty()) {
+            prompts.push_back(line);
+        }
+    }
+    if (prompts.empty()) {
+        std::cerr << "No prompts in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool send_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Connect and switch to protocol v2, blocking until the daemon answers
+bool open_connection(const std::string& socket_path, Connection& conn) {
+    conn.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn.fd < 0) {
+        std::cerr << "Failed to create socket" << std::endl;
+        return false;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(conn.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Failed to connect to " << socket_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    llxd_protocol::MessageHeader header;
+    header.type = llxd_protocol::MessageType::HELLO;
+    std::string payload = llxd_protocol::encode_hello(llxd_protocol::Hello());
+    header.payload_size = htonl(payload.size());
+    if (!send_all(conn.fd, std::string(reinterpret_cast<const char*>(&header), sizeof(header)) + payload)) {
+        std::cerr << "Failed to send hello" << std::endl;
+        return false;
+    }
+
+    const size_t frame_size = sizeof(llxd_protocol::FrameHeader) + llxd_protocol::HELLO_SIZE;
+    char buffer[64];
+    while (conn.in.size() < frame_size) {
+        ssize_t n = read(conn.fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        conn.in.append(buffer, n);
+    }
+    llxd_protocol::Hello hello;
+    if (conn.in.size() < frame_size ||
+        llxd_protocol::decode_frame_header(conn.in.data()).type != llxd_protocol::FrameType::HELLO ||
+        !llxd_protocol::decode_hello(conn.in.substr(sizeof(llxd_protocol::FrameHeader), llxd_protocol::HELLO_SIZE),
+                                     hello)) {
+        std::cerr << "Daemon does not speak protocol v2" << std::endl;
+        return false;
+    }
+    conn.in.erase(0, frame_size);
+    return true;
+}
+
+const char* reason_name(llxd_protocol::FinishReason reason) {
+    switch (reason) {
+        case llxd_protocol::FinishReason::STOP: return "stop";
+        case llxd_protocol::FinishReason::EOS: return "eos";
+        case llxd_protocol::FinishReason::LENGTH: return "length";
+        case llxd_protocol::FinishReason::ERROR: return "error";
+        case llxd_protocol::FinishReason::CANCELLED: return "cancelled";
+        case llxd_protocol::FinishReason::BUSY: return "busy";
+        case llxd_protocol::FinishReason::EXPIRED: return "expired";
+    }
+    return "unknown";
+}
+
+bool succeeded(llxd_protocol::FinishReason reason) {
+    return reason == llxd_protocol::FinishReason::STOP || reason == llxd_protocol::FinishReason::EOS ||
+           reason == llxd_protocol::FinishReason::LENGTH;
+}
+
+struct Distribution {
+    size_t count = 0;
+    double mean = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double max = 0;
+};
+
+// Nearest-rank percentiles, the samples are few enough to sort
+Distribution distribution(std::vector<double> values) {
+    Distribution d;
+    if (values.empty()) {
+        return d;
+    }
+    std::sort(values.begin(), values.end());
+    auto rank = [&values](double p) {
+        size_t i = static_cast<size_t>(std::ceil(p / 100.0 * values.size()));
+        return values[std::min(values.size() - 1, i > 0 ? i - 1 : 0)];
+    };
+    d.count = values.size();
+    for (double v : values) {
+        d.mean += v;
+    }
+    d.mean /= values.size();
+    d.p50 = rank(50);
+    d.p90 = rank(90);
+    d.p99 = rank(99);
+    d.max = values.back();
+    return d;
+}
+
+class Bench {
+public:
+    Bench(const BenchOptions& options, std::vector<std::string> prompts)
+        : options_(options)
+        , prompts_(std::move(prompts)) {
+        // Same replay order for the same seed and corpus
+        order_.resize(prompts_.size());
+        for (size_t i = 0; i < order_.size(); i++) {
+            order_[i] = i;
+        }
+        std::mt19937 rng(options_.seed);
+        std::shuffle(order_.begin(), order_.end(), rng);
+    }
+
+    ~Bench() {
+        for (Connection& conn : connections_) {
+            if (conn.fd >= 0) {
+                close(conn.fd);
+            }
+        }
+    }
+
+    bool connect() {
+        connections_.resize(options_.n_connections);
+        for (Connection& conn : connections_) {
+            if (!open_connection(options_.socket_path, conn)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Replay the corpus until every request is answered, false on timeout
+    // or when connections were lost
+    bool run() {
+        const int n_total = options_.n_warmup + options_.n_requests;
+        const int64_t t_deadline = now_us() + static_cast<int64_t>(options_.timeout_s) * 1000000;
+        const double interval_us = options_.rate > 0 ? 1e6 / options_.rate : 0;
+        int64_t t_next_arrival = now_us();
+        std::vector<struct pollfd> fds(connections_.size());
+
+        while (n_done_ < n_total) {
+            int64_t t_now = now_us();
+            if (t_now > t_deadline) {
+                std::cerr << "Timed out with " << n_total - n_done_ << " requests unanswered" << std::endl;
+                break;
+            }
+
+            // Keep the load going, by arrival time or by free capacity
+            if (options_.rate > 0) {
+                while (n_sent_ < n_total && t_now >= t_next_arrival) {
+                    send_request(connections_[n_sent_ % connections_.size()]);
+                    t_next_arrival += static_cast<int64_t>(interval_us);
+                }
+            } else {
+                for (Connection& conn : connections_) {
+                    while (conn.fd >= 0 && n_sent_ < n_total &&
+                           conn.inflight.size() < static_cast<size_t>(options_.depth)) {
+                        send_request(conn);
+                    }
+                }
+            }
+
+            size_t n_open = 0;
+            for (size_t i = 0; i < connections_.size(); i++) {
+                fds[i].fd = connections_[i].fd;
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+                n_open += connections_[i].fd >= 0;
+            }
+            if (n_open == 0) {
+                std::cerr << "Every connection closed" << std::endl;
+                break;
+            }
+
+            int timeout_ms = 1000;
+            if (options_.rate > 0 && n_sent_ < n_total) {
+                timeout_ms = static_cast<int>(std::max<int64_t>(0, (t_next_arrival - now_us() + 999) / 1000));
+            }
+            if (poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR) {
+                std::cerr << "poll failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+            for (size_t i = 0; i < connections_.size(); i++) {
+                if (fds[i].fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    receive(connections_[i]);
+                }
+            }
+        }
+        return n_done_ == n_total;
+    }
+
+    // Print the summary, and write JSON if asked. False if any request failed.
+    bool report() const {
+        std::vector<double> ttft, itl, e2e;
+        std::map<std::string, int> failures;
+        uint64_t n_generated = 0;
+        uint64_t n_prompt = 0;
+        uint64_t n_cached = 0;
+        int n_ok = 0;
+        int n_from_cache = 0;
+        int64_t t_first_send = 0;
+        int64_t t_last_end = 0;
+        for (const Sample& sample : samples_) {
+            t_first_send = t_first_send == 0 ? sample.t_send : std::min(t_first_send, sample.t_send);
+            t_last_end = std::max(t_last_end, sample.t_end);
+            if (!succeeded(sample.reason)) {
+                failures[reason_name(sample.reason)]++;
+                continue;
+            }
+            n_ok++;
+            n_from_cache += sample.from_cache;
+            n_generated += sample.generated_tokens;
+            n_prompt += sample.prompt_tokens;
+            n_cached += sample.cached_tokens;
+            e2e.push_back(sample.t_total);
+            if (sample.t_first_token >= 0) {
+                ttft.push_back(sample.t_first_token);
+            }
+            if (sample.t_inter_token >= 0) {
+                itl.push_back(sample.t_inter_token);
+            }
+        }
+        const int n_unanswered = std::max(0, options_.n_requests - static_cast<int>(samples_.size()));
+        if (n_unanswered > 0) {
+            failures["unanswered"] = n_unanswered;
+        }
+        const int n_failed = static_cast<int>(samples_.size()) - n_ok + n_unanswered;
+        const double t_wall = t_last_end > t_first_send ? (t_last_end - t_first_send) / 1e6 : 0;
+        const double requests_per_sec = t_wall > 0 ? n_ok / t_wall : 0;
+        const double tokens_per_sec = t_wall > 0 ? n_generated / t_wall : 0;
+
+        const Distribution d_ttft = distribution(ttft);
+        const Distribution d_itl = distribution(itl);
+        const Distribution d_e2e = distribution(e2e);
+
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << "llx-bench " << LLX_VERSION << ": " << options_.n_requests << " requests over "
+                  << options_.n_connections << " connections, ";
+        if (options_.rate > 0) {
+            std::cout << options_.rate << " requests/s open loop";
+        } else {
+            std::cout << options_.depth << " in flight per connection";
+        }
+        std::cout << ", max " << options_.max_tokens << " tokens" << std::endl;
+        std::cout << "Completed " << n_ok << ", failed " << n_failed;
+        for (const auto& item : failures) {
+            std::cout << " (" << item.first << " " << item.second << ")";
+        }
+        std::cout << ", " << n_from_cache << " from the response cache" << std::endl;
+        std::cout << "Throughput: " << requests_per_sec << " requests/s, " << tokens_per_sec
+                  << " generated tokens/s over " << t_wall << " s" << std::endl;
+        std::cout << "Tokens: " << n_prompt << " prompt, " << n_cached << " cached, " << n_generated << " generated"
+                  << std::endl;
+        print_distribution("Time to first token", d_ttft);
+        print_distribution("Inter-token latency", d_itl);
+        print_distribution("End-to-end latency", d_e2e);
+        if (n_from_cache > 0 && !options_.vary) {
+            std::cout << "Note: cached answers skew latencies, use --vary or llxd --no-response-cache" << std::endl;
+        }
+
+        if (!options_.json_path.empty()) {
+            std::ostringstream json;
+            json << std::fixed << std::setprecision(3);
+            json << "{\"version\":\"" << LLX_VERSION << "\""
+                 << ",\"config\":{\"connections\":" << options_.n_connections
+                 << ",\"requests\":" << options_.n_requests
+                 << ",\"warmup\":" << options_.n_warmup
+                 << ",\"depth\":" << options_.depth
+                 << ",\"rate\":" << options_.rate
+                 << ",\"max_tokens\":" << options_.max_tokens
+                 << ",\"temperature\":" << options_.temperature
+                 << ",\"seed\":" << options_.seed
+                 << ",\"vary\":" << (options_.vary ? "true" : "false")
+                 << ",\"prompts\":" << prompts_.size() << "}"
+                 << ",\"completed\":" << n_ok
+                 << ",\"failed\":" << n_failed
+                 << ",\"failures\":{";
+            bool first = true;
+            for (const auto& item : failures) {
+                json << (first ? "" : ",") << "\"" << item.first << "\":" << item.second;
+                first = false;
+            }
+            json << "},\"from_cache\":" << n_from_cache
+                 << ",\"wall_s\":" << t_wall
+                 << ",\"requests_per_sec\":" << requests_per_sec
+                 << ",\"tokens_per_sec\":" << tokens_per_sec
+                 << ",\"prompt_tokens\":" << n_prompt
+                 << ",\"cached_tokens\":" << n_cached
+                 << ",\"generated_tokens\":" << n_generated
+                 << ",\"latency_ms\":{";
+            append_distribution(json, "time_to_first_token", d_ttft);
+            json << ",";
+            append_distribution(json, "inter_token", d_itl);
+            json << ",";
+            append_distribution(json, "end_to_end", d_e2e);
+            json << "}}\n";
+
+            if (options_.json_path == "-") {
+                std::cout << json.str();
+            } else {
+                std::ofstream file(options_.json_path, std::ios::trunc);
+                if (!file || !(file << json.str())) {
+                    std::cerr << "Failed to write " << options_.json_path << std::endl;
+                    return false;
+                }
+            }
+        }
+        return n_failed == 0;
+    }
+
+private:
+    void send_request(Connection& conn) {
+        const int index = n_sent_++;
+        std::string prompt = prompts_[order_[index % order_.size()]];
+        if (options_.vary) {
+            prompt += " (" + std::to_string(index) + ")";
+        }
+
+        llxd_protocol::RequestParams params;
+        params.prompt = prompt;
+        params.max_tokens = options_.max_tokens > 0 ? options_.max_tokens : 0;
+        params.temperature = options_.temperature;
+        params.model = options_.model;
+
+        Inflight request;
+        request.warmup = index < options_.n_warmup;
+        request.t_send = now_us();
+        if (conn.fd < 0) {
+            // Lost earlier, the request fails right away
+            finish(request, llxd_protocol::FinishReason::ERROR, request.t_send);
+            return;
+        }
+
+        const uint32_t id = conn.next_id++;
+        conn.inflight[id] = request;
+        if (!send_all(conn.fd, llxd_protocol::encode_frame(llxd_protocol::FrameType::REQUEST, id,
+                                                           llxd_protocol::encode_request(params)))) {
+            std::cerr << "Failed to send request: " << strerror(errno) << std::endl;
+            drop(conn);
+        }
+    }
+
+    void receive(Connection& conn) {
+        char buffer[64 * 1024];
+        ssize_t n = read(conn.fd, buffer, sizeof(buffer));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            return;
+        }
+        if (n <= 0) {
+            std::cerr << "Daemon closed a connection with " << conn.inflight.size() << " requests in flight"
+                      << std::endl;
+            drop(conn);
+            return;
+        }
+        const int64_t t_now = now_us();
+        conn.in.append(buffer, n);
+
+        const size_t header_size = sizeof(llxd_protocol::FrameHeader);
+        size_t offset = 0;
+        while (conn.in.size() - offset >= header_size) {
+            llxd_protocol::FrameHeader header = llxd_protocol::decode_frame_header(conn.in.data() + offset);
+            if (conn.in.size() - offset - header_size < header.length) {
+                break;
+            }
+            const char* payload = conn.in.data() + offset + header_size;
+            on_frame(conn, header, std::string(payload, header.length), t_now);
+            offset += header_size + header.length;
+        }
+        conn.in.erase(0, offset);
+    }
+
+    void on_frame(Connection& conn, const llxd_protocol::FrameHeader& header, const std::string& payload,
+                  int64_t t_now) {
+        auto it = conn.inflight.find(header.request_id);
+        if (it == conn.inflight.end()) {
+            return;
+        }
+        Inflight& inflight = it->second;
+        if (header.type == llxd_protocol::FrameType::TOKEN) {
+            if (inflight.t_first_token == 0) {
+                inflight.t_first_token = t_now;
+            }
+            inflight.t_last_token = t_now;
+        } else if (header.type == llxd_protocol::FrameType::USAGE) {
+            inflight.has_usage = llxd_protocol::decode_usage(payload, inflight.usage);
+        } else if (header.type == llxd_protocol::FrameType::END) {
+            llxd_protocol::FinishReason reason = payload.empty() ? llxd_protocol::FinishReason::ERROR
+                                                                 : static_cast<llxd_protocol::FinishReason>(payload[0]);
+            finish(inflight, reason, t_now);
+            conn.inflight.erase(it);
+        }
+    }
+
+    void finish(const Inflight& inflight, llxd_protocol::FinishReason reason, int64_t t_end) {
+        n_done_++;
+        if (inflight.warmup) {
+            return;
+        }
+        Sample sample;
+        sample.reason = reason;
+        sample.t_send = inflight.t_send;
+        sample.t_end = t_end;
+        sample.t_total = (t_end - inflight.t_send) / 1e3;
+        if (inflight.t_first_token > 0) {
+            sample.t_first_token = (inflight.t_first_token - inflight.t_send) / 1e3;
+        }
+        if (inflight.has_usage) {
+            sample.generated_tokens = inflight.usage.generated_tokens;
+            sample.prompt_tokens = inflight.usage.prompt_tokens;
+            sample.cached_tokens = inflight.usage.cached_tokens;
+            sample.from_cache = inflight.usage.from_cache != 0;
+        }
+
+        // Averaged from the token count, coalesced writes carry several
+        // tokens per frame so gaps between frames would overstate it
+        if (sample.generated_tokens > 1 && inflight.t_last_token > inflight.t_first_token) {
+            sample.t_inter_token = (inflight.t_last_token - inflight.t_first_token) / 1e3 /
+                                   (sample.generated_tokens - 1);
+        }
+        samples_.push_back(sample);
+    }
+
+    // Give up on a connection, its requests count as failed
+    void drop(Connection& conn) {
+        const int64_t t_now = now_us();
+        for (const auto& item : conn.inflight) {
+            finish(item.second, llxd_protocol::FinishReason::ERROR, t_now);
+        }
+        conn.inflight.clear();
+        close(conn.fd);
+        conn.fd = -1;
+    }
+
+    static void print_distribution(const char* name, const Distribution& d) {
+        std::cout << name << " (ms): mean " << d.mean << ", p50 " << d.p50 << ", p90 " << d.p90 << ", p99 "
+                  << d.p99 << ", max " << d.max << " (" << d.count << " samples)" << std::endl;
+    }
+
+    static void append_distribution(std::ostream& out, const char* name, const Distribution& d) {
+        out << "\"" << name << "\":{\"count\":" << d.count << ",\"mean\":" << d.mean << ",\"p50\":" << d.p50
+            << ",\"p90\":" << d.p90 << ",\"p99\":" << d.p99 << ",\"max\":" << d.max << "}";
+    }
+
+    BenchOptions options_;
+    std::vector<std::string> prompts_;
+    std::vector<size_t> order_;
+    std::vector<Connection> connections_;
+    std::vector<Sample> samples_;
+    int n_sent_ = 0;
+    int n_done_ = 0;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (!parse_args(argc, argv, options)) {
+        return 2;
+    }
+    std::vector<std::string> prompts;
+    if (!load_prompts(options.prompts_path, prompts)) {
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);   // A daemon that went away fails the send instead
+
+    Bench bench(options, std::move(prompts));
+    if (!bench.connect()) {
+        std::cerr << "Is llxd running? Start it with llx or llxd" << std::endl;
+        return 1;
+    }
+    bool completed = bench.run();
+    bool ok = bench.report();
+    return completed && ok ? 0 : 1;
+}
@@ -1,6 +1,8 @@
 #include "daemon_manager.h"
+#include "../llxd/protocol.h"
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <iostream>
 #include <cstring>
@@ -58,6 +60,17 @@ public:
         return start_daemon(model_path.string());
     }
 
+    bool ensure_model(const std::string& model_id) {
+        if (validate_model(model_id)) {
+            return true;
+        }
+        if (!download_model(model_id)) {
+            std::cerr << "Failed to download model: " << model_id << std::endl;
+            return false;
+        }
+        return true;
+    }
+
     std::string determine_model_id(const std::optional<std::string>& requested_model) const {
         if (requested_model && !requested_model->empty()) {
             return *requested_model;
@@ -147,10 +160,19 @@ public:
         std::ofstream ofs(log_file, std::ofstream::out | std::ofstream::trunc);
         ofs.close();
 
+        // The daemon reports load progress and readiness on this pipe
+        int ready_pipe[2];
+        if (pipe(ready_pipe) < 0) {
+            std::cerr << "Failed to create pipe: " << strerror(errno) << std::endl;
+            return false;
+        }
+
         // Fork process
         pid_t pid = fork();
         if (pid < 0) {
             std::cerr << "Failed to fork process" << std::endl;
+            close(ready_pipe[0]);
+            close(ready_pipe[1]);
             return false;
         }
 
@@ -170,17 +192,19 @@ public:
             dup2(log_fd, STDERR_FILENO);
 
             for (int i = 3; i < 1024; i++) {
-                if (i != log_fd) {
+                if (i != log_fd && i != ready_pipe[1]) {
                     close(i);
                 }
             }
 
             std::string model_arg = "-m";
+            std::string ready_fd = std::to_string(ready_pipe[1]);
             std::vector<const char*> args = {
                 daemon_path.c_str(),
                 model_arg.c_str(),
                 model_path.c_str(),
-                "-d"  // Debug mode during startup
+                "--ready-fd",
+                ready_fd.c_str()
             };
             
             args.push_back(nullptr);
@@ -191,24 +215,23 @@ public:
             exit(1);
         }
 
-        // Parent process - wait for daemon to start
-        const int MAX_RETRIES = 30;
-        int retries = MAX_RETRIES;
-        while (retries-- > 0) {
-            if (is_running()) {
-                return true;
-            }
-            usleep(200000);  // 200ms
-            
-            int status;
-            pid_t result = waitpid(pid, &status, WNOHANG);
-            if (result == pid) {
-                if (WIFEXITED(status)) {
-                    std::cerr << "Daemon process exited with status " << WEXITSTATUS(status) << std::endl;
-                } else if (WIFSIGNALED(status)) {
-                    std::cerr << "Daemon process killed by signal " << WTERMSIG(status) << std::endl;
-                }
-                break;
+        // Parent process - wait until the daemon says it is ready. It
+        // listens before loading, so a closed pipe without READY_OK means
+        // it failed or died.
+        close(ready_pipe[1]);
+        bool ready = wait_ready(ready_pipe[0]);
+        close(ready_pipe[0]);
+        if (ready) {
+            return true;
+        }
+
+        int status;
+        pid_t result = waitpid(pid, &status, WNOHANG);
+        if (result == pid) {
+            if (WIFEXITED(status)) {
+                std::cerr << "Daemon process exited with status " << WEXITSTATUS(status) << std::endl;
+            } else if (WIFSIGNALED(status)) {
+                std::cerr << "Daemon process killed by signal " << WTERMSIG(status) << std::endl;
             }
         }
 
@@ -226,6 +249,43 @@ public:
         return false;
     }
 
+    // Read the daemon's ready pipe until it reports ready or fails,
+    // showing model load progress on a terminal
+    bool wait_ready(int fd) const {
+        const bool show_progress = isatty(STDERR_FILENO);
+        std::string pending;
+        char buffer[256];
+        bool ready = false;
+        ssize_t n;
+        while (!ready && (n = read(fd, buffer, sizeof(buffer))) > 0) {
+            pending.append(buffer, n);
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+
+                if (line.compare(0, strlen(llxd_protocol::READY_PROGRESS), llxd_protocol::READY_PROGRESS) == 0) {
+                    if (show_progress) {
+                        std::cerr << "\rLoading model... " << line.substr(strlen(llxd_protocol::READY_PROGRESS))
+                                  << "%" << std::flush;
+                    }
+                } else if (line == llxd_protocol::READY_OK) {
+                    ready = true;
+                } else if (line.compare(0, strlen(llxd_protocol::READY_ERROR), llxd_protocol::READY_ERROR) == 0) {
+                    if (show_progress) {
+                        std::cerr << std::endl;
+                    }
+                    std::cerr << "Daemon error: " << line.substr(strlen(llxd_protocol::READY_ERROR)) << std::endl;
+                    return false;
+                }
+            }
+        }
+        if (show_progress) {
+            std::cerr << "\r\033[K" << std::flush;
+        }
+        return ready;
+    }
+
     fs::path get_daemon_path() const {
         fs::path exe_dir;
 
@@ -278,5 +338,6 @@ DaemonManager::~DaemonManager() = default;
 
 bool DaemonManager::is_running() const { return impl->is_running(); }
 bool DaemonManager::ensure_running(const std::optional<std::string>& model_id) { return impl->ensure_running(model_id); }
+bool DaemonManager::ensure_model(const std::string& model_id) { return impl->ensure_model(model_id); }
 fs::path DaemonManager::get_daemon_path() const { return impl->get_daemon_path(); }
 fs::path DaemonManager::get_default_model_path() const { return impl->get_model_path("TheBloke/Llama-3.2-3B-Instruct-GGUF"); }
@@ -18,6 +18,10 @@ public:
     // Returns true if successful, false if there was an error
     bool ensure_running(const std::optional<std::string>& model_id = std::nullopt);
 
+    // Download model_id into the models directory if it is not there yet,
+    // so a running daemon can load it by id
+    bool ensure_model(const std::string& model_id);
+
     // Get path to daemon executable
     std::filesystem::path get_daemon_path() const;
 
@@ -6,8 +6,50 @@
 #include <unistd.h>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <arpa/inet.h>
 
+namespace {
+
+const char* finish_reason_name(llxd_protocol::FinishReason reason) {
+    switch (reason) {
+        case llxd_protocol::FinishReason::STOP: return "stop";
+        case llxd_protocol::FinishReason::EOS: return "eos";
+        case llxd_protocol::FinishReason::LENGTH: return "length";
+        case llxd_protocol::FinishReason::ERROR: return "error";
+        case llxd_protocol::FinishReason::CANCELLED: return "cancelled";
+        case llxd_protocol::FinishReason::BUSY: return "busy";
+        case llxd_protocol::FinishReason::EXPIRED: return "expired";
+    }
+    return "unknown";
+}
+
+// Ended without an answer, the message says why
+bool is_failure(llxd_protocol::FinishReason reason) {
+    return reason == llxd_protocol::FinishReason::ERROR || reason == llxd_protocol::FinishReason::BUSY ||
+           reason == llxd_protocol::FinishReason::EXPIRED;
+}
+
+bool uses_v2(const llx_query_options& options) {
+    return options.max_tokens > 0 || options.temperature >= 0.0f || options.priority != 0 ||
+           options.deadline_ms > 0;
+}
+
+llxd_protocol::RequestParams make_params(const std::string& prompt, const llx_query_options& options) {
+    llxd_protocol::RequestParams params;
+    params.prompt = prompt;
+    params.max_tokens = options.max_tokens > 0 ? options.max_tokens : 0;
+    params.temperature = options.temperature;
+    params.stop = options.stop;
+    params.stop_set = options.stop_at_code_block ? llxd_protocol::StopSet::CODE_BLOCK : llxd_protocol::StopSet::NONE;
+    params.model = options.model;
+    params.priority = static_cast<int8_t>(std::max(-128, std::min(127, options.priority)));
+    params.deadline_ms = options.deadline_ms > 0 ? options.deadline_ms : 0;
+    return params;
+}
+
+} // namespace
+
 class llx::Impl {
 public:
     Impl() : socket_fd_(-1) {}
@@ -40,41 +82,242 @@ public:
         return true;
     }
 
-    bool query(const std::string& prompt, ResponseCallback callback) {
+    bool query(const std::string& prompt, ResponseCallback callback, const llx_query_options& options) {
         if (socket_fd_ < 0) {
             std::cerr << "Not connected to daemon" << std::endl;
             return false;
         }
+        if (uses_v2(options)) {
+            return query_v2(prompt, callback, options);
+        }
 
-        // Prepare and send message header
+        // Default options go out as a plain prompt
         llxd_protocol::MessageHeader header;
-        header.type = llxd_protocol::MessageType::PROMPT;
-        header.payload_size = htonl(prompt.length());  // Convert to network byte order
+        std::string payload;
+        if (options.stop_at_code_block && options.stop.empty() && options.model.empty()) {
+            header.type = llxd_protocol::MessageType::PROMPT;
+            payload = prompt;
+        } else {
+            header.type = llxd_protocol::MessageType::PROMPT_EX;
+            payload = llxd_protocol::encode_prompt_ex(options.stop_at_code_block ? llxd_protocol::StopSet::CODE_BLOCK
+                                                                                 : llxd_protocol::StopSet::NONE,
+                                                      options.stop, options.model, prompt);
+        }
+        header.payload_size = htonl(payload.length());  // Convert to network byte order
 
         if (!send_all(&header, sizeof(header))) {
             return false;
         }
 
         // Send prompt
-        if (!send_all(prompt.c_str(), prompt.length())) {
+        if (!send_all(payload.c_str(), payload.length())) {
             return false;
         }
 
-        // Read response in chunks
-        char buffer[4096];
+        // Read response in chunks, reusing one string for all of them.
+        // Everything after V1_ERROR is the error message, not text.
+        char buffer[16384];
+        std::string chunk;
+        chunk.reserve(sizeof(buffer));
+        std::string error;
+        bool failed = false;
         while (true) {
-            ssize_t n = read(socket_fd_, buffer, sizeof(buffer) - 1);
+            ssize_t n = read(socket_fd_, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
             if (n <= 0) {
                 break;
             }
-            buffer[n] = '\0';
-            callback(std::string(buffer, n));
+            if (failed) {
+                error.append(buffer, n);
+                continue;
+            }
+            const char* marker = static_cast<const char*>(memchr(buffer, llxd_protocol::V1_ERROR, n));
+            if (marker) {
+                failed = true;
+                error.assign(marker + 1, buffer + n - marker - 1);
+                n = marker - buffer;
+                if (n == 0) {
+                    continue;
+                }
+            }
+            chunk.assign(buffer, n);
+            callback(chunk);
         }
 
+        if (failed) {
+            while (!error.empty() && error.back() == '\n') {
+                error.pop_back();
+            }
+            std::cerr << "Error: " << error << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool batch(const std::vector<std::string>& prompts, ResultCallback callback, const llx_query_options& options) {
+        if (socket_fd_ < 0) {
+            std::cerr << "Not connected to daemon" << std::endl;
+            return false;
+        }
+        if (!hello()) {
+            return false;
+        }
+
+        // Every request goes out in one write, tagged with its index
+        std::string out;
+        for (size_t i = 0; i < prompts.size(); i++) {
+            std::string payload = llxd_protocol::encode_request(make_params(prompts[i], options));
+            llxd_protocol::append_frame(out, llxd_protocol::FrameType::REQUEST, static_cast<uint32_t>(i),
+                                        payload.data(), payload.size());
+        }
+        if (!send_all(out.data(), out.size())) {
+            return false;
+        }
+
+        // Responses interleave, collect each until its END frame
+        std::vector<llx_result> results(prompts.size());
+        size_t n_done = 0;
+        llxd_protocol::FrameHeader header;
+        std::string payload;
+        while (n_done < prompts.size()) {
+            if (!read_frame(header, payload)) {
+                std::cerr << "Connection closed with " << prompts.size() - n_done << " prompts unanswered" << std::endl;
+                return false;
+            }
+            if (header.request_id >= results.size()) {
+                continue;
+            }
+            llx_result& result = results[header.request_id];
+            if (header.type == llxd_protocol::FrameType::TOKEN) {
+                result.text += payload;
+            } else if (header.type == llxd_protocol::FrameType::USAGE) {
+                read_usage(payload, result);
+            } else if (header.type == llxd_protocol::FrameType::END && !payload.empty()) {
+                result.finish_reason = finish_reason_name(static_cast<llxd_protocol::FinishReason>(payload[0]));
+                result.error = payload.substr(1);
+                callback(header.request_id, result);
+                result = llx_result();
+                n_done++;
+            }
+        }
         return true;
     }
 
     bool shutdown() {
+        return control(llxd_protocol::ControlCommand::SHUTDOWN);
+    }
+
+    bool models() {
+        return control(llxd_protocol::ControlCommand::MODELS);
+    }
+
+    bool swap(const std::string& model) {
+        return control(llxd_protocol::ControlCommand::SWAP, model);
+    }
+
+    bool stats() {
+        return control(llxd_protocol::ControlCommand::STATS);
+    }
+
+    bool trace(const std::string& argument) {
+        return control(llxd_protocol::ControlCommand::TRACE, argument);
+    }
+
+private:
+    // One prompt over protocol v2, for the options v1 cannot carry
+    bool query_v2(const std::string& prompt, ResponseCallback callback, const llx_query_options& options) {
+        if (!hello()) {
+            return false;
+        }
+        std::string request = llxd_protocol::encode_frame(llxd_protocol::FrameType::REQUEST, 0,
+                                                          llxd_protocol::encode_request(make_params(prompt, options)));
+        if (!send_all(request.data(), request.size())) {
+            return false;
+        }
+
+        llxd_protocol::FrameHeader header;
+        std::string payload;
+        while (read_frame(header, payload)) {
+            if (header.type == llxd_protocol::FrameType::TOKEN) {
+                callback(payload);
+            } else if (header.type == llxd_protocol::FrameType::END) {
+                if (!payload.empty() && is_failure(static_cast<llxd_protocol::FinishReason>(payload[0]))) {
+                    std::cerr << "Error: " << payload.substr(1) << std::endl;
+                    return false;
+                }
+                return true;
+            }
+        }
+        std::cerr << "Connection closed before the response ended" << std::endl;
+        return false;
+    }
+
+    // Switch the connection to protocol v2
+    bool hello() {
+        llxd_protocol::MessageHeader header;
+        header.type = llxd_protocol::MessageType::HELLO;
+        std::string payload = llxd_protocol::encode_hello(llxd_protocol::Hello());
+        header.payload_size = htonl(payload.size());
+        if (!send_all(&header, sizeof(header)) || !send_all(payload.data(), payload.size())) {
+            return false;
+        }
+
+        llxd_protocol::FrameHeader reply;
+        std::string reply_payload;
+        llxd_protocol::Hello hello;
+        if (!read_frame(reply, reply_payload) || reply.type != llxd_protocol::FrameType::HELLO ||
+            !llxd_protocol::decode_hello(reply_payload, hello)) {
+            std::cerr << "Daemon does not speak protocol v2, restart it with llx --shutdown" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Next frame from the daemon, false once the connection is closed
+    bool read_frame(llxd_protocol::FrameHeader& header, std::string& payload) {
+        const size_t header_size = sizeof(llxd_protocol::FrameHeader);
+        while (true) {
+            const size_t available = in_.size() - in_offset_;
+            if (available >= header_size) {
+                header = llxd_protocol::decode_frame_header(in_.data() + in_offset_);
+                if (available - header_size >= header.length) {
+                    payload.assign(in_, in_offset_ + header_size, header.length);
+                    in_offset_ += header_size + header.length;
+                    return true;
+                }
+            }
+
+            in_.erase(0, in_offset_);
+            in_offset_ = 0;
+            char buffer[16384];
+            ssize_t n = read(socket_fd_, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            in_.append(buffer, n);
+        }
+    }
+
+    static void read_usage(const std::string& payload, llx_result& result) {
+        llxd_protocol::Usage usage;
+        if (!llxd_protocol::decode_usage(payload, usage)) {
+            return;
+        }
+        result.prompt_tokens = usage.prompt_tokens;
+        result.cached_tokens = usage.cached_tokens;
+        result.generated_tokens = usage.generated_tokens;
+        result.t_first_token = usage.t_first_token_us / 1e3;
+        result.t_total = usage.t_total_us / 1e3;
+        result.from_cache = usage.from_cache != 0;
+    }
+
+    // Send a control command and print the daemon's reply
+    bool control(llxd_protocol::ControlCommand cmd, const std::string& argument = "") {
         if (socket_fd_ < 0) {
             std::cerr << "Not connected to daemon" << std::endl;
             return false;
@@ -83,24 +326,22 @@ public:
         // Prepare and send message header
         llxd_protocol::MessageHeader header;
         header.type = llxd_protocol::MessageType::CONTROL;
-        header.payload_size = htonl(sizeof(llxd_protocol::ControlCommand));
+        header.payload_size = htonl(sizeof(llxd_protocol::ControlCommand) + argument.size());
 
         if (!send_all(&header, sizeof(header))) {
             return false;
         }
 
-        // Send shutdown command
-        llxd_protocol::ControlCommand cmd = llxd_protocol::ControlCommand::SHUTDOWN;
-        if (!send_all(&cmd, sizeof(cmd))) {
+        // Send control command
+        if (!send_all(&cmd, sizeof(cmd)) || !send_all(argument.data(), argument.size())) {
             return false;
         }
 
-        // Read confirmation response
+        // Read the response until the daemon closes the connection
         char buffer[4096];
-        ssize_t n = read(socket_fd_, buffer, sizeof(buffer) - 1);
-        if (n > 0) {
-            buffer[n] = '\0';
-            std::cout << buffer;
+        ssize_t n;
+        while ((n = read(socket_fd_, buffer, sizeof(buffer))) > 0) {
+            std::cout.write(buffer, n);
         }
 
         // Close socket
@@ -110,7 +351,6 @@ public:
         return true;
     }
 
-private:
     bool send_all(const void* data, size_t len) {
         const char* ptr = static_cast<const char*>(data);
         size_t remaining = len;
@@ -128,6 +368,10 @@ private:
     }
 
     int socket_fd_;
+
+    // Frames read but not consumed yet, v2 only
+    std::string in_;
+    size_t in_offset_ = 0;
 };
 
 llx::llx() : impl(std::make_unique<Impl>()) {}
@@ -137,10 +381,30 @@ bool llx::connect() {
     return impl->connect();
 }
 
-bool llx::query(const std::string& prompt, ResponseCallback callback) {
-    return impl->query(prompt, callback);
+bool llx::query(const std::string& prompt, ResponseCallback callback, const llx_query_options& options) {
+    return impl->query(prompt, callback, options);
+}
+
+bool llx::batch(const std::vector<std::string>& prompts, ResultCallback callback, const llx_query_options& options) {
+    return impl->batch(prompts, callback, options);
 }
 
 bool llx::shutdown() {
     return impl->shutdown();
+}
+
+bool llx::models() {
+    return impl->models();
+}
+
+bool llx::swap(const std::string& model) {
+    return impl->swap(model);
+}
+
+bool llx::stats() {
+    return impl->stats();
+}
+
+bool llx::trace(const std::string& argument) {
+    return impl->trace(argument);
 } 
\ No newline at end of file
@@ -1,15 +1,46 @@
 #ifndef LLX_H
 #define LLX_H
 
+#include <cstdint>
 #include <string>
+#include <vector>
 #include <memory>
 #include <functional>
 
+// Per-query options
+struct llx_query_options {
+    bool stop_at_code_block = true;     // End right after the first code block
+    std::vector<std::string> stop;      // Extra stop strings
+    std::string model;                  // Model id, empty for the daemon default
+
+    // Sent over protocol v2, the daemon's defaults otherwise
+    int max_tokens = 0;                 // 0 for the default
+    float temperature = -1.0f;          // Negative for the default
+    int priority = 0;                   // Higher is served first
+    int deadline_ms = 0;                // Give up unless started within this, 0 for the default
+};
+
+// Outcome of one prompt of a batch
+struct llx_result {
+    std::string text;
+    std::string finish_reason;          // stop, eos, length, error, cancelled, busy or expired
+    std::string error;                  // Why it failed, busy carries a retry hint
+    uint32_t prompt_tokens = 0;
+    uint32_t cached_tokens = 0;
+    uint32_t generated_tokens = 0;
+    double t_first_token = 0;           // ms
+    double t_total = 0;                 // ms
+    bool from_cache = false;
+};
+
 class llx {
 public:
     // Callback type for receiving streamed responses
     using ResponseCallback = std::function<void(const std::string&)>;
 
+    // Callback type for finished batch prompts, index into the prompts
+    using ResultCallback = std::function<void(size_t index, const llx_result& result)>;
+
     llx();
     ~llx();
 
@@ -17,11 +48,31 @@ public:
     bool connect();
 
     // Send a prompt and receive response
-    bool query(const std::string& prompt, ResponseCallback callback);
+    bool query(const std::string& prompt, ResponseCallback callback,
+               const llx_query_options& options = llx_query_options());
+
+    // Send every prompt over this one connection and report each result as
+    // it completes. The daemon runs them concurrently, in any order.
+    bool batch(const std::vector<std::string>& prompts, ResultCallback callback,
+               const llx_query_options& options = llx_query_options());
 
     // Send shutdown command to daemon
     bool shutdown();
 
+    // Print the daemon's per-model residency stats
+    bool models();
+
+    // Serve a model from another GGUF file without downtime, model is
+    // "<id>=<path>" or just "<path>" for the default model
+    bool swap(const std::string& model);
+
+    // Print the daemon's counters and latency percentiles as JSON
+    bool stats();
+
+    // Print the daemon's recorded spans as Chrome trace JSON, or start or
+    // stop recording with "on" or "off"
+    bool trace(const std::string& argument = "");
+
 private:
     class Impl;
     std::unique_ptr<Impl> impl;
@@ -3,6 +3,10 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 
 #ifndef LLX_VERSION
 #define LLX_VERSION "unknown"
@@ -15,10 +19,25 @@
 #define COLOR_LANG    "\033[38;5;242m"  // Gray for language tags
 
 void print_usage(const char* program) {
-    std::cerr << "Usage: " << program << " \"<prompt>\"" << std::endl;
-    std::cerr << "   or: " << program << " (enter multi-line input, terminate with two blank lines)" << std::endl;
+    std::cerr << "Usage: " << program << " [options] \"<prompt>\"" << std::endl;
+    std::cerr << "   or: " << program << " [options] (enter multi-line input, terminate with two blank lines)" << std::endl;
     std::cerr << "   or: " << program << " --version" << std::endl;
     std::cerr << "   or: " << program << " --shutdown" << std::endl;
+    std::cerr << "   or: " << program << " --models" << std::endl;
+    std::cerr << "   or: " << program << " --stats" << std::endl;
+    std::cerr << "   or: " << program << " --trace [on|off] > trace.json" << std::endl;
+    std::cerr << "   or: " << program << " --swap [<id>=]<path.gguf>" << std::endl;
+    std::cerr << "   or: " << program << " [options] --batch < prompts.txt" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --no-stop          keep generating after the first code block" << std::endl;
+    std::cerr << "  --stop <text>      also stop at <text>, may be repeated" << std::endl;
+    std::cerr << "  --model <id>       answer with another model, downloaded if needed" << std::endl;
+    std::cerr << "  --max-tokens <n>   generate at most <n> tokens" << std::endl;
+    std::cerr << "  --temperature <t>  sample at temperature <t>" << std::endl;
+    std::cerr << "  --priority <p>     served before lower priorities, -128 to 127" << std::endl;
+    std::cerr << "  --deadline-ms <ms> give up unless answering starts within <ms>" << std::endl;
+    std::cerr << "  --batch            answer each line of stdin over one connection," << std::endl;
+    std::cerr << "                     printing one JSON object per line as they finish" << std::endl;
     std::cerr << "Example: " << program << " \"What is the capital of France?\"" << std::endl;
 }
 
@@ -30,6 +49,83 @@ bool ensure_daemon_running() {
     return daemon_manager.ensure_running();
 }
 
+std::string json_string(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// Answer every line of stdin as its own prompt over one connection
+int run_batch(const llx_query_options& options) {
+    std::vector<std::string> prompts;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (!line.empty()) {
+            prompts.push_back(line);
+        }
+    }
+    if (prompts.empty()) {
+        std::cerr << "Error: No prompts on stdin" << std::endl;
+        return 1;
+    }
+
+    if (!ensure_daemon_running()) {
+        std::cerr << "Failed to start daemon" << std::endl;
+        return 1;
+    }
+    if (!options.model.empty() && !DaemonManager().ensure_model(options.model)) {
+        return 1;
+    }
+
+    llx client;
+    if (!client.connect()) {
+        std::cerr << "Failed to connect to llxd" << std::endl;
+        return 1;
+    }
+
+    int n_failed = 0;
+    bool success = client.batch(prompts, [&](size_t index, const llx_result& result) {
+        if (result.finish_reason != "stop" && result.finish_reason != "eos" && result.finish_reason != "length") {
+            n_failed++;
+        }
+        std::cout << "{\"index\":" << index
+                  << ",\"prompt\":" << json_string(prompts[index])
+                  << ",\"text\":" << json_string(result.text)
+                  << ",\"finish_reason\":" << json_string(result.finish_reason);
+        if (!result.error.empty()) {
+            std::cout << ",\"error\":" << json_string(result.error);
+        }
+        std::cout << ",\"prompt_tokens\":" << result.prompt_tokens
+                  << ",\"cached_tokens\":" << result.cached_tokens
+                  << ",\"generated_tokens\":" << result.generated_tokens
+                  << ",\"ttft_ms\":" << result.t_first_token
+                  << ",\"total_ms\":" << result.t_total
+                  << ",\"from_cache\":" << (result.from_cache ? "true" : "false") << "}" << std::endl;
+    }, options);
+
+    if (!success) {
+        std::cerr << "Failed to get responses from llxd" << std::endl;
+        return 1;
+    }
+    return n_failed > 0 ? 1 : 0;
+}
+
 int main(int argc, char** argv) {
     // Handle version flag
     if (argc == 2 && std::string(argv[1]) == "--version") {
@@ -52,16 +148,101 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    // Validate no flags with prompt
-    if (argc >= 2 && argv[1][0] == '-') {
-        std::cerr << "Error: Unknown flag '" << argv[1] << "'" << std::endl;
-        print_usage(argv[0]);
-        return 1;
+    // Handle models flag
+    if (argc == 2 && std::string(argv[1]) == "--models") {
+        llx client;
+        if (!client.connect()) {
+            std::cerr << "Failed to connect to llxd. Make sure the daemon is running." << std::endl;
+            return 1;
+        }
+        return client.models() ? 0 : 1;
+    }
+
+    // Handle stats flag, a JSON snapshot for scraping
+    if (argc == 2 && std::string(argv[1]) == "--stats") {
+        llx client;
+        if (!client.connect()) {
+            std::cerr << "Failed to connect to llxd. Make sure the daemon is running." << std::endl;
+            return 1;
+        }
+        return client.stats() ? 0 : 1;
+    }
+
+    // Handle trace flag, the dump opens in chrome://tracing or Perfetto
+    if ((argc == 2 || argc == 3) && std::string(argv[1]) == "--trace") {
+        llx client;
+        if (!client.connect()) {
+            std::cerr << "Failed to connect to llxd. Make sure the daemon is running." << std::endl;
+            return 1;
+        }
+        return client.trace(argc == 3 ? argv[2] : "") ? 0 : 1;
+    }
+
+    // Handle swap flag, the daemon keeps serving while the model loads
+    if (argc == 3 && std::string(argv[1]) == "--swap") {
+        llx client;
+        if (!client.connect()) {
+            std::cerr << "Failed to connect to llxd. Make sure the daemon is running." << std::endl;
+            return 1;
+        }
+
+        // The daemon runs elsewhere, send it an absolute path
+        std::string model = argv[2];
+        size_t eq = model.find('=');
+        size_t path_start = eq != std::string::npos && eq < model.find('/') ? eq + 1 : 0;
+        model = model.substr(0, path_start) + std::filesystem::absolute(model.substr(path_start)).string();
+        return client.swap(model) ? 0 : 1;
+    }
+
+    // Query options come before the prompt
+    llx_query_options options;
+    bool batch = false;
+    int arg_index = 1;
+    while (arg_index < argc && argv[arg_index][0] == '-') {
+        std::string arg = argv[arg_index];
+        if (arg == "--batch") {
+            batch = true;
+            arg_index++;
+        } else if (arg == "--max-tokens" && arg_index + 1 < argc) {
+            options.max_tokens = std::atoi(argv[arg_index + 1]);
+            arg_index += 2;
+        } else if (arg == "--temperature" && arg_index + 1 < argc) {
+            options.temperature = std::atof(argv[arg_index + 1]);
+            arg_index += 2;
+        } else if (arg == "--priority" && arg_index + 1 < argc) {
+            options.priority = std::atoi(argv[arg_index + 1]);
+            arg_index += 2;
+        } else if (arg == "--deadline-ms" && arg_index + 1 < argc) {
+            options.deadline_ms = std::atoi(argv[arg_index + 1]);
+            arg_index += 2;
+        } else if (arg == "--no-stop") {
+            options.stop_at_code_block = false;
+            arg_index++;
+        } else if (arg == "--stop" && arg_index + 1 < argc) {
+            options.stop.push_back(argv[arg_index + 1]);
+            arg_index += 2;
+        } else if (arg == "--model" && arg_index + 1 < argc) {
+            options.model = argv[arg_index + 1];
+            arg_index += 2;
+        } else {
+            std::cerr << "Error: Unknown flag '" << arg << "'" << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    const int n_args = argc - arg_index;
+
+    if (batch) {
+        if (n_args != 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_batch(options);
     }
 
     std::string prompt;
 
-    if (argc == 1) {
+    if (n_args == 0) {
         // Multi-line input mode
         std::cout << "Enter your prompt (terminate with two blank lines):" << std::endl;
         std::string line;
@@ -85,8 +266,8 @@ int main(int argc, char** argv) {
         while (!prompt.empty() && prompt.back() == '\n') {
             prompt.pop_back();
         }
-    } else if (argc == 2) {
-        prompt = argv[1];
+    } else if (n_args == 1) {
+        prompt = argv[arg_index];
     } else {
         print_usage(argv[0]);
         return 1;
@@ -103,6 +284,11 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    // The daemon loads other models by id from the shared models directory
+    if (!options.model.empty() && !DaemonManager().ensure_model(options.model)) {
+        return 1;
+    }
+
     llx client;
     if (!client.connect()) {
         std::cerr << "Failed to connect to llxd" << std::endl;
@@ -196,7 +382,7 @@ int main(int argc, char** argv) {
             buffer.clear();
             std::cout << std::flush;
         }
-    });
+    }, options);
 
     if (!success) {
         std::cerr << "Failed to get response from llxd" << std::endl;
@@ -0,0 +1,233 @@
+#include "context_pool.h"
+#include "common/sampling.h"
+#include "common/speculative.h"
+#include "common/common.h"
+#include "logging.h"
+
+#include <vector>
+#include <mutex>
+
+static const char* const LOG_CATEGORY = "context_pool";
+
+class ContextPool::Impl {
+public:
+    Impl(llama_model* model,
+         const llama_context_params& ctx_params,
+         const common_params_sampling& sampling_params,
+         size_t n_slots)
+        : model_(model)
+        , ctx_params_(ctx_params)
+        , sampling_params_(sampling_params)
+        , size_(n_slots) {}
+
+    ~Impl() {
+        free_drafts();
+        for (auto& slot : slots_) {
+            if (slot.sampler) {
+                common_sampler_free(slot.sampler);
+            }
+        }
+        if (pristine_) {
+            common_sampler_free(pristine_);
+        }
+        if (ctx_) {
+            llama_free(ctx_);
+        }
+    }
+
+    bool init() {
+        // One sequence per slot plus the shared prefix
+        ctx_params_.n_seq_max = size_ + 1;
+        ctx_ = llama_init_from_model(model_, ctx_params_);
+        if (!ctx_) {
+            LOG_ERROR("Failed to create pooled context");
+            return false;
+        }
+
+        if (!sampling_params_.grammar.empty()) {
+            pristine_ = common_sampler_init(model_, sampling_params_);
+            if (!pristine_) {
+                LOG_ERROR("Failed to compile sampling grammar");
+                return false;
+            }
+        }
+
+        slots_.resize(size_);
+        for (size_t i = 0; i < size_; i++) {
+            slots_[i].seq_id = PREFIX_SEQ + 1 + i;
+            slots_[i].sampler = new_sampler();
+            if (!slots_[i].sampler) {
+                LOG_ERROR("Failed to initialize pooled sampler " << i);
+                return false;
+            }
+
+            free_.push_back(i);
+        }
+
+        if (draft_model_ && !init_drafts()) {
+            LOG_WARN("Draft model is not compatible with the target, speculative decoding disabled");
+            free_drafts();
+        }
+        return true;
+    }
+
+    bool init_drafts() {
+        for (auto& slot : slots_) {
+            slot.ctx_dft = llama_init_from_model(draft_model_, draft_ctx_params_);
+            if (!slot.ctx_dft || !common_speculative_are_compatible(ctx_, slot.ctx_dft)) {
+                return false;
+            }
+            slot.spec = common_speculative_init(slot.ctx_dft);
+            if (!slot.spec) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void free_drafts() {
+        for (auto& slot : slots_) {
+            if (slot.spec) {
+                common_speculative_free(slot.spec);
+                slot.spec = nullptr;
+            }
+            if (slot.ctx_dft) {
+                llama_free(slot.ctx_dft);
+                slot.ctx_dft = nullptr;
+            }
+        }
+        draft_model_ = nullptr;
+    }
+
+    common_sampler* new_sampler() {
+        return pristine_ ? common_sampler_clone(pristine_) : common_sampler_init(model_, sampling_params_);
+    }
+
+    bool try_acquire(size_t& index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            return false;
+        }
+        index = free_.back();
+        free_.pop_back();
+        return true;
+    }
+
+    void release(size_t index) {
+        // Reset state outside the lock, nobody else can touch a leased slot
+        llama_kv_cache_seq_rm(ctx_, slots_[index].seq_id, -1, -1);
+        if (pristine_) {
+            common_sampler_free(slots_[index].sampler);
+            slots_[index].sampler = common_sampler_clone(pristine_);
+        } else {
+            common_sampler_reset(slots_[index].sampler);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        free_.push_back(index);
+    }
+
+    llama_model* model_;
+    llama_context_params ctx_params_;
+    common_params_sampling sampling_params_;
+    size_t size_;
+
+    llama_model* draft_model_ = nullptr;
+    llama_context_params draft_ctx_params_ = {};
+
+    llama_context* ctx_ = nullptr;
+    common_sampler* pristine_ = nullptr;     // Compiled grammar, cloned per lease
+    std::vector<PooledSlot> slots_;
+    std::vector<size_t> free_;
+    mutable std::mutex mutex_;
+};
+
+ContextPool::ContextPool(llama_model* model,
+                         const llama_context_params& ctx_params,
+                         const common_params_sampling& sampling_params,
+                         size_t n_slots)
+    : impl(std::make_unique<Impl>(model, ctx_params, sampling_params, n_slots)) {}
+
+ContextPool::~ContextPool() = default;
+
+void ContextPool::enable_draft(llama_model* draft_model, const llama_context_params& draft_ctx_params) {
+    impl->draft_model_ = draft_model;
+    impl->draft_ctx_params_ = draft_ctx_params;
+    impl->draft_ctx_params_.n_seq_max = 1;
+}
+
+bool ContextPool::init() {
+    return impl->init();
+}
+
+ContextPool::Lease ContextPool::try_acquire() {
+    size_t index = 0;
+    if (!impl->try_acquire(index)) {
+        return Lease();
+    }
+    return Lease(this, index);
+}
+
+llama_context* ContextPool::ctx() const {
+    return impl->ctx_;
+}
+
+bool ContextPool::has_draft() const {
+    return impl->draft_model_ != nullptr;
+}
+
+size_t ContextPool::size() const {
+    return impl->size_;
+}
+
+size_t ContextPool::n_free() const {
+    std::unique_lock<std::mutex> lock(impl->mutex_);
+    return impl->free_.size();
+}
+
+void ContextPool::release(size_t index) {
+    impl->release(index);
+}
+
+ContextPool::Lease::Lease(ContextPool* pool, size_t index)
+    : pool_(pool)
+    , index_(index) {}
+
+ContextPool::Lease::Lease(Lease&& other) noexcept
+    : pool_(other.pool_)
+    , index_(other.index_) {
+    other.pool_ = nullptr;
+}
+
+ContextPool::Lease& ContextPool::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        index_ = other.index_;
+        other.pool_ = nullptr;
+    }
+    return *this;
+}
+
+ContextPool::Lease::~Lease() {
+    release();
+}
+
+llama_seq_id ContextPool::Lease::seq_id() const {
+    return pool_ ? pool_->impl->slots_[index_].seq_id : -1;
+}
+
+common_sampler* ContextPool::Lease::sampler() const {
+    return pool_ ? pool_->impl->slots_[index_].sampler : nullptr;
+}
+
+common_speculative* ContextPool::Lease::spec() const {
+    return pool_ ? pool_->impl->slots_[index_].spec : nullptr;
+}
+
+void ContextPool::Lease::release() {
+    if (pool_) {
+        pool_->release(index_);
+        pool_ = nullptr;
+    }
+}
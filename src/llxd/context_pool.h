@@ -0,0 +1,97 @@
+#ifndef LLXD_CONTEXT_POOL_H
+#define LLXD_CONTEXT_POOL_H
+
+#include "llama.h"
+
+#include <memory>
+
+struct common_sampler;
+struct common_params_sampling;
+struct common_speculative;
+
+// Sequence layout of the pooled context: the shared system-prompt prefix
+// stays resident on PREFIX_SEQ and slot i decodes on sequence i + 1
+constexpr llama_seq_id PREFIX_SEQ = 0;
+
+// A sequence of the shared context together with its warm sampler chain
+// and, with a draft model, its own draft context
+struct PooledSlot {
+    llama_seq_id seq_id = -1;
+    common_sampler* sampler = nullptr;
+    llama_context* ctx_dft = nullptr;
+    common_speculative* spec = nullptr;
+};
+
+// Warm llama_context created once at daemon start and shared by a fixed
+// number of request slots, one sequence id each. Requests lease a slot,
+// and on return its KV cells are removed and its sampler reset so the
+// next lease starts from a clean state while the prefix is kept.
+//
+// With a grammar in the sampling params the grammar is compiled once into
+// a pristine sampler, and slots get clones of it instead of a reset, which
+// would parse the grammar again.
+//
+// With a draft model every slot also gets a small draft context for
+// speculative decoding. It is kept across leases, the speculative state
+// reuses whatever prefix of the previous request's tokens still matches.
+class ContextPool {
+public:
+    // RAII lease handle, returns the slot to the pool when destroyed
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(ContextPool* pool, size_t index);
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease();
+
+        llama_seq_id seq_id() const;
+        common_sampler* sampler() const;
+
+        // Draft state, nullptr without a draft model
+        common_speculative* spec() const;
+
+        explicit operator bool() const { return pool_ != nullptr; }
+
+    private:
+        void release();
+
+        ContextPool* pool_ = nullptr;
+        size_t index_ = 0;
+    };
+
+    ContextPool(llama_model* model,
+                const llama_context_params& ctx_params,
+                const common_params_sampling& sampling_params,
+                size_t n_slots);
+    ~ContextPool();
+
+    // Give every slot a draft context on draft_model, call before init()
+    void enable_draft(llama_model* draft_model, const llama_context_params& draft_ctx_params);
+
+    // Create the context and slot samplers, returns false if any failed.
+    // A draft model that does not match the target is dropped with a warning.
+    bool init();
+
+    // Lease a slot if one is free, otherwise return an empty lease
+    Lease try_acquire();
+
+    // The shared context
+    llama_context* ctx() const;
+
+    // Whether slots carry draft state
+    bool has_draft() const;
+
+    size_t size() const;
+    size_t n_free() const;
+
+private:
+    void release(size_t index);
+
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // LLXD_CONTEXT_POOL_H
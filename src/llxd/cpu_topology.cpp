@@ -0,0 +1,223 @@
+#include "cpu_topology.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <thread>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#else
+#include <sched.h>
+#endif
+
+namespace {
+
+#ifdef __APPLE__
+
+int sysctl_int(const char* name) {
+    int value = 0;
+    size_t size = sizeof(value);
+    if (sysctlbyname(name, &value, &size, nullptr, 0) != 0) {
+        return 0;
+    }
+    return value;
+}
+
+#else
+
+bool read_int(const std::string& path, int& value) {
+    std::ifstream file(path);
+    return static_cast<bool>(file >> value);
+}
+
+// Expand a sysfs CPU list such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first = 0;
+        int last = 0;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n == 1) {
+            last = first;
+        } else if (n != 2) {
+            continue;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Cores allowed by one cgroup v2 cpu.max, "max 100000" or "<quota> <period>"
+double read_cpu_max(const std::string& path) {
+    std::ifstream file(path);
+    std::string quota;
+    double period = 0;
+    if (!(file >> quota >> period) || quota == "max" || period <= 0) {
+        return 0;
+    }
+    return std::strtod(quota.c_str(), nullptr) / period;
+}
+
+// The tightest quota on the way from our cgroup up to the root, limits
+// set by parents apply too. 0 when there is none.
+double read_cgroup_quota() {
+    double quota = 0;
+    auto tighten = [&quota](double limit) {
+        if (limit > 0 && (quota == 0 || limit < quota)) {
+            quota = limit;
+        }
+    };
+
+    // cgroup v2, the process's own group is the "0::" line
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroups, line)) {
+        if (line.compare(0, 3, "0::") != 0) {
+            continue;
+        }
+        std::string group = line.substr(3);
+        while (true) {
+            tighten(read_cpu_max("/sys/fs/cgroup" + group + "/cpu.max"));
+            size_t slash = group.find_last_of('/');
+            if (slash == std::string::npos || group.size() <= 1) {
+                break;
+            }
+            group = slash == 0 ? "/" : group.substr(0, slash);
+        }
+    }
+    // Inside a container the group is usually mounted as the root
+    tighten(read_cpu_max("/sys/fs/cgroup/cpu.max"));
+
+    // cgroup v1
+    for (const char* dir : { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" }) {
+        int cfs_quota = 0;
+        int cfs_period = 0;
+        if (read_int(std::string(dir) + "/cpu.cfs_quota_us", cfs_quota) &&
+            read_int(std::string(dir) + "/cpu.cfs_period_us", cfs_period) && cfs_quota > 0 && cfs_period > 0) {
+            tighten(static_cast<double>(cfs_quota) / cfs_period);
+        }
+    }
+    return quota;
+}
+
+#endif
+
+} // namespace
+
+int CpuTopology::usable_cores() const {
+    int n = n_physical;
+    if (cpu_quota > 0) {
+        // Threads beyond the quota get throttled while the others wait
+        // for them at every barrier
+        n = std::min(n, static_cast<int>(std::floor(cpu_quota)));
+    }
+    return std::max(1, n);
+}
+
+std::string CpuTopology::summary() const {
+    std::ostringstream out;
+    out << n_physical << (n_physical == 1 ? " core (" : " cores (") << n_logical << " logical) on " << n_numa_nodes << " NUMA node"
+        << (n_numa_nodes == 1 ? "" : "s");
+    if (cpu_quota > 0) {
+        out << ", quota " << cpu_quota << " cores";
+    }
+    return out.str();
+}
+
+CpuTopology detect_cpu_topology() {
+    CpuTopology topology;
+
+#ifdef __APPLE__
+    topology.n_logical = std::max(1, sysctl_int("hw.logicalcpu"));
+    int n_performance = sysctl_int("hw.perflevel0.physicalcpu");  // Apple silicon only
+    topology.n_physical = std::max(1, n_performance > 0 ? n_performance : sysctl_int("hw.physicalcpu"));
+    topology.n_first_node = topology.n_physical;
+#else
+    std::vector<int> allowed;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &mask)) {
+                allowed.push_back(cpu);
+            }
+        }
+    }
+    if (allowed.empty()) {
+        for (int cpu = 0; cpu < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); cpu++) {
+            allowed.push_back(cpu);
+        }
+    }
+    topology.n_logical = static_cast<int>(allowed.size());
+
+    // NUMA node of every CPU, all on node 0 without sysfs nodes
+    std::map<int, int> node_of;
+    for (int node = 0;; node++) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list)) {
+            break;
+        }
+        for (int cpu : parse_cpu_list(list)) {
+            node_of[cpu] = node;
+        }
+    }
+
+    // SMT siblings share a package and core id, the lowest numbered
+    // sibling stands for the core
+    std::map<std::tuple<int, int, int>, int> core_cpu;   // (node, package, core) -> CPU
+    for (int cpu : allowed) {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        int package = 0;
+        int core = cpu;     // Without sysfs every CPU is its own core
+        read_int(dir + "physical_package_id", package);
+        read_int(dir + "core_id", core);
+        const int node = node_of.count(cpu) ? node_of[cpu] : 0;
+        core_cpu.emplace(std::make_tuple(node, package, core), cpu);
+    }
+
+    std::vector<std::pair<int, int>> cores;     // (node, CPU)
+    for (const auto& entry : core_cpu) {
+        cores.emplace_back(std::get<0>(entry.first), entry.second);
+    }
+    std::sort(cores.begin(), cores.end());
+    for (const auto& core : cores) {
+        topology.cores.push_back(core.second);
+    }
+    topology.n_physical = std::max(1, static_cast<int>(cores.size()));
+
+    topology.n_numa_nodes = 0;
+    topology.n_first_node = 0;
+    for (size_t i = 0; i < cores.size(); i++) {
+        if (i == 0 || cores[i].first != cores[i - 1].first) {
+            topology.n_numa_nodes++;
+        }
+        if (cores[i].first == cores[0].first) {
+            topology.n_first_node++;
+        }
+    }
+    topology.n_numa_nodes = std::max(1, topology.n_numa_nodes);
+    topology.n_first_node = std::max(1, topology.n_first_node);
+
+    topology.cpu_quota = read_cgroup_quota();
+#endif
+
+    return topology;
+}
+
+ThreadPlan default_thread_plan(const CpuTopology& topology) {
+    ThreadPlan plan;
+    plan.n_threads_batch = topology.usable_cores();
+    plan.n_threads = std::min(plan.n_threads_batch, topology.n_first_node);
+    return plan;
+}
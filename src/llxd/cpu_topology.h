@@ -0,0 +1,43 @@
+#ifndef LLXD_CPU_TOPOLOGY_H
+#define LLXD_CPU_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+// CPUs the daemon may run on, as the host and its cgroup see them.
+//
+// On Linux the affinity mask, sysfs core and NUMA node lists and the
+// cgroup CPU quota (v2 cpu.max or v1 cfs) are read. On macOS the
+// performance cores are counted, efficiency cores only slow down the
+// barriers between a decode's threads.
+struct CpuTopology {
+    int n_logical = 1;          // CPUs in the affinity mask
+    int n_physical = 1;         // Cores among them, SMT siblings counted once
+    int n_numa_nodes = 1;       // Nodes those cores are on
+    int n_first_node = 1;       // Cores on the first of them
+    double cpu_quota = 0;       // cgroup CPU limit in cores, 0 for none
+
+    // One CPU per core, first node first, empty where threads cannot be
+    // pinned
+    std::vector<int> cores;
+
+    // Cores worth a thread, capped by the quota
+    int usable_cores() const;
+
+    // One line for logs, also identifies the host's shape in file names
+    std::string summary() const;
+};
+
+CpuTopology detect_cpu_topology();
+
+// Inference threads for prompt prefill, which is compute bound and scales
+// with cores, and for decode steps, which are memory bound and run best
+// within one NUMA node
+struct ThreadPlan {
+    int n_threads = 1;          // Decode
+    int n_threads_batch = 1;    // Prefill
+};
+
+ThreadPlan default_thread_plan(const CpuTopology& topology);
+
+#endif // LLXD_CPU_TOPOLOGY_H
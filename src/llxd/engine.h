@@ -0,0 +1,173 @@
+#ifndef LLXD_ENGINE_H
+#define LLXD_ENGINE_H
+
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Model side of a scheduler: the chat template and vocabulary, and a
+// fixed number of sequences of one shared context that are prefilled,
+// stepped in batches and sampled.
+//
+// The scheduler keeps queueing, admission, stop sequences and streaming
+// to itself and drives the engine one step at a time. Every sequence
+// starts from the resident prefix, gets prompt chunks and sampled tokens
+// added to the shared batch, and after each decode the sequences that
+// need a token are sampled and their pieces detokenized.
+//
+// LlamaEngine runs a model with llama.cpp. MockEngine replays a scripted
+// answer at a configured pace, so the daemon's own overhead can be
+// measured without a model.
+class Engine {
+public:
+    // RAII lease of one sequence, returned to the engine when destroyed
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Engine* engine, llama_seq_id seq_id)
+            : engine_(engine)
+            , seq_id_(seq_id) {}
+        Lease(Lease&& other) noexcept
+            : engine_(other.engine_)
+            , seq_id_(other.seq_id_) {
+            other.engine_ = nullptr;
+        }
+        Lease& operator=(Lease&& other) noexcept {
+            if (this != &other) {
+                release();
+                engine_ = other.engine_;
+                seq_id_ = other.seq_id_;
+                other.engine_ = nullptr;
+            }
+            return *this;
+        }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() {
+            release();
+        }
+
+        llama_seq_id seq_id() const { return engine_ ? seq_id_ : -1; }
+
+        explicit operator bool() const { return engine_ != nullptr; }
+
+    private:
+        void release() {
+            if (engine_) {
+                engine_->release(seq_id_);
+                engine_ = nullptr;
+            }
+        }
+
+        Engine* engine_ = nullptr;
+        llama_seq_id seq_id_ = -1;
+    };
+
+    virtual ~Engine() = default;
+
+    // Create the shared context with n_seq request sequences
+    virtual bool init(int n_seq) = 0;
+
+    // Prefill the formatted system prompt every sequence starts from
+    virtual bool prefill_prefix(const std::string& text) = 0;
+
+    // The resident prefix and its tokens (including BOS)
+    virtual const std::string& prefix_text() const = 0;
+    virtual const std::vector<llama_token>& prefix_tokens() const = 0;
+
+    // Hash of the engine settings that shape a response, the model and
+    // sampling parameters, for response cache keys
+    virtual uint64_t fingerprint() const = 0;
+
+    // Default sampling temperature
+    virtual float temperature() const = 0;
+
+    // Render messages with the chat template
+    virtual bool format_chat(const std::vector<llama_chat_message>& messages, bool add_ass,
+                             std::string& out) const = 0;
+
+    virtual std::vector<llama_token> tokenize(const std::string& text, bool add_special) const = 0;
+    virtual std::string detokenize(llama_token token) const = 0;
+    virtual bool is_eog(llama_token token) const = 0;
+    virtual bool is_bos(llama_token token) const = 0;
+
+    // Lease a sequence if one is free, otherwise return an empty lease
+    Lease try_acquire() {
+        llama_seq_id seq_id = acquire();
+        return seq_id < 0 ? Lease() : Lease(this, seq_id);
+    }
+
+    // KV cells one sequence may fill besides the prefix cells it shares.
+    // Prompt and response must fit, or the shared cache runs out for all.
+    virtual int n_seq_cells() const = 0;
+
+    // Request sequences, and how many are not leased. n_free() may be
+    // called from any thread, everything else from the scheduler thread.
+    virtual size_t n_seq() const = 0;
+    virtual size_t n_free() const = 0;
+
+    // Start a request on a leased sequence, sampling at temperature, or
+    // the default when it is negative
+    virtual bool begin(llama_seq_id seq_id, float temperature) = 0;
+
+    // Drop the sequence's cells, then copy the prefix cells into it if asked
+    virtual void seq_reset(llama_seq_id seq_id, bool with_prefix) = 0;
+
+    // Drop the sequence's cells from position pos on
+    virtual void seq_truncate(llama_seq_id seq_id, llama_pos pos) = 0;
+
+    // Building and decoding the shared batch
+    virtual int n_batch() const = 0;
+    virtual int batch_size() const = 0;
+    virtual void batch_clear() = 0;
+    virtual void batch_add(llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) = 0;
+
+    // 0 on success, 2 when the abort callback stopped it, else an error
+    virtual int decode() = 0;
+
+    // Polled while a batch decodes, returning true aborts the decode
+    virtual void set_abort_callback(bool (*callback)(void* user_data), void* user_data) = 0;
+
+    // Sample the token at output i_batch, and accept one that is kept
+    virtual llama_token sample(llama_seq_id seq_id, int i_batch) = 0;
+    virtual void accept(llama_seq_id seq_id, llama_token token) = 0;
+
+    // Verify draft tokens decoded at outputs idxs, returns the accepted
+    // ones followed by one sampled past them, all of them accepted
+    virtual std::vector<llama_token> sample_and_accept_n(llama_seq_id seq_id, const std::vector<int>& idxs,
+                                                         const std::vector<llama_token>& draft) = 0;
+
+    // Whether draft() proposes anything
+    virtual bool has_drafts() const { return false; }
+
+    // Propose up to n_max tokens to follow history, which ends with the
+    // token about to be decoded. history is not modified, it is non-const
+    // because the llama.cpp n-gram functions take it that way.
+    virtual std::vector<llama_token> draft(llama_seq_id seq_id, std::vector<llama_token>& history, int n_max) {
+        (void)seq_id;
+        (void)history;
+        (void)n_max;
+        return {};
+    }
+
+    // The sequence's history was rewound, forget what draft() learned from it
+    virtual void reset_draft(llama_seq_id seq_id) { (void)seq_id; }
+
+    // A request ended with history, the response starts at n_prompt
+    virtual void on_response(std::vector<llama_token>& history, size_t n_prompt) {
+        (void)history;
+        (void)n_prompt;
+    }
+
+    // Persist state for the next start, called once the loop has stopped
+    virtual void save() {}
+
+protected:
+    // Sequence id of a free sequence, or -1
+    virtual llama_seq_id acquire() = 0;
+    virtual void release(llama_seq_id seq_id) = 0;
+};
+
+#endif // LLXD_ENGINE_H
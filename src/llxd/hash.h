@@ -0,0 +1,58 @@
+#ifndef LLXD_HASH_H
+#define LLXD_HASH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+namespace llxd_hash {
+
+constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+// 64-bit FNV-1a, chainable through the seed argument
+inline uint64_t fnv1a(const void* data, size_t len, uint64_t hash = FNV_OFFSET) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a(const std::string& s, uint64_t hash = FNV_OFFSET) {
+    return fnv1a(s.data(), s.size(), hash);
+}
+
+// Identify a model file without reading all of its weights: the file size
+// plus the leading GGUF header, metadata and tensor table
+inline uint64_t model_fingerprint(const std::string& path) {
+    constexpr size_t HEADER_BYTES = 4 * 1024 * 1024;
+
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return 0;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> header(std::min<uint64_t>(size, HEADER_BYTES));
+    file.read(header.data(), header.size());
+
+    uint64_t hash = fnv1a(&size, sizeof(size));
+    return fnv1a(header.data(), static_cast<size_t>(file.gcount()), hash);
+}
+
+inline std::string to_hex(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(value));
+    return buf;
+}
+
+} // namespace llxd_hash
+
+#endif // LLXD_HASH_H
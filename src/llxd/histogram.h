@@ -0,0 +1,116 @@
+#ifndef LLXD_HISTOGRAM_H
+#define LLXD_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <atomic>
+#include <array>
+#include <algorithm>
+
+// Histogram of non-negative integer samples with lock-free recording.
+//
+// Buckets are log-linear like HdrHistogram: every power of two is split
+// into SUB_BUCKETS equal buckets, so values below SUB_BUCKETS are exact and
+// percentiles of larger ones are within 1/SUB_BUCKETS of the truth. Each
+// record is a handful of relaxed atomic adds, any thread may record while
+// another reads. Reads are not a consistent snapshot, counts recorded
+// meanwhile may or may not show up.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;   // ~6% resolution
+    static constexpr int MAX_BITS = 40;                 // Larger values land in the last bucket
+    static constexpr int N_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    // Summary read from the buckets
+    struct Summary {
+        uint64_t count = 0;
+        double mean = 0;
+        uint64_t p50 = 0;
+        uint64_t p95 = 0;
+        uint64_t p99 = 0;
+        uint64_t max = 0;
+    };
+
+    void record(uint64_t value, uint64_t count = 1) {
+        if (count == 0) {
+            return;
+        }
+        buckets_[bucket_of(value)].fetch_add(count, std::memory_order_relaxed);
+        count_.fetch_add(count, std::memory_order_relaxed);
+        sum_.fetch_add(value * count, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    Summary summary() const {
+        std::array<uint64_t, N_BUCKETS> counts;
+        uint64_t total = 0;
+        for (int i = 0; i < N_BUCKETS; i++) {
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+
+        Summary summary;
+        summary.count = total;
+        if (total == 0) {
+            return summary;
+        }
+        summary.max = max_.load(std::memory_order_relaxed);
+        summary.mean = static_cast<double>(sum_.load(std::memory_order_relaxed)) / count();
+        summary.p50 = percentile(counts, total, 50.0, summary.max);
+        summary.p95 = percentile(counts, total, 95.0, summary.max);
+        summary.p99 = percentile(counts, total, 99.0, summary.max);
+        return summary;
+    }
+
+    static int bucket_of(uint64_t value) {
+        if (value < static_cast<uint64_t>(SUB_BUCKETS)) {
+            return static_cast<int>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        if (msb >= MAX_BITS) {
+            return N_BUCKETS - 1;
+        }
+        int shift = msb - SUB_BITS;
+        int sub = static_cast<int>(value >> shift) - SUB_BUCKETS;
+        return (shift + 1) * SUB_BUCKETS + sub;
+    }
+
+    // Largest value that lands in bucket
+    static uint64_t bucket_high(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        int shift = bucket / SUB_BUCKETS - 1;
+        uint64_t low = static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+        return low + (uint64_t(1) << shift) - 1;
+    }
+
+private:
+    static uint64_t percentile(const std::array<uint64_t, N_BUCKETS>& counts, uint64_t total, double p,
+                               uint64_t max) {
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100.0 * total)));
+        uint64_t seen = 0;
+        for (int i = 0; i < N_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(bucket_high(i), max);
+            }
+        }
+        return max;
+    }
+
+    std::array<std::atomic<uint64_t>, N_BUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{ 0 };
+    std::atomic<uint64_t> sum_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+};
+
+#endif // LLXD_HISTOGRAM_H
@@ -0,0 +1,610 @@
+#include "llama_engine.h"
+#include "context_pool.h"
+#include "prefix_cache.h"
+#include "hash.h"
+#include "common/sampling.h"
+#include "common/speculative.h"
+#include "common/ngram-cache.h"
+#include "common/common.h"
+#include "llama-chat.h"
+#include "prompts.h"
+#include "logging.h"
+#include "trace.h"
+#include "ggml-cpu.h"
+
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+static const char* const LOG_CATEGORY = "engine";
+
+// KV cells of the shared context per sequence, the prefix has its own share
+static const int SEQ_N_CTX = 1024;
+
+// Draft context size, fits the system prompt, a prompt and a response
+static const int DRAFT_N_CTX = 2048;
+
+// Autotune workload per thread count: one prompt chunk, then single-token
+// decode steps
+static const int AUTOTUNE_PROMPT_TOKENS = 256;
+static const int AUTOTUNE_DECODE_STEPS = 32;
+
+namespace {
+
+class LlamaEngine : public Engine {
+public:
+    explicit LlamaEngine(const LlamaEngineParams& params)
+        : params_(params)
+        , model_(params.model)
+        , vocab_(llama_model_get_vocab(params.model)) {}
+
+    ~LlamaEngine() override {
+        // Leases go back to the pool before it is freed
+        leases_.clear();
+        for (common_sampler* sampler : own_samplers_) {
+            if (sampler) {
+                common_sampler_free(sampler);
+            }
+        }
+        if (batch_.token) {
+            llama_batch_free(batch_);
+        }
+        prefix_cache_.reset();
+        pool_.reset();
+        if (threadpool_) {
+            ggml_threadpool_free(threadpool_);
+        }
+    }
+
+    bool init(int n_seq) override {
+        // Create the shared context up front so requests never pay for
+        // KV cache, compute buffer and thread pool allocation. The KV
+        // cache is unified, the system prompt cells are shared by all.
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = SEQ_N_CTX * (n_seq + 1); // Prefix plus room per sequence
+        ctx_params.n_batch = 512;     // Increase batch size for better throughput
+        plan_ = choose_threads();
+        ctx_params.n_threads = plan_.n_threads;
+        ctx_params.n_threads_batch = plan_.n_threads_batch;
+        ctx_params.offload_kqv = true;// Enable KQV offloading to GPU
+
+        // Setup sampling parameters for more precise responses
+        common_params_sampling& sampling_params = sampling_params_;
+        sampling_params.temp = 0.2f;          // Lower temperature for more deterministic output
+        sampling_params.top_p = 0.1f;         // More focused token selection
+        sampling_params.min_p = 0.05f;        // Slightly higher minimum probability
+        sampling_params.penalty_repeat = 1.3f; // Stronger repetition penalty
+        sampling_params.n_probs = 0;
+        sampling_params.penalty_freq = 0.0f;
+        sampling_params.penalty_present = 0.0f;
+        if (params_.constrained_output) {
+            // Compiled once by the pool, the follow-up pass is never needed
+            sampling_params.grammar = BASH_BLOCK_GRAMMAR;
+        }
+
+        pool_ = std::make_unique<ContextPool>(model_, ctx_params, sampling_params, n_seq);
+        if (params_.draft_model) {
+            // Each draft context holds one slot's full history
+            llama_context_params draft_ctx_params = ctx_params;
+            draft_ctx_params.n_ctx = DRAFT_N_CTX;
+            pool_->enable_draft(params_.draft_model, draft_ctx_params);
+        }
+        if (!pool_->init()) {
+            LOG_ERROR("Failed to create context pool");
+            return false;
+        }
+        ctx_ = pool_->ctx();
+        attach_threadpool();
+
+        if (pool_->has_draft()) {
+            DEBUG_LOG("Speculative decoding with up to " << params_.n_draft << " draft tokens per step");
+        } else if (params_.lookup) {
+            lookup_path_ = params_.model_path + ".lookup-" +
+                           llxd_hash::to_hex(llxd_hash::model_fingerprint(params_.model_path)) + ".bin";
+            load_lookup_cache();
+            DEBUG_LOG("N-gram lookup decoding with up to " << params_.n_draft << " draft tokens per step, "
+                      << nc_dynamic_.size() << " n-grams from " << lookup_path_);
+        }
+        DEBUG_LOG("Created shared context with " << n_seq << " slots, n_ctx " << llama_n_ctx(ctx_)
+                  << (params_.constrained_output ? ", grammar-constrained output" : ""));
+
+        // Sequence ids are 1..n_seq, PREFIX_SEQ holds the prefix
+        leases_.resize(n_seq + 1);
+        own_samplers_.resize(n_seq + 1, nullptr);
+        lookup_.resize(n_seq + 1);
+
+        // Detect chat template once per model
+        std::string model_template;
+        const char* raw_template = llama_model_chat_template(model_, "chatml");  // Use ChatML as default template
+        if (raw_template != nullptr) {
+            model_template = raw_template;
+        }
+
+        // Default to LLama3 if no template or unknown
+        if (!model_template.empty()) {
+            llxd_trace::Span span("detect template");
+            try {
+                chat_template_ = llm_chat_detect_template(model_template);
+                if (chat_template_ == LLM_CHAT_TEMPLATE_UNKNOWN) {
+                    DEBUG_LOG("Unknown chat template, defaulting to LLama3");
+                    chat_template_ = LLM_CHAT_TEMPLATE_LLAMA_3;
+                }
+            } catch (const std::exception& e) {
+                DEBUG_LOG("Error detecting chat template: " << e.what() << ", defaulting to LLama3");
+                chat_template_ = LLM_CHAT_TEMPLATE_LLAMA_3;
+            }
+        }
+        DEBUG_LOG("Using chat template: " << (model_template.empty() ? "LLama3 (default)" : model_template));
+
+        batch_ = llama_batch_init(llama_n_batch(ctx_), 0, 1);
+
+        // A batch with more tokens than a step of every sequence and its
+        // drafts carries prompt chunks
+        max_step_tokens_ = n_seq * (has_drafts() ? params_.n_draft + 1 : 1);
+        if (params_.autotune) {
+            autotune();
+        }
+        LOG_INFO("Threads: " << plan_.n_threads << " decode, " << plan_.n_threads_batch << " prefill ("
+                 << threads_source_ << (threadpool_ ? ", pinned" : "") << ")");
+        return true;
+    }
+
+    bool prefill_prefix(const std::string& text) override {
+        int64_t t_start_prefix = ggml_time_us();
+        prefix_cache_ = std::make_unique<PrefixCache>(model_, params_.model_path, text);
+        if (!prefix_cache_->init(ctx_, PREFIX_SEQ)) {
+            LOG_ERROR("Failed to build system prompt cache");
+            return false;
+        }
+        DEBUG_LOG("System prompt cache ready: " << prefix_cache_->tokens().size() << " tokens, "
+                  << (prefix_cache_->loaded_from_disk() ? "loaded from " : "saved to ")
+                  << prefix_cache_->file_path() << " in " << (ggml_time_us() - t_start_prefix) / 1e3 << " ms");
+        return true;
+    }
+
+    const std::string& prefix_text() const override {
+        return prefix_cache_->text();
+    }
+
+    const std::vector<llama_token>& prefix_tokens() const override {
+        return prefix_cache_->tokens();
+    }
+
+    uint64_t fingerprint() const override {
+        uint64_t hash = llxd_hash::model_fingerprint(params_.model_path);
+        hash = llxd_hash::fnv1a(&sampling_params_.temp, sizeof(sampling_params_.temp), hash);
+        hash = llxd_hash::fnv1a(&sampling_params_.top_p, sizeof(sampling_params_.top_p), hash);
+        hash = llxd_hash::fnv1a(&sampling_params_.min_p, sizeof(sampling_params_.min_p), hash);
+        hash = llxd_hash::fnv1a(&sampling_params_.penalty_repeat, sizeof(sampling_params_.penalty_repeat), hash);
+        return llxd_hash::fnv1a(sampling_params_.grammar, hash);
+    }
+
+    float temperature() const override {
+        return sampling_params_.temp;
+    }
+
+    bool format_chat(const std::vector<llama_chat_message>& messages, bool add_ass,
+                     std::string& out) const override {
+        std::vector<const llama_chat_message*> msg_ptrs;
+        for (const auto& msg : messages) {
+            msg_ptrs.push_back(&msg);
+        }
+
+        llxd_trace::Span span("apply template");
+        out.clear();
+        return llm_chat_apply_template(chat_template_, msg_ptrs, out, add_ass) >= 0;
+    }
+
+    std::vector<llama_token> tokenize(const std::string& text, bool add_special) const override {
+        return common_tokenize(vocab_, text, add_special, true);
+    }
+
+    std::string detokenize(llama_token token) const override {
+        return common_token_to_piece(vocab_, token, true);
+    }
+
+    bool is_eog(llama_token token) const override {
+        return llama_vocab_is_eog(vocab_, token);
+    }
+
+    bool is_bos(llama_token token) const override {
+        return token == llama_vocab_bos(vocab_);
+    }
+
+    int n_seq_cells() const override {
+        return SEQ_N_CTX;
+    }
+
+    size_t n_seq() const override {
+        return pool_->size();
+    }
+
+    size_t n_free() const override {
+        return pool_->n_free();
+    }
+
+    bool begin(llama_seq_id seq_id, float temperature) override {
+        if (temperature < 0.0f || temperature == sampling_params_.temp) {
+            return true;
+        }
+        common_params_sampling sampling_params = sampling_params_;
+        sampling_params.temp = temperature;
+        own_samplers_[seq_id] = common_sampler_init(model_, sampling_params);
+        return own_samplers_[seq_id] != nullptr;
+    }
+
+    void seq_reset(llama_seq_id seq_id, bool with_prefix) override {
+        llama_kv_cache_seq_rm(ctx_, seq_id, -1, -1);
+        if (with_prefix) {
+            llama_kv_cache_seq_cp(ctx_, PREFIX_SEQ, seq_id, -1, -1);
+        }
+    }
+
+    void seq_truncate(llama_seq_id seq_id, llama_pos pos) override {
+        llama_kv_cache_seq_rm(ctx_, seq_id, pos, -1);
+    }
+
+    int n_batch() const override {
+        return llama_n_batch(ctx_);
+    }
+
+    int batch_size() const override {
+        return batch_.n_tokens;
+    }
+
+    void batch_clear() override {
+        common_batch_clear(batch_);
+    }
+
+    void batch_add(llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) override {
+        common_batch_add(batch_, token, pos, { seq_id }, logits);
+    }
+
+    int decode() override {
+        // llama.cpp would take prefill threads for any batch of more than
+        // one token, but a batched decode step is as memory bound as one
+        const int n_threads = batch_.n_tokens > max_step_tokens_ ? plan_.n_threads_batch : plan_.n_threads;
+        if (n_threads != n_threads_cur_) {
+            llama_set_n_threads(ctx_, n_threads, n_threads);
+            n_threads_cur_ = n_threads;
+        }
+        return llama_decode(ctx_, batch_);
+    }
+
+    void set_abort_callback(bool (*callback)(void* user_data), void* user_data) override {
+        llama_set_abort_callback(ctx_, callback, user_data);
+    }
+
+    llama_token sample(llama_seq_id seq_id, int i_batch) override {
+        return common_sampler_sample(sampler(seq_id), ctx_, i_batch);
+    }
+
+    void accept(llama_seq_id seq_id, llama_token token) override {
+        common_sampler_accept(sampler(seq_id), token, true);
+    }
+
+    std::vector<llama_token> sample_and_accept_n(llama_seq_id seq_id, const std::vector<int>& idxs,
+                                                 const std::vector<llama_token>& draft) override {
+        return common_sampler_sample_and_accept_n(sampler(seq_id), ctx_, idxs, draft);
+    }
+
+    bool has_drafts() const override {
+        return pool_->has_draft() || !lookup_path_.empty();
+    }
+
+    std::vector<llama_token> draft(llama_seq_id seq_id, std::vector<llama_token>& history, int n_max) override {
+        if (history.empty()) {
+            return {};
+        }
+        n_max = std::min(n_max, params_.n_draft);
+        if (common_speculative* spec = leases_[seq_id].spec()) {
+            // Propose with the draft model, which also needs room for the history
+            n_max = std::min(n_max, DRAFT_N_CTX - static_cast<int>(history.size()) - 1);
+            if (n_max < 1) {
+                return {};
+            }
+            common_speculative_params spec_params;
+            spec_params.n_draft = n_max;
+            spec_params.p_min = 0.75f;
+            llama_tokens prompt(history.begin(), history.end() - 1);
+            llama_tokens draft = common_speculative_gen_draft(spec, spec_params, prompt, history.back());
+            if (draft.size() > static_cast<size_t>(n_max)) {
+                draft.resize(n_max);
+            }
+            return draft;
+        }
+        if (lookup_path_.empty() || n_max < 1) {
+            return {};
+        }
+
+        // Index tokens added since the last step
+        LookupState& lookup = lookup_[seq_id];
+        if (history.size() > lookup.n_indexed) {
+            common_ngram_cache_update(lookup.nc_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, history,
+                                      history.size() - lookup.n_indexed, false);
+            lookup.n_indexed = history.size();
+        }
+
+        // The draft starts with the last token, which is already queued
+        llama_tokens draft(1, history.back());
+        common_ngram_cache_draft(history, draft, n_max, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                                 lookup.nc_context, nc_dynamic_, nc_static_);
+        draft.erase(draft.begin());
+        return draft;
+    }
+
+    void reset_draft(llama_seq_id seq_id) override {
+        lookup_[seq_id].nc_context.clear();
+        lookup_[seq_id].n_indexed = 0;
+    }
+
+    void on_response(std::vector<llama_token>& history, size_t n_prompt) override {
+        // Remember the n-grams of the response for future lookup drafts
+        if (!lookup_path_.empty() && history.size() > n_prompt) {
+            common_ngram_cache_update(nc_dynamic_, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, history,
+                                      history.size() - n_prompt, false);
+        }
+    }
+
+    void save() override {
+        if (!lookup_path_.empty()) {
+            save_lookup_cache();
+        }
+    }
+
+protected:
+    llama_seq_id acquire() override {
+        ContextPool::Lease lease = pool_->try_acquire();
+        if (!lease) {
+            return -1;
+        }
+        const llama_seq_id seq_id = lease.seq_id();
+        leases_[seq_id] = std::move(lease);
+        return seq_id;
+    }
+
+    void release(llama_seq_id seq_id) override {
+        if (own_samplers_[seq_id]) {
+            common_sampler_free(own_samplers_[seq_id]);
+            own_samplers_[seq_id] = nullptr;
+        }
+        reset_draft(seq_id);
+
+        // The pool drops the sequence's cells and resets its sampler
+        leases_[seq_id] = ContextPool::Lease();
+    }
+
+private:
+    // N-grams of one sequence's history, for lookup drafts
+    struct LookupState {
+        common_ngram_cache nc_context;
+        size_t n_indexed = 0;       // History tokens already in nc_context
+    };
+
+    // Requested temperature, else the lease's
+    common_sampler* sampler(llama_seq_id seq_id) const {
+        return own_samplers_[seq_id] ? own_samplers_[seq_id] : leases_[seq_id].sampler();
+    }
+
+    // Set counts win, then a saved autotune for this host and model, then
+    // the defaults for the topology
+    ThreadPlan choose_threads() {
+        char hostname[256] = {};
+        gethostname(hostname, sizeof(hostname) - 1);
+        uint64_t host_key = llxd_hash::fnv1a(params_.topology.summary(), llxd_hash::fnv1a(hostname));
+        threads_path_ = params_.model_path + ".threads-" +
+                        llxd_hash::to_hex(llxd_hash::model_fingerprint(params_.model_path)) + "-" +
+                        llxd_hash::to_hex(host_key);
+
+        ThreadPlan plan = default_thread_plan(params_.topology);
+        threads_source_ = "detected";
+        std::ifstream saved(threads_path_);
+        ThreadPlan loaded;
+        if (!params_.autotune && saved >> loaded.n_threads >> loaded.n_threads_batch &&
+            loaded.n_threads > 0 && loaded.n_threads_batch > 0) {
+            plan = loaded;
+            threads_source_ = "autotuned";
+        }
+        if (params_.n_threads > 0) {
+            plan.n_threads = params_.n_threads;
+            threads_source_ = "set";
+        }
+        if (params_.n_threads_batch > 0) {
+            plan.n_threads_batch = params_.n_threads_batch;
+            threads_source_ = "set";
+        }
+        return plan;
+    }
+
+    // Run inference threads on a pool pinned one per core, first NUMA
+    // node first. Decode steps use the pool's first threads, which ggml
+    // places on the lowest numbered CPUs of the mask.
+    void attach_threadpool() {
+        const std::vector<int>& cores = params_.topology.cores;
+        if (!params_.pin_threads || cores.empty()) {
+            return;
+        }
+
+        // Room for the autotune candidates too
+        const int n_pool = std::max({ plan_.n_threads, plan_.n_threads_batch, params_.topology.usable_cores() });
+        const int n_cores = std::min<int>({ n_pool, static_cast<int>(cores.size()), params_.topology.usable_cores() });
+        ggml_threadpool_params tp_params = ggml_threadpool_params_default(n_pool);
+        for (int i = 0; i < n_cores; i++) {
+            if (cores[i] < GGML_MAX_N_THREADS) {
+                tp_params.cpumask[cores[i]] = true;
+            }
+        }
+        tp_params.strict_cpu = true;
+
+        threadpool_ = ggml_threadpool_new(&tp_params);
+        if (!threadpool_) {
+            LOG_WARN("Failed to create pinned thread pool, threads float");
+            return;
+        }
+        llama_attach_threadpool(ctx_, threadpool_, threadpool_);
+    }
+
+    // Prefill and decode rates at n_threads on a scratch sequence, in
+    // tokens per second. Nothing is leased during init(), so any request
+    // sequence will do.
+    bool measure(int n_threads, double& prefill_rate, double& decode_rate) {
+        const llama_seq_id seq_id = PREFIX_SEQ + 1;
+        const int n_vocab = llama_vocab_n_tokens(vocab_);
+        llama_set_n_threads(ctx_, n_threads, n_threads);
+        llama_kv_cache_seq_rm(ctx_, seq_id, -1, -1);
+
+        // The cost of a token does not depend on which one it is
+        common_batch_clear(batch_);
+        for (int i = 0; i < AUTOTUNE_PROMPT_TOKENS; i++) {
+            common_batch_add(batch_, (i * 7919) % n_vocab, i, { seq_id }, i == AUTOTUNE_PROMPT_TOKENS - 1);
+        }
+        const int64_t t_start_prefill = ggml_time_us();
+        bool ok = llama_decode(ctx_, batch_) == 0;
+        llama_synchronize(ctx_);
+        const int64_t t_start_decode = ggml_time_us();
+        for (int i = 0; ok && i < AUTOTUNE_DECODE_STEPS; i++) {
+            common_batch_clear(batch_);
+            common_batch_add(batch_, (i * 7919) % n_vocab, AUTOTUNE_PROMPT_TOKENS + i, { seq_id }, true);
+            ok = llama_decode(ctx_, batch_) == 0;
+        }
+        llama_synchronize(ctx_);
+        const int64_t t_end = ggml_time_us();
+
+        llama_kv_cache_seq_rm(ctx_, seq_id, -1, -1);
+        common_batch_clear(batch_);
+        n_threads_cur_ = -1;
+        if (!ok) {
+            return false;
+        }
+        prefill_rate = AUTOTUNE_PROMPT_TOKENS * 1e6 / std::max<int64_t>(1, t_start_decode - t_start_prefill);
+        decode_rate = AUTOTUNE_DECODE_STEPS * 1e6 / std::max<int64_t>(1, t_end - t_start_decode);
+        return true;
+    }
+
+    // Measure a quarter, half, three quarters and all of the usable cores
+    // plus the current counts, keep the fastest for each phase unless it
+    // was set, and save the choice for later starts
+    void autotune() {
+        const int n_usable = params_.topology.usable_cores();
+        std::vector<int> candidates = { n_usable / 4, n_usable / 2, 3 * n_usable / 4, n_usable,
+                                        plan_.n_threads, plan_.n_threads_batch };
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](int n) { return n < 1; }),
+                         candidates.end());
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        // The first run also faults in weights and buffers
+        double prefill_rate = 0;
+        double decode_rate = 0;
+        if (!measure(plan_.n_threads_batch, prefill_rate, decode_rate)) {
+            LOG_ERROR("Autotune decode failed, keeping " << threads_source_ << " threads");
+            return;
+        }
+
+        ThreadPlan best = plan_;
+        double best_prefill = 0;
+        double best_decode = 0;
+        for (int n : candidates) {
+            if (!measure(n, prefill_rate, decode_rate)) {
+                LOG_ERROR("Autotune decode failed, keeping " << threads_source_ << " threads");
+                return;
+            }
+            LOG_INFO("Autotune " << n << " threads: prefill " << prefill_rate << " tokens/s, decode "
+                     << decode_rate << " tokens/s");
+            if (prefill_rate > best_prefill) {
+                best_prefill = prefill_rate;
+                best.n_threads_batch = n;
+            }
+            if (decode_rate > best_decode) {
+                best_decode = decode_rate;
+                best.n_threads = n;
+            }
+        }
+
+        if (params_.n_threads <= 0) {
+            plan_.n_threads = best.n_threads;
+        }
+        if (params_.n_threads_batch <= 0) {
+            plan_.n_threads_batch = best.n_threads_batch;
+        }
+        threads_source_ = "autotuned";
+
+        // Write to a temporary file first so a crash never leaves a partial choice
+        const std::string tmp_path = threads_path_ + ".tmp";
+        std::ofstream out(tmp_path);
+        out << best.n_threads << " " << best.n_threads_batch << "\n";
+        out.close();
+        if (!out || rename(tmp_path.c_str(), threads_path_.c_str()) != 0) {
+            LOG_ERROR("Failed to save thread counts " << threads_path_);
+            remove(tmp_path.c_str());
+        }
+    }
+
+    void load_lookup_cache() {
+        FILE* probe = fopen(lookup_path_.c_str(), "rb");
+        if (!probe) {
+            return;
+        }
+        fclose(probe);
+
+        try {
+            nc_dynamic_ = common_ngram_cache_load(lookup_path_);
+        } catch (const std::exception& e) {
+            LOG_WARN("Ignoring unreadable n-gram cache " << lookup_path_ << ": " << e.what());
+            nc_dynamic_.clear();
+        }
+    }
+
+    void save_lookup_cache() {
+        // Write to a temporary file first so a crash never leaves a partial cache
+        std::string tmp_path = lookup_path_ + ".tmp";
+        try {
+            common_ngram_cache_save(nc_dynamic_, tmp_path);
+        } catch (const std::exception& e) {
+            LOG_ERROR("Failed to save n-gram cache " << lookup_path_ << ": " << e.what());
+            remove(tmp_path.c_str());
+            return;
+        }
+        if (rename(tmp_path.c_str(), lookup_path_.c_str()) != 0) {
+            LOG_ERROR("Failed to save n-gram cache " << lookup_path_);
+            remove(tmp_path.c_str());
+        }
+    }
+
+    LlamaEngineParams params_;
+
+    llama_model* model_ = nullptr;
+    const llama_vocab* vocab_ = nullptr;
+    llama_context* ctx_ = nullptr;
+    llm_chat_template chat_template_ = LLM_CHAT_TEMPLATE_LLAMA_3;
+    std::unique_ptr<ContextPool> pool_;
+    std::unique_ptr<PrefixCache> prefix_cache_;
+    llama_batch batch_ = {};
+    common_params_sampling sampling_params_;
+
+    // Inference threads
+    ThreadPlan plan_;
+    std::string threads_source_;    // How plan_ was picked, for the log
+    std::string threads_path_;      // Saved autotune choice
+    ggml_threadpool* threadpool_ = nullptr;   // Pinned pool, null when threads float
+    int n_threads_cur_ = -1;        // Last count set on the context
+    int max_step_tokens_ = 0;       // Larger batches take prefill threads
+
+    // By sequence id, only touched by the scheduler thread
+    std::vector<ContextPool::Lease> leases_;
+    std::vector<common_sampler*> own_samplers_;
+    std::vector<LookupState> lookup_;
+
+    // Lookup decoding
+    std::string lookup_path_;       // Empty when lookup decoding is off
+    common_ngram_cache nc_dynamic_; // Past responses, persisted
+    common_ngram_cache nc_static_;  // Unused, no static corpus
+};
+
+} // namespace
+
+std::unique_ptr<Engine> make_llama_engine(const LlamaEngineParams& params) {
+    return std::make_unique<LlamaEngine>(params);
+}
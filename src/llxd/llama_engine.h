@@ -0,0 +1,39 @@
+#ifndef LLXD_LLAMA_ENGINE_H
+#define LLXD_LLAMA_ENGINE_H
+
+#include "engine.h"
+#include "cpu_topology.h"
+
+#include <string>
+#include <memory>
+
+// llama.cpp engine configuration
+struct LlamaEngineParams {
+    llama_model* model = nullptr;
+    std::string model_path;
+    bool constrained_output = false;    // Force one fenced bash block via grammar
+    llama_model* draft_model = nullptr; // Optional, enables speculative decoding
+    bool lookup = false;                // N-gram lookup drafts when there is no draft model
+    int n_draft = 8;                    // Maximum draft tokens per step
+    CpuTopology topology;
+    int n_threads = 0;                  // Decode threads, 0 for the saved or default choice
+    int n_threads_batch = 0;            // Prefill threads, likewise
+    bool pin_threads = true;            // One inference thread per core, where supported
+    bool autotune = false;              // Measure thread counts in init() and save the best
+};
+
+// Engine running a model with llama.cpp.
+//
+// Sequences come from a ContextPool with warm samplers, and the system
+// prompt KV is kept resident and on disk by a PrefixCache. Drafts come
+// from the draft model when there is one, or with lookup enabled from
+// n-grams of the request and of past responses, which are saved next to
+// the model.
+//
+// Prefill and decode steps run with their own thread counts, picked for
+// the CPU topology unless set. An autotune measures both rates at a few
+// thread counts on a scratch sequence and saves the best next to the
+// model, keyed by host, for later starts to load.
+std::unique_ptr<Engine> make_llama_engine(const LlamaEngineParams& params);
+
+#endif // LLXD_LLAMA_ENGINE_H
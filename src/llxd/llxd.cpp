@@ -1,11 +1,18 @@
 #include "llxd.h"
 #include "llama.h"
-#include "common/sampling.h"
-#include "common/common.h"
-#include "llama-chat.h"
-#include "prompts.h"
 #include "protocol.h"
-#include "logging.h"  // Add the new logging header
+#include "logging.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "llama_engine.h"
+#include "mock_engine.h"
+#include "cpu_topology.h"
+#include "model_registry.h"
+#include "response_cache.h"
+#include "semantic_cache.h"
+#include "prefetch.h"
+#include "reactor.h"
+#include "trace.h"
 
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -16,136 +23,85 @@
 #include <atomic>
 #include <vector>
 #include <queue>
+#include <map>
 #include <mutex>
 #include <condition_variable>
 #include <errno.h>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 #include <arpa/inet.h>
-#include <os/log.h>  // macOS system logging
 
-// System logger
-static os_log_t logger = nullptr;
+static const char* const LOG_CATEGORY = "llxd";
 
-// Initialize logger
-static void init_logger() {
-    if (!logger) {
-        // Create a persistent subsystem identifier
-        logger = os_log_create("com.llx.daemon", OS_LOG_CATEGORY_INIT("llxd"));
-    }
-}
-
-// Request structure to hold client request data
-struct Request {
-    int client_fd;
-    llxd_protocol::MessageType type;
-    std::string payload;
-};
-
-// Metrics structure to track performance
-struct Metrics {
-    int64_t t_start = 0;
-
-    // Total metrics since daemon start
-    uint64_t n_prompt_tokens_processed_total = 0;
-    uint64_t t_prompt_processing_total = 0;      // ms
-    uint64_t n_tokens_predicted_total = 0;
-    uint64_t t_tokens_generation_total = 0;      // ms
-
-    // Current request metrics
-    uint64_t n_prompt_tokens_processed = 0;
-    uint64_t t_prompt_processing = 0;            // ms
-    uint64_t n_tokens_predicted = 0;
-    uint64_t t_tokens_generation = 0;            // ms
-
-    // Stats
-    uint64_t n_requests_processed = 0;
-    uint64_t n_active_requests = 0;
-
-    void init() {
-        t_start = ggml_time_us();
-    }
-
-    void on_prompt_eval(int n_tokens, int64_t t_start_us, int64_t t_end_us) {
-        n_prompt_tokens_processed += n_tokens;
-        n_prompt_tokens_processed_total += n_tokens;
-        
-        double t_ms = (t_end_us - t_start_us) / 1e3;
-        t_prompt_processing += t_ms;
-        t_prompt_processing_total += t_ms;
-    }
-
-    void on_token_generated(int64_t t_start_us, int64_t t_end_us) {
-        n_tokens_predicted++;
-        n_tokens_predicted_total++;
-
-        double t_ms = (t_end_us - t_start_us) / 1e3;
-        t_tokens_generation += t_ms;
-        t_tokens_generation_total += t_ms;
-    }
-
-    void on_request_start() {
-        n_active_requests++;
-        n_requests_processed++;
-        
-        // Reset per-request counters
-        n_prompt_tokens_processed = 0;
-        t_prompt_processing = 0;
-        n_tokens_predicted = 0;
-        t_tokens_generation = 0;
-    }
-
-    void on_request_end() {
-        n_active_requests--;
-        
-        // Log metrics for this request
-        if (n_tokens_predicted > 0) {
-            double prompt_tokens_per_sec = n_prompt_tokens_processed / (t_prompt_processing / 1e3);
-            double gen_tokens_per_sec = n_tokens_predicted / (t_tokens_generation / 1e3);
-            
-            std::cout << "\nRequest Metrics:" << std::endl;
-            std::cout << "Prompt processing: " << n_prompt_tokens_processed << " tokens, "
-                      << t_prompt_processing << " ms (" << prompt_tokens_per_sec << " tokens/sec)" << std::endl;
-            std::cout << "Token generation: " << n_tokens_predicted << " tokens, "
-                      << t_tokens_generation << " ms (" << gen_tokens_per_sec << " tokens/sec)" << std::endl;
-        }
-
-        // Log total metrics periodically
-        if (n_requests_processed % 10 == 0) {
-            double total_prompt_tokens_per_sec = n_prompt_tokens_processed_total / (t_prompt_processing_total / 1e3);
-            double total_gen_tokens_per_sec = n_tokens_predicted_total / (t_tokens_generation_total / 1e3);
-            
-            std::cout << "\nTotal Metrics:" << std::endl;
-            std::cout << "Total requests processed: " << n_requests_processed << std::endl;
-            std::cout << "Total prompt tokens: " << n_prompt_tokens_processed_total 
-                      << " (" << total_prompt_tokens_per_sec << " tokens/sec)" << std::endl;
-            std::cout << "Total generated tokens: " << n_tokens_predicted_total
-                      << " (" << total_gen_tokens_per_sec << " tokens/sec)" << std::endl;
-        }
-    }
-};
+// How long shutdown waits for in-flight requests before closing them
+static constexpr int SHUTDOWN_DRAIN_MS = 30000;
 
 class llxd::Impl {
 public:
-    Impl(const std::string& model_path, bool debug_mode) 
-        : model_path_(model_path)
+    Impl(const llxd_options& options)
+        : model_path_(options.model_path)
+        , models_(options.models)
+        , models_dir_(options.models_dir)
+        , model_budget_bytes_(options.model_budget_mb * 1024 * 1024)
         , running_(false)
-        , debug_mode_(debug_mode)
-        , socket_fd_(-1)
-        , model_(nullptr) {
-        init_logger();  // Initialize system logger
+        , n_parallel_(options.n_parallel > 0 ? options.n_parallel : 1)
+        , constrained_output_(options.constrained_output)
+        , draft_model_path_(options.draft_model_path)
+        , lookup_(options.lookup)
+        , n_draft_(options.n_draft)
+        , response_cache_path_(options.response_cache_path)
+        , response_cache_bytes_(options.response_cache_mb * 1024 * 1024)
+        , semantic_cache_enabled_(options.semantic_cache)
+        , embed_model_path_(options.embed_model_path)
+        , semantic_threshold_(options.semantic_threshold)
+        , semantic_capacity_(options.semantic_capacity)
+        , warmup_(options.warmup)
+        , max_queue_(options.max_queue)
+        , deadline_ms_(options.deadline_ms)
+        , mock_(options.mock)
+        , n_threads_(options.n_threads)
+        , n_threads_batch_(options.n_threads_batch)
+        , pin_threads_(options.pin_threads)
+        , autotune_(options.autotune)
+        , socket_fd_(options.listen_fd)
+        , owns_socket_path_(options.listen_fd < 0)
+        , ready_fd_(options.ready_fd) {
+        mock_params_.script = options.mock_script;
+        mock_params_.tokens_per_sec = options.mock_tokens_per_sec;
+        mock_params_.prefill_tokens_per_sec = options.mock_prefill_tokens_per_sec;
+        mock_params_.latency_us = static_cast<int64_t>(std::max(0, options.mock_latency_ms)) * 1000;
+        write_budget_.max_bytes = options.coalesce_bytes;
+        write_budget_.max_delay_us = std::max(0, options.coalesce_us);
+        llxd_log::Config log_config;
+        if (options.debug_mode) {
+            log_config.level = llxd_log::Level::Debug;
+        } else if (!options.log_level.empty() && !llxd_log::parse_level(options.log_level, log_config.level)) {
+            LOG_ERROR("Unknown log level " << options.log_level << ", using info");
+        }
+        log_config.file_path = options.log_file;
+        log_config.system_log = options.log_system;
+        llxd_log::start(log_config);
+        if (options.trace) {
+            llxd_trace::enable(true);
+        }
         metrics_.init();
-        LOG_INFO("%{public}s", ("Initializing daemon with model: " + model_path).c_str());
-        DEBUG_LOG("Initializing daemon with model: " << model_path);
+        LOG_INFO("Initializing daemon with model: " << model_path_);
+    }
+
+    ~Impl() {
+        llxd_log::stop();  // Flush what is queued if stop() never ran
     }
 
     bool start() {
-        LOG_INFO("%{public}s", "Starting daemon initialization");
-        DEBUG_LOG("Starting daemon initialization");
+        LOG_INFO("Starting daemon initialization");
         
         // Initialize llama.cpp
         llama_backend_init();
         DEBUG_LOG("Initialized llama backend");
+        topology_ = detect_cpu_topology();
+        LOG_INFO("CPU: " << topology_.summary());
+        t_start_ = ggml_time_us();
 
         // Load the model with optimized parameters for Apple Silicon
         llama_model_params model_params = llama_model_default_params();
@@ -154,620 +110,738 @@ public:
         model_params.tensor_split = nullptr;
         model_params.use_mmap = true;
         model_params.use_mlock = false;
+        model_params.progress_callback = &Impl::on_load_progress;
+        model_params.progress_callback_user_data = this;
         
         DEBUG_LOG("Loading model with params:"
                  "\n  n_gpu_layers: " << model_params.n_gpu_layers <<
                  "\n  use_mmap: " << model_params.use_mmap <<
                  "\n  use_mlock: " << model_params.use_mlock);
         
-        model_ = llama_model_load_from_file(model_path_.c_str(), model_params);
-        if (!model_) {
-            std::cerr << "Failed to load model: " << model_path_ << std::endl;
-            return false;
+        // Persistent response cache, the daemon still works without it
+        if (!response_cache_path_.empty()) {
+            response_cache_ = std::make_unique<ResponseCache>(response_cache_path_, response_cache_bytes_);
+            if (!response_cache_->open()) {
+                LOG_WARN("Continuing without response cache");
+                response_cache_.reset();
+            } else {
+                DEBUG_LOG("Response cache " << response_cache_path_ << ": "
+                         << response_cache_->n_entries() << " entries, "
+                         << response_cache_->bytes_used() << " bytes");
+            }
         }
 
-        // Create Unix domain socket
-        socket_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (socket_fd_ < 0) {
-            std::cerr << "Failed to create socket" << std::endl;
-            return false;
+        // Every model gets its own continuous-batching scheduler when it is
+        // loaded. The default model is pinned and loaded right away.
+        registry_ = std::make_unique<ModelRegistry>(model_params, model_budget_bytes_, models_dir_,
+            [this, model_params](const std::string& id, const std::string& path, llama_model* model) {
+                return start_scheduler(id, path, model, model_params);
+            },
+            !mock_);
+        default_model_id_ = model_id_for(model_path_);
+        registry_->add(default_model_id_, model_path_, true);
+        for (const auto& model : models_) {
+            registry_->add(model.first, model.second);
         }
 
-        struct sockaddr_un addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, "/tmp/llx.sock", sizeof(addr.sun_path) - 1);
-
-        // Remove existing socket file if it exists
-        unlink(addr.sun_path);
-
-        if (bind(socket_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-            std::cerr << "Failed to bind socket" << std::endl;
+        // Listen before loading, so clients can connect right away. A
+        // socket handed over by a service manager is already listening.
+        if (socket_fd_ < 0 && !open_socket()) {
             return false;
         }
 
-        if (listen(socket_fd_, 5) < 0) {
-            std::cerr << "Failed to listen on socket" << std::endl;
+        running_ = true;
+        DEBUG_LOG("Starting reactor");
+
+        // One event loop accepts and reads every connection, complete
+        // messages are handed to on_message on its thread. Streamed text
+        // is coalesced per connection within the write budget.
+        reactor_ = std::make_unique<Reactor>(
+            [this](std::shared_ptr<Connection> client, ClientMessage message) {
+                on_message(std::move(client), std::move(message));
+            },
+            write_budget_);
+        if (!reactor_->start(socket_fd_)) {
             return false;
         }
+        socket_fd_ = -1;  // Owned by the reactor now
+        dispatch_thread_ = std::thread(&Impl::dispatch_requests, this);
 
-        running_ = true;
-        DEBUG_LOG("Starting worker and accept threads");
-        
-        // Start worker thread to process requests
-        worker_thread_ = std::thread(&Impl::process_requests, this);
-        
-        // Start accept thread to handle incoming connections
-        accept_thread_ = std::thread(&Impl::accept_connections, this);
+        // Models load in the background, prompts arriving meanwhile wait
+        load_thread_ = std::thread(&Impl::load_models, this, model_params);
 
         return true;
     }
 
     void stop() {
-        LOG_INFO("%{public}s", "Initiating daemon shutdown sequence...");
-        std::cout << "Initiating daemon shutdown sequence..." << std::endl;
+        if (stopped_.exchange(true)) {
+            return;
+        }
+        LOG_INFO("Initiating daemon shutdown sequence...");
         
         // First set running flag to false to stop accepting new requests
         running_ = false;
         
-        // Close socket to interrupt accept() call
+        // Stop accepting, connections already open keep being served
+        LOG_INFO("Closing socket connections...");
+        if (reactor_) {
+            reactor_->stop_accepting();
+        }
         if (socket_fd_ >= 0) {
-            std::cout << "Closing socket connections..." << std::endl;
-            shutdown(socket_fd_, SHUT_RDWR);
             close(socket_fd_);
             socket_fd_ = -1;
+        }
+        if (owns_socket_path_) {
             unlink("/tmp/llx.sock");
         }
 
-        // Wake up worker thread and wait for it to finish
+        LOG_INFO("Waiting for threads to finish...");
+        if (load_thread_.joinable() && load_thread_.get_id() != std::this_thread::get_id()) {
+            load_thread_.join();
+        }
         {
-            std::cout << "Stopping worker thread..." << std::endl;
-            std::unique_lock<std::mutex> lock(queue_mutex_);
-            // Add a final null request to ensure the worker thread wakes up
-            request_queue_.push({-1, llxd_protocol::MessageType::CONTROL, ""});
-            queue_condition_.notify_one();
+            std::unique_lock<std::mutex> lock(dispatch_mutex_);
+            dispatch_ready_.notify_all();
         }
-        
-        std::cout << "Waiting for threads to finish..." << std::endl;
-        if (accept_thread_.joinable()) {
-            accept_thread_.join();
+        if (dispatch_thread_.joinable()) {
+            dispatch_thread_.join();
         }
-        
-        if (worker_thread_.joinable()) {
-            worker_thread_.join();
+        // The reactor may still be queueing, take what is left under the lock
+        std::queue<Request> left;
+        {
+            std::unique_lock<std::mutex> lock(dispatch_mutex_);
+            left.swap(dispatch_queue_);
+        }
+        while (!left.empty()) {
+            left.front().stream->end(llxd_protocol::FinishReason::CANCELLED);
+            left.pop();
         }
 
-        std::cout << "Cleaning up resources..." << std::endl;
-        if (model_) {
-            llama_model_free(model_);
-            model_ = nullptr;
+        // Let requests already accepted finish streaming
+        if (registry_ && !registry_->wait_idle(SHUTDOWN_DRAIN_MS)) {
+            LOG_WARN("Requests still running after " << SHUTDOWN_DRAIN_MS / 1000 << " s, closing them");
         }
+
+        // Stop the schedulers, closing anything left, and wait for swaps
+        LOG_INFO("Stopping schedulers...");
+        if (registry_) {
+            LOG_INFO(registry_->format_stats());
+            registry_->stop_schedulers();
+        }
+        if (reactor_) {
+            LOG_INFO(format_write_stats());
+        }
+        {
+            std::unique_lock<std::mutex> lock(swap_mutex_);
+            swap_done_.wait(lock, [this] { return n_swaps_ == 0; });
+        }
+        {
+            std::unique_lock<std::mutex> lock(cold_mutex_);
+            cold_done_.wait(lock, [this] { return n_cold_loads_ == 0; });
+        }
+        if (reactor_) {
+            reactor_->stop();
+        }
+        semantic_cache_.reset();
+        response_cache_.reset();
+        if (registry_) {
+            registry_->clear();
+        }
+
+        LOG_INFO("Cleaning up resources...");
+        if (draft_model_) {
+            llama_model_free(draft_model_);
+            draft_model_ = nullptr;
+        }
+        if (embed_model_) {
+            llama_model_free(embed_model_);
+            embed_model_ = nullptr;
+        }
+        registry_.reset();
         
         llama_backend_free();
-        std::cout << "Daemon shutdown complete" << std::endl;
-        exit(0);  // Force exit after cleanup
+        LOG_INFO("Daemon shutdown complete");
+        llxd_log::stop();
+    }
+
+    bool shutdown_requested() const {
+        return shutdown_requested_;
+    }
+
+    int exit_code() const {
+        return exit_code_;
     }
 
 private:
-    void accept_connections() {
-        while (running_) {
-            int client_fd = accept(socket_fd_, nullptr, nullptr);
-            if (client_fd < 0) {
-                if (running_) {
-                    if (errno == EINVAL) {
-                        // Socket was closed, exit the loop
-                        DEBUG_LOG("Socket closed, stopping accept loop");
-                        break;
-                    }
-                    std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
-                }
-                continue;
-            }
+    bool open_socket() {
+        // Create Unix domain socket
+        socket_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socket_fd_ < 0) {
+            LOG_ERROR("Failed to create socket");
+            return false;
+        }
 
-            // Read message header
-            llxd_protocol::MessageHeader header;
-            ssize_t header_size = read(client_fd, &header, sizeof(header));
-            if (header_size != sizeof(header)) {
-                std::cerr << "Failed to read message header" << std::endl;
-                close(client_fd);
-                continue;
-            }
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, "/tmp/llx.sock", sizeof(addr.sun_path) - 1);
 
-            DEBUG_LOG("Received message type: " << (header.type == llxd_protocol::MessageType::CONTROL ? "CONTROL" : "PROMPT"));
-
-            // Read payload
-            uint32_t payload_size = ntohl(header.payload_size);
-            std::string payload;
-            payload.resize(payload_size);
-            
-            ssize_t n = read(client_fd, &payload[0], payload_size);
-            if (n != static_cast<ssize_t>(payload_size)) {
-                std::cerr << "Failed to read payload" << std::endl;
-                close(client_fd);
-                continue;
-            }
+        // Remove existing socket file if it exists
+        unlink(addr.sun_path);
 
-            if (header.type == llxd_protocol::MessageType::CONTROL) {
-                DEBUG_LOG("Control message payload size: " << payload_size);
-            }
+        if (bind(socket_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            LOG_ERROR("Failed to bind socket");
+            return false;
+        }
 
-            // Queue the request
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex_);
-                request_queue_.push({client_fd, header.type, payload});
-                queue_condition_.notify_one();
+        // Early clients wait in the backlog while the model loads
+        if (listen(socket_fd_, SOMAXCONN) < 0) {
+            LOG_ERROR("Failed to listen on socket");
+            return false;
+        }
+        return true;
+    }
+
+    // Load the draft model and the default model, then release queued
+    // prompts to the dispatcher and tell whoever started the daemon
+    void load_models(llama_model_params model_params) {
+        bool loaded = true;
+
+        // Small draft model for speculative decoding, same vocab as the target
+        if (!draft_model_path_.empty() && !mock_) {
+            if (warmup_) {
+                prefetch_weights(draft_model_path_);
+            }
+            draft_model_ = llama_model_load_from_file(draft_model_path_.c_str(), model_params);
+            if (!draft_model_) {
+                LOG_ERROR("Failed to load draft model: " << draft_model_path_);
+                loaded = false;
+            } else {
+                DEBUG_LOG("Loaded draft model: " << draft_model_path_);
             }
+        }
+
+        // The default model is loaded right away and pinned
+        if (loaded && !registry_->acquire(default_model_id_)) {
+            loaded = false;
+        }
 
-            // If this was a shutdown request, exit the accept loop
-            if (header.type == llxd_protocol::MessageType::CONTROL && 
-                payload_size >= sizeof(llxd_protocol::ControlCommand) &&
-                *reinterpret_cast<const llxd_protocol::ControlCommand*>(payload.data()) == llxd_protocol::ControlCommand::SHUTDOWN) {
-                DEBUG_LOG("Shutdown request received, stopping accept loop");
-                break;
+        size_t n_waiting;
+        {
+            std::unique_lock<std::mutex> lock(dispatch_mutex_);
+            load_done_ = true;
+            models_loaded_ = loaded;
+            n_waiting = dispatch_queue_.size();
+            dispatch_ready_.notify_all();
+        }
+
+        if (!loaded) {
+            notify_ready(std::string(llxd_protocol::READY_ERROR) + "failed to load model " + model_path_);
+            if (running_) {
+                exit_code_ = 1;
+                shutdown_requested_ = true;
             }
+            return;
         }
-        DEBUG_LOG("Accept loop stopped");
+
+        LOG_INFO("Ready after " << (ggml_time_us() - t_start_) / 1e3 << " ms"
+                 << (n_waiting > 0 ? ", " + std::to_string(n_waiting) + " requests waited for the model" : ""));
+        notify_ready(llxd_protocol::READY_OK);
     }
 
-    void process_requests() {
-        while (running_) {
-            Request request;
-            
-            // Wait for and get next request
-            {
-                std::unique_lock<std::mutex> lock(queue_mutex_);
-                queue_condition_.wait(lock, [this] {
-                    return !request_queue_.empty() || !running_;
-                });
-                
-                if (!running_) {
-                    break;
-                }
-                
-                request = request_queue_.front();
-                request_queue_.pop();
-            }
+    // Write a line to the ready fd, closing it after the final one
+    void notify_ready(const std::string& line) {
+        int fd = ready_fd_.load();
+        if (fd < 0) {
+            return;
+        }
+        const std::string message = line + "\n";
+        if (write(fd, message.data(), message.size()) < 0) {
+            DEBUG_LOG("Failed to write to ready fd: " << strerror(errno));
+        }
+        if (line.compare(0, strlen(llxd_protocol::READY_PROGRESS), llxd_protocol::READY_PROGRESS) != 0 &&
+            ready_fd_.exchange(-1) == fd) {
+            close(fd);
+        }
+    }
 
-            handle_request(request);
+    // Model load progress, reported while the daemon is starting. Returning
+    // false aborts a load once the daemon is stopping.
+    static bool on_load_progress(float progress, void* user_data) {
+        Impl* self = static_cast<Impl*>(user_data);
+        int percent = static_cast<int>(progress * 100);
+        if (self->ready_fd_ >= 0 && percent != self->load_percent_) {
+            self->load_percent_ = percent;
+            self->notify_ready(llxd_protocol::READY_PROGRESS + std::to_string(percent));
         }
+        return self->running_;
     }
 
-    void handle_request(const Request& request) {
-        // Handle control messages
-        if (request.type == llxd_protocol::MessageType::CONTROL) {
-            if (request.client_fd == -1) {
-                // This is our shutdown sentinel request
-                return;
-            }
+    // Models under models_dir are known by their relative path without the
+    // .gguf suffix, like the ids llx asks for, others by their file name
+    std::string model_id_for(const std::string& path) const {
+        const std::string suffix = ".gguf";
+        std::string id = path;
+        if (!models_dir_.empty() && id.compare(0, models_dir_.size() + 1, models_dir_ + "/") == 0) {
+            id = id.substr(models_dir_.size() + 1);
+        } else if (id.find('/') != std::string::npos) {
+            id = id.substr(id.rfind('/') + 1);
+        }
+        if (id.size() > suffix.size() && id.compare(id.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            id.resize(id.size() - suffix.size());
+        }
+        return id;
+    }
 
-            std::cout << "Processing control message..." << std::endl;
-            
-            if (request.payload.size() >= sizeof(llxd_protocol::ControlCommand)) {
-                llxd_protocol::ControlCommand cmd = *reinterpret_cast<const llxd_protocol::ControlCommand*>(request.payload.data());
-                if (cmd == llxd_protocol::ControlCommand::SHUTDOWN) {
-                    std::cout << "Received shutdown command. Initiating shutdown..." << std::endl;
-                    const char* response = "Shutting down llxd daemon...\n";
-                    send(request.client_fd, response, strlen(response), MSG_NOSIGNAL);
-                    close(request.client_fd);
-                    
-                    // Call stop() in a separate thread to avoid deadlock
-                    std::thread([this]() {
-                        stop();
-                    }).detach();
-                    return;
-                }
+    // Scheduler for a freshly loaded model. The draft model and the
+    // semantic cache belong to the default model, which is never evicted.
+    // Swapping the default model rebuilds a semantic cache that embeds
+    // with it; the old scheduler keeps the old one until it drains.
+    // In mock mode there is no model and every scheduler gets a mock engine.
+    std::unique_ptr<Scheduler> start_scheduler(const std::string& id, const std::string& path,
+                                               llama_model* model, const llama_model_params& model_params) {
+        const bool is_default = id == default_model_id_;
+        if (mock_) {
+            if (semantic_cache_enabled_ || !draft_model_path_.empty()) {
+                LOG_WARN("The mock engine has no embeddings or drafts, ignoring them");
+            }
+        } else if (is_default) {
+            // Semantic cache resolves paraphrases to response cache entries
+            const bool stale = semantic_cache_ && embed_model_path_.empty() && semantic_model_ != model;
+            if (semantic_cache_enabled_ && !response_cache_) {
+                LOG_WARN("Semantic cache needs the response cache, disabling it");
+            } else if (semantic_cache_enabled_ && (!semantic_cache_ || stale) &&
+                       !start_semantic_cache(model, path, model_params)) {
+                LOG_WARN("Continuing without semantic cache");
+                semantic_cache_.reset();
             }
-            close(request.client_fd);
-            return;
         }
 
-        // Handle prompt messages
-        metrics_.on_request_start();
-        int64_t t_start_prompt = ggml_time_us();
+        // Weights are mmap'd, fault them in before the scheduler touches them
+        if (warmup_ && !mock_) {
+            prefetch_weights(path);
+        }
 
-        // Use RAII for client socket
-        struct ClientSocket {
-            int fd;
-            ClientSocket(int fd) : fd(fd) {}
-            ~ClientSocket() { 
-                if (fd >= 0) {
-                    close(fd);
-                }
-            }
-        } client_guard(request.client_fd);
-
-        LOG_INFO("%{public}s", ("Processing LLM request: " + request.payload).c_str());
-        DEBUG_LOG("Processing LLM request: " << request.payload);
-
-        // Create optimized context parameters for this request
-        llama_context_params ctx_params = llama_context_default_params();
-        ctx_params.n_ctx = 2048;      // Keep context size reasonable
-        ctx_params.n_batch = 512;     // Increase batch size for better throughput
-        ctx_params.n_threads = 8;     // Optimize for M1/M2 performance
-        ctx_params.n_threads_batch = 8;// Match batch threads to CPU cores
-        ctx_params.offload_kqv = true;// Enable KQV offloading to GPU
-        
-        // Create context for this request
-        llama_context* ctx = llama_init_from_model(model_, ctx_params);
-        if (!ctx) {
-            std::cerr << "Failed to create context for request" << std::endl;
-            metrics_.on_request_end();
-            return;
+        std::unique_ptr<Engine> engine;
+        if (mock_) {
+            engine = make_mock_engine(mock_params_);
+        } else {
+            LlamaEngineParams engine_params;
+            engine_params.model = model;
+            engine_params.model_path = path;
+            engine_params.constrained_output = constrained_output_;
+            engine_params.draft_model = is_default ? draft_model_ : nullptr;
+            engine_params.lookup = lookup_;
+            engine_params.n_draft = n_draft_;
+            engine_params.topology = topology_;
+            engine_params.n_threads = n_threads_;
+            engine_params.n_threads_batch = n_threads_batch_;
+            engine_params.pin_threads = pin_threads_;
+            engine_params.autotune = autotune_;
+            engine = make_llama_engine(engine_params);
         }
-        DEBUG_LOG("Created context successfully");
 
-        // Detect chat template
-        std::string model_template;
-        const char* raw_template = llama_model_chat_template(model_, "chatml");  // Use ChatML as default template
-        if (raw_template != nullptr) {
-            model_template = raw_template;
+        SchedulerParams scheduler_params;
+        scheduler_params.model_path = path;
+        scheduler_params.n_parallel = n_parallel_;
+        scheduler_params.constrained_output = constrained_output_ && !mock_;
+        scheduler_params.response_cache = response_cache_.get();
+        scheduler_params.semantic_cache = is_default ? semantic_cache_ : nullptr;
+        scheduler_params.semantic_threshold = semantic_threshold_;
+        scheduler_params.warmup = warmup_;
+        scheduler_params.max_queue = max_queue_;
+        auto scheduler = std::make_unique<Scheduler>(std::move(engine), scheduler_params, metrics_);
+        if (!scheduler->start()) {
+            return nullptr;
         }
-        
-        // Default to ChatML if no template or unknown
-        llm_chat_template chat_template = LLM_CHAT_TEMPLATE_LLAMA_3;
-        if (!model_template.empty()) {
-            try {
-                chat_template = llm_chat_detect_template(model_template);
-                if (chat_template == LLM_CHAT_TEMPLATE_UNKNOWN) {
-                    DEBUG_LOG("Unknown chat template, defaulting to ChatML");
-                    chat_template = LLM_CHAT_TEMPLATE_LLAMA_3;
-                }
-            } catch (const std::exception& e) {
-                DEBUG_LOG("Error detecting chat template: " << e.what() << ", defaulting to LLama3");
-                chat_template = LLM_CHAT_TEMPLATE_LLAMA_3;
+        return scheduler;
+    }
+
+    // Embed with a dedicated small model when given, else the serving one
+    bool start_semantic_cache(llama_model* model, std::string model_path, const llama_model_params& model_params) {
+        semantic_model_ = model;
+        if (!embed_model_path_.empty()) {
+            embed_model_ = llama_model_load_from_file(embed_model_path_.c_str(), model_params);
+            if (!embed_model_) {
+                LOG_ERROR("Failed to load embedding model: " << embed_model_path_);
+                return false;
             }
+            model = embed_model_;
+            model_path = embed_model_path_;
         }
-        DEBUG_LOG("Using chat template: " << (model_template.empty() ? "LLama3 (default)" : model_template));
 
-        // Create chat messages
-        std::vector<llama_chat_message> messages;
-        
-        // Add system message with more specific instructions
-        llama_chat_message system_msg;
-        system_msg.role = "system";
-        system_msg.content = UNIX_COMMAND_SYSTEM_PROMPT;
-        messages.push_back(system_msg);
-
-        // Add user message
-        llama_chat_message user_msg;
-        user_msg.role = "user";
-        user_msg.content = request.payload.c_str();
-        messages.push_back(user_msg);
-
-        // Convert messages to prompt using template
-        std::vector<const llama_chat_message*> msg_ptrs;
-        for (const auto& msg : messages) {
-            msg_ptrs.push_back(&msg);
-        }
-
-        // First get required size
-        std::string formatted_prompt;
-        int prompt_size = llm_chat_apply_template(chat_template, msg_ptrs, formatted_prompt, true);
-        if (prompt_size < 0) {
-            std::cerr << "Failed to apply chat template (size check)" << std::endl;
-            llama_free(ctx);
-            metrics_.on_request_end();
-            return;
+        semantic_cache_ = std::make_shared<SemanticCache>(model, model_path, semantic_capacity_);
+        if (!semantic_cache_->init()) {
+            return false;
         }
+        DEBUG_LOG("Semantic cache " << semantic_cache_->file_path() << ": "
+                 << semantic_cache_->n_entries() << " prompts, " << semantic_cache_->n_embd()
+                 << " dims, threshold " << semantic_threshold_);
+        return true;
+    }
 
-        // Now apply template with proper size
-        if (llm_chat_apply_template(chat_template, msg_ptrs, formatted_prompt, true) < 0) {
-            std::cerr << "Failed to apply chat template (formatting)" << std::endl;
-            llama_free(ctx);
-            metrics_.on_request_end();
+    // A complete message from a client, on the reactor thread. Anything
+    // that may block goes through the dispatcher.
+    void on_message(std::shared_ptr<Connection> client, ClientMessage message) {
+        if (message.version >= llxd_protocol::PROTOCOL_VERSION) {
+            on_frame(std::move(client), std::move(message));
             return;
         }
-        DEBUG_LOG("Applied chat template successfully. Prompt size: " << formatted_prompt.size());
-        DEBUG_LOG("Formatted prompt:\n" << formatted_prompt);
+        DEBUG_LOG("Received message type: " << (message.type == llxd_protocol::MessageType::CONTROL ? "CONTROL" : "PROMPT")
+                  << ", payload size: " << message.payload.size());
+
+        Request request;
+        request.stream = std::make_unique<ResponseStream>(std::move(client));
+        request.type = message.type;
 
-        // Get vocab for tokenization
-        const llama_vocab* vocab = llama_model_get_vocab(model_);
-        if (!vocab) {
-            std::cerr << "Failed to get vocab from model" << std::endl;
-            llama_free(ctx);
-            metrics_.on_request_end();
+        // Control messages are handled right here, prompts go to the scheduler
+        if (message.type == llxd_protocol::MessageType::CONTROL) {
+            request.payload = std::move(message.payload);
+            handle_control(std::move(request));
             return;
         }
 
-        std::string full_prompt = formatted_prompt;
-
-        // Tokenize prompt
-        std::vector<llama_token> tokens;
-        tokens.resize(full_prompt.length() + 1);
-        int n_tokens = llama_tokenize(
-            vocab,
-            full_prompt.c_str(),
-            full_prompt.length(),
-            tokens.data(),
-            tokens.size(),
-            true,  // add_bos
-            true   // special tokens
-        );
-        if (n_tokens < 0) {
-            std::cerr << "Failed to tokenize prompt" << std::endl;
-            llama_free(ctx);
-            metrics_.on_request_end();
+        if (message.type == llxd_protocol::MessageType::PROMPT_EX) {
+            if (!llxd_protocol::decode_prompt_ex(message.payload, request.stop_set, request.stop, request.model,
+                                                 request.payload)) {
+                LOG_ERROR("Malformed prompt options");
+                metrics_.on_error();
+                request.stream->end(llxd_protocol::FinishReason::ERROR);
+                return;
+            }
+        } else if (message.type == llxd_protocol::MessageType::PROMPT) {
+            request.payload = std::move(message.payload);
+        } else {
+            request.stream->end(llxd_protocol::FinishReason::ERROR);
             return;
         }
-        tokens.resize(n_tokens);
-        DEBUG_LOG("Tokenized prompt into " << n_tokens << " tokens");
+        request.t_deadline = deadline_after(0);
+        queue_dispatch(std::move(request));
+    }
 
-        // Create batch for prompt evaluation
-        llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
-        if (!batch.token) {
-            std::cerr << "Failed to create batch" << std::endl;
-            llama_free(ctx);
-            metrics_.on_request_end();
+    // A v2 frame, one of many requests sharing the connection
+    void on_frame(std::shared_ptr<Connection> client, ClientMessage message) {
+        DEBUG_LOG("Received frame type " << static_cast<int>(message.frame_type) << " for request "
+                  << message.request_id << ", payload size: " << message.payload.size());
+
+        Request request;
+        request.stream = std::make_unique<ResponseStream>(std::move(client), message.request_id);
+        if (request.stream->duplicate()) {
+            LOG_WARN("Request id " << message.request_id << " is already in flight on the connection");
+            metrics_.on_error();
+            request.stream->end(llxd_protocol::FinishReason::ERROR, "request id already in flight");
             return;
         }
 
-        // Enable logits for last token
-        auto* logits_array = new int8_t[batch.n_tokens]();
-        logits_array[batch.n_tokens - 1] = 1;
-        batch.logits = logits_array;
-
-        // Evaluate prompt
-        if (llama_decode(ctx, batch)) {
-            std::cerr << "Failed to evaluate prompt" << std::endl;
-            delete[] logits_array;
-            llama_free(ctx);
-            metrics_.on_request_end();
+        if (message.frame_type == llxd_protocol::FrameType::CONTROL) {
+            request.type = llxd_protocol::MessageType::CONTROL;
+            request.payload = std::move(message.payload);
+            handle_control(std::move(request));
             return;
         }
-        delete[] logits_array;
-
-        int64_t t_end_prompt = ggml_time_us();
-        metrics_.on_prompt_eval(n_tokens, t_start_prompt, t_end_prompt);
 
-        // Setup sampling parameters for more precise responses
-        common_params_sampling sampling_params;
-        sampling_params.temp = 0.2f;          // Lower temperature for more deterministic output
-        sampling_params.top_p = 0.1f;         // More focused token selection
-        sampling_params.min_p = 0.05f;        // Slightly higher minimum probability
-        sampling_params.penalty_repeat = 1.3f; // Stronger repetition penalty
-        sampling_params.n_probs = 0;
-        sampling_params.penalty_freq = 0.0f;
-        sampling_params.penalty_present = 0.0f;
-        
-        auto* sampler = common_sampler_init(model_, sampling_params);
-        if (!sampler) {
-            std::cerr << "Failed to initialize sampler" << std::endl;
-            llama_free(ctx);
-            metrics_.on_request_end();
+        llxd_protocol::RequestParams params;
+        if (message.frame_type != llxd_protocol::FrameType::REQUEST ||
+            !llxd_protocol::decode_request(message.payload, params)) {
+            LOG_ERROR("Malformed request frame");
+            metrics_.on_error();
+            request.stream->end(llxd_protocol::FinishReason::ERROR, "malformed request");
             return;
         }
+        request.type = llxd_protocol::MessageType::PROMPT;
+        request.payload = std::move(params.prompt);
+        request.stop_set = params.stop_set;
+        request.stop = std::move(params.stop);
+        request.model = std::move(params.model);
+        request.max_tokens = static_cast<int>(std::min<uint32_t>(params.max_tokens, INT32_MAX));
+        request.temperature = params.temperature;
+        request.priority = params.priority;
+        request.t_deadline = deadline_after(params.deadline_ms);
+        queue_dispatch(std::move(request));
+    }
 
-        // Generate response with better control
-        const int max_tokens = 256;  // Limit maximum tokens since commands should be short
-        auto* next_logits = new int8_t[1]{1};
-        int64_t t_start_token = 0;
-        int64_t t_end_token = 0;
-        std::string response;
-        bool found_newline = false;
-        bool found_backticks = false;
-
-        for (int i = 0; i < max_tokens; i++) {
-            t_start_token = ggml_time_us();
-            
-            // Sample next token
-            llama_token new_token = common_sampler_sample(sampler, ctx, -1);
-
-            // Check for end conditions
-            if (new_token == llama_vocab_eos(vocab) || 
-                llama_vocab_is_eog(vocab, new_token) ||
-                (found_newline && (new_token == llama_vocab_bos(vocab) || new_token == llama_vocab_eos(vocab)))) {
-                break;
-            }
+    // When a request arriving now must have started, 0 for never. Falls
+    // back to the daemon's default deadline.
+    int64_t deadline_after(uint32_t deadline_ms) const {
+        int64_t ms = deadline_ms > 0 ? deadline_ms : std::max(0, deadline_ms_);
+        return ms > 0 ? ggml_time_us() + ms * 1000 : 0;
+    }
 
-            // Convert token to text
-            char piece_buf[32];
-            int piece_len = llama_token_to_piece(
-                vocab,
-                new_token,
-                piece_buf,
-                sizeof(piece_buf),
-                0,
-                true
-            );
-            if (piece_len < 0 || piece_len >= (int)sizeof(piece_buf)) {
-                break;
-            }
-            piece_buf[piece_len] = '\0';
-            
-            // Track backticks for follow-up prompt logic
-            std::string piece(piece_buf, piece_len);
-            if (piece.find("```") != std::string::npos) {
-                found_backticks = true;
-            }
+    void queue_dispatch(Request request) {
+        std::unique_lock<std::mutex> lock(dispatch_mutex_);
+        if (!running_) {
+            // Shutting down, nothing would dispatch it
+            lock.unlock();
+            request.stream->end(llxd_protocol::FinishReason::CANCELLED);
+            return;
+        }
+        if (!load_done_) {
+            DEBUG_LOG("Model still loading, queueing request");
+        }
+        request.id = ++n_requests_;
+        dispatch_queue_.push(std::move(request));
+        dispatch_ready_.notify_one();
+    }
 
-            // Track if we've seen a newline
-            if (strchr(piece_buf, '\n') != nullptr) {
-                found_newline = true;
+    // Hands requests to the scheduler of their model, off the reactor
+    // thread since that may load a model. Holds everything back until the
+    // default model is loaded.
+    void dispatch_requests() {
+        llxd_trace::set_thread_name("dispatcher");
+        while (true) {
+            Request request;
+            bool loaded;
+            {
+                std::unique_lock<std::mutex> lock(dispatch_mutex_);
+                dispatch_ready_.wait(lock, [this] {
+                    return !running_ || (load_done_ && !dispatch_queue_.empty());
+                });
+                if (!running_) {
+                    break;
+                }
+                request = std::move(dispatch_queue_.front());
+                dispatch_queue_.pop();
+                loaded = models_loaded_;
             }
 
-            // Send piece to client without any formatting
-            ssize_t sent = send(request.client_fd, piece_buf, piece_len, MSG_NOSIGNAL);
-            if (sent < 0) {
-                break;
+            if (request.type == llxd_protocol::MessageType::CONTROL) {
+                // MODELS, the registry is busy while a model loads
+                request.stream->send(registry_->format_stats() + format_write_stats());
+                request.stream->end(llxd_protocol::FinishReason::STOP);
+            } else if (!loaded) {
+                metrics_.on_error();
+                request.stream->end(llxd_protocol::FinishReason::ERROR, "failed to load model " + model_path_);
+            } else {
+                dispatch(std::move(request));
             }
+        }
+        DEBUG_LOG("Dispatcher stopped");
+    }
 
-            // Collect response for validation
-            response += piece;
-
-            // Accept token and prepare next batch
-            common_sampler_accept(sampler, new_token, true);
+    // Hand a prompt to the scheduler of its model
+    void dispatch(Request request) {
+        llxd_trace::Span span("dispatch", request.id);
+        if (request.t_deadline > 0 && ggml_time_us() > request.t_deadline) {
+            // Waited out its deadline while the model loaded
+            metrics_.on_expired();
+            request.stream->end(llxd_protocol::FinishReason::EXPIRED, "deadline passed before the model was ready");
+            return;
+        }
+        const std::string id = request.model.empty() ? default_model_id_ : request.model;
+        std::shared_ptr<Scheduler> scheduler = registry_->acquire_resident(id);
+        if (scheduler) {
+            scheduler->submit(std::move(request));
+            return;
+        }
 
-            llama_batch next_batch = llama_batch_get_one(&new_token, 1);
-            if (!next_batch.token) {
-                break;
+        // Cold, load it on a thread of its own so requests for resident
+        // models keep flowing. Requests for it meanwhile wait with the first.
+        {
+            std::unique_lock<std::mutex> lock(cold_mutex_);
+            std::vector<Request>& waiting = cold_loads_[id];
+            waiting.push_back(std::move(request));
+            if (waiting.size() > 1) {
+                return;
             }
+            n_cold_loads_++;
+        }
+        std::thread(&Impl::load_and_dispatch, this, id).detach();
+    }
 
-            next_batch.logits = next_logits;
-            next_batch.seq_id = seq_id_ptr_ptr;
+    // Load a model off the dispatcher, then dispatch what waited for it
+    void load_and_dispatch(std::string id) {
+        std::shared_ptr<Scheduler> scheduler = registry_->acquire(id);
 
-            if (llama_decode(ctx, next_batch)) {
-                break;
+        std::vector<Request> waiting;
+        {
+            std::unique_lock<std::mutex> lock(cold_mutex_);
+            waiting = std::move(cold_loads_[id]);
+            cold_loads_.erase(id);
+        }
+        for (Request& request : waiting) {
+            if (!scheduler) {
+                metrics_.on_error();
+                request.stream->end(llxd_protocol::FinishReason::ERROR, "model " + request.model + " is not available");
+            } else if (request.t_deadline > 0 && ggml_time_us() > request.t_deadline) {
+                metrics_.on_expired();
+                request.stream->end(llxd_protocol::FinishReason::EXPIRED, "deadline passed before the model was ready");
+            } else {
+                scheduler->submit(std::move(request));
             }
-
-            t_end_token = ggml_time_us();
-            metrics_.on_token_generated(t_start_token, t_end_token);
         }
 
-        // If no backticks found, send follow-up prompt
-        if (!found_backticks) {
-            // Create follow-up message
-            llama_chat_message assistant_msg;
-            assistant_msg.role = "assistant";
-            assistant_msg.content = response.c_str();
-            messages.push_back(assistant_msg);
+        std::unique_lock<std::mutex> lock(cold_mutex_);
+        n_cold_loads_--;
+        cold_done_.notify_all();
+    }
 
-            llama_chat_message followup_msg;
-            followup_msg.role = "user";
-            followup_msg.content = "Please reformat the above response to enclose the command in ```bash backticks.";
-            messages.push_back(followup_msg);
+    // Socket write counters, several pieces per syscall is coalescing at work
+    std::string format_write_stats() const {
+        WriteStats stats = reactor_->write_stats();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        out << "Socket writes: " << stats.n_writes << " syscalls for " << stats.n_sends << " pieces";
+        if (stats.n_writes > 0) {
+            out << " (" << static_cast<double>(stats.n_sends) / stats.n_writes << " pieces, "
+                << static_cast<double>(stats.n_bytes) / stats.n_writes << " bytes per syscall)";
+        }
+        out << ", " << stats.n_timer_flushes << " flushed after " << write_budget_.max_delay_us << " us\n";
+        return out.str();
+    }
 
-            // Convert messages to prompt
-            msg_ptrs.clear();
-            for (const auto& msg : messages) {
-                msg_ptrs.push_back(&msg);
+    void handle_control(Request request) {
+        LOG_INFO("Processing control message...");
+        
+        if (request.payload.size() >= sizeof(llxd_protocol::ControlCommand)) {
+            llxd_protocol::ControlCommand cmd = *reinterpret_cast<const llxd_protocol::ControlCommand*>(request.payload.data());
+            if (cmd == llxd_protocol::ControlCommand::SHUTDOWN) {
+                LOG_INFO("Received shutdown command. Initiating shutdown...");
+                request.stream->send("Shutting down llxd daemon...\n");
+                request.stream->end(llxd_protocol::FinishReason::STOP);
+                
+                // The main thread stops us, stopping here would deadlock
+                shutdown_requested_ = true;
+                return;
             }
-
-            // Apply template and generate reformatted response
-            formatted_prompt.clear();
-            if (llm_chat_apply_template(chat_template, msg_ptrs, formatted_prompt, true) < 0) {
-                std::cerr << "Failed to apply chat template for follow-up" << std::endl;
-                llama_free(ctx);
-                metrics_.on_request_end();
+            if (cmd == llxd_protocol::ControlCommand::MODELS) {
+                queue_dispatch(std::move(request));
                 return;
             }
-
-            // Send newline before follow-up response
-            const char* newline = "\n";
-            send(request.client_fd, newline, 1, MSG_NOSIGNAL);
-
-            // Tokenize and process follow-up prompt
-            tokens.clear();
-            tokens.resize(formatted_prompt.length() + 1);
-            n_tokens = llama_tokenize(vocab, formatted_prompt.c_str(), formatted_prompt.length(), 
-                                    tokens.data(), tokens.size(), true, true);
-            if (n_tokens < 0) {
-                std::cerr << "Failed to tokenize follow-up prompt" << std::endl;
-                llama_free(ctx);
-                metrics_.on_request_end();
+            if (cmd == llxd_protocol::ControlCommand::SWAP) {
+                swap_model(std::move(request.stream), request.payload.substr(sizeof(cmd)));
                 return;
             }
-            tokens.resize(n_tokens);
-
-            // Process follow-up response
-            batch = llama_batch_get_one(tokens.data(), tokens.size());
-            if (!batch.token) {
-                std::cerr << "Failed to create batch for follow-up" << std::endl;
-                llama_free(ctx);
-                metrics_.on_request_end();
+            if (cmd == llxd_protocol::ControlCommand::TRACE) {
+                // Dumping holds up the reactor for a few ms, fine for debugging
+                std::string argument = request.payload.substr(sizeof(cmd));
+                if (argument == "on" || argument == "off") {
+                    llxd_trace::enable(argument == "on");
+                    request.stream->send(std::string("Tracing ") + (argument == "on" ? "enabled" : "disabled") + "\n");
+                } else {
+                    request.stream->send(llxd_trace::dump_json());
+                }
+                request.stream->end(llxd_protocol::FinishReason::STOP);
                 return;
             }
-
-            logits_array = new int8_t[batch.n_tokens]();
-            logits_array[batch.n_tokens - 1] = 1;
-            batch.logits = logits_array;
-
-            if (llama_decode(ctx, batch)) {
-                std::cerr << "Failed to evaluate follow-up prompt" << std::endl;
-                delete[] logits_array;
-                llama_free(ctx);
-                metrics_.on_request_end();
+            if (cmd == llxd_protocol::ControlCommand::STATS) {
+                // Lock-free reads, answered right here even while models load
+                request.stream->send(metrics_.format_json());
+                request.stream->end(llxd_protocol::FinishReason::STOP);
                 return;
             }
-            delete[] logits_array;
-
-            // Generate follow-up response
-            response.clear();
-            found_newline = false;
-            found_backticks = false;
-
-            for (int i = 0; i < max_tokens; i++) {
-                t_start_token = ggml_time_us();
-                llama_token new_token = common_sampler_sample(sampler, ctx, -1);
-
-                if (new_token == llama_vocab_eos(vocab) || 
-                    llama_vocab_is_eog(vocab, new_token) ||
-                    (found_newline && (new_token == llama_vocab_bos(vocab) || new_token == llama_vocab_eos(vocab)))) {
-                    break;
-                }
-
-                char piece_buf[32];
-                int piece_len = llama_token_to_piece(vocab, new_token, piece_buf, sizeof(piece_buf), 0, true);
-                if (piece_len < 0 || piece_len >= (int)sizeof(piece_buf)) {
-                    break;
-                }
-                piece_buf[piece_len] = '\0';
-
-                std::string piece(piece_buf, piece_len);
-                if (piece.find("```") != std::string::npos) {
-                    found_backticks = true;
-                }
-
-                if (strchr(piece_buf, '\n') != nullptr) {
-                    found_newline = true;
-                }
-
-                // Send piece to client without any formatting
-                ssize_t sent = send(request.client_fd, piece_buf, piece_len, MSG_NOSIGNAL);
-                if (sent < 0) {
-                    break;
-                }
-
-                response += piece;
-                common_sampler_accept(sampler, new_token, true);
-
-                llama_batch next_batch = llama_batch_get_one(&new_token, 1);
-                if (!next_batch.token) {
-                    break;
-                }
-
-                next_batch.logits = next_logits;
-                next_batch.seq_id = seq_id_ptr_ptr;
-
-                if (llama_decode(ctx, next_batch)) {
-                    break;
-                }
+        }
+        request.stream->end(llxd_protocol::FinishReason::ERROR, "unknown control command");
+    }
 
-                t_end_token = ggml_time_us();
-                metrics_.on_token_generated(t_start_token, t_end_token);
-            }
+    // Load the new model in the background while the old one keeps
+    // serving, then reply once the old one has drained
+    void swap_model(std::unique_ptr<ResponseStream> stream, const std::string& spec) {
+        std::string id = default_model_id_;
+        std::string path = spec;
+        size_t eq = spec.find('=');
+        if (eq != std::string::npos && eq < spec.find('/')) {
+            id = spec.substr(0, eq);
+            path = spec.substr(eq + 1);
         }
 
-        // Log complete response
-        std::string log_response = "Complete LLM response for request:\n" + response;
-        LOG_INFO("%{public}s", log_response.c_str());
-        DEBUG_LOG(log_response);
+        {
+            std::unique_lock<std::mutex> lock(swap_mutex_);
+            n_swaps_++;
+        }
+        LOG_INFO("Swapping model " << id << " to " << path);
+        std::thread([this, stream = std::move(stream), id, path]() {
+            if (registry_->swap(id, path)) {
+                stream->send("Swapped model " + id + " to " + path + "\n");
+                stream->end(llxd_protocol::FinishReason::STOP);
+            } else {
+                stream->end(llxd_protocol::FinishReason::ERROR, "failed to swap model " + id + " to " + path);
+            }
 
-        // Cleanup
-        delete[] next_logits;
-        common_sampler_free(sampler);
-        llama_free(ctx);
-        metrics_.on_request_end();
+            std::unique_lock<std::mutex> lock(swap_mutex_);
+            n_swaps_--;
+            swap_done_.notify_all();
+        }).detach();
     }
 
     std::string model_path_;
+    std::vector<std::pair<std::string, std::string>> models_;
+    std::string models_dir_;
+    size_t model_budget_bytes_;
+    std::string default_model_id_;
     std::atomic<bool> running_;
-    bool debug_mode_;
+    int n_parallel_;
+    bool constrained_output_;
+    std::string draft_model_path_;
+    bool lookup_;
+    int n_draft_;
+    std::string response_cache_path_;
+    size_t response_cache_bytes_;
+    bool semantic_cache_enabled_;
+    std::string embed_model_path_;
+    float semantic_threshold_;
+    int semantic_capacity_;
+    bool warmup_;
+    int max_queue_;
+    int deadline_ms_;           // Default for requests without one, 0 for none
+    bool mock_;                 // Mock engine instead of llama.cpp, no model files
+    MockEngineParams mock_params_;
+    CpuTopology topology_;
+    int n_threads_;             // 0 lets each engine pick
+    int n_threads_batch_;
+    bool pin_threads_;
+    bool autotune_;
     int socket_fd_;
-    std::thread accept_thread_;
-    std::thread worker_thread_;
-    llama_model* model_;
+    bool owns_socket_path_;     // False for a socket handed over by a service manager
+    std::unique_ptr<Reactor> reactor_;
+    WriteBudget write_budget_;
+    std::thread dispatch_thread_;
+    std::thread load_thread_;
+    int64_t t_start_ = 0;
+    std::atomic<int> exit_code_{ 0 };
+    std::atomic<bool> shutdown_requested_{ false };    // By a client or a failed load
+    std::atomic<bool> stopped_{ false };
+
+    // Prompts on their way to a scheduler. They wait here until the
+    // default model is loaded, load progress and readiness go to ready_fd_.
+    std::mutex dispatch_mutex_;
+    std::condition_variable dispatch_ready_;
+    std::queue<Request> dispatch_queue_;
+    uint64_t n_requests_ = 0;
+    bool load_done_ = false;
+    bool models_loaded_ = false;
+    std::atomic<int> ready_fd_;
+    int load_percent_ = -1;
+    llama_model* draft_model_ = nullptr;
+    llama_model* embed_model_ = nullptr;
+    llama_model* semantic_model_ = nullptr;    // Model the semantic cache was built for
+
+    // Swaps run on their own threads, stop() waits for them
+    std::mutex swap_mutex_;
+    std::condition_variable swap_done_;
+    int n_swaps_ = 0;
+    std::mutex cold_mutex_;
+    std::condition_variable cold_done_;
+    std::map<std::string, std::vector<Request>> cold_loads_;    // Waiting for their model to load
+    int n_cold_loads_ = 0;
 
-    std::queue<Request> request_queue_;
-    std::mutex queue_mutex_;
-    std::condition_variable queue_condition_;
     Metrics metrics_;
-    llama_seq_id seq_id = 0;  // The sequence ID value
-    llama_seq_id* seq_id_ptr = &seq_id;  // Pointer to the sequence ID
-    llama_seq_id** seq_id_ptr_ptr = &seq_id_ptr;  // Pointer to the pointer
+    std::unique_ptr<ResponseCache> response_cache_;
+    std::shared_ptr<SemanticCache> semantic_cache_;
+    std::unique_ptr<ModelRegistry> registry_;
 };
 
+static llxd_options make_options(const std::string& model_path, bool debug_mode) {
+    llxd_options options;
+    options.model_path = model_path;
+    options.debug_mode = debug_mode;
+    return options;
+}
+
 llxd::llxd(const std::string& model_path, bool debug_mode)
-    : impl(std::make_unique<Impl>(model_path, debug_mode)) {}
+    : llxd(make_options(model_path, debug_mode)) {}
+
+llxd::llxd(const llxd_options& options)
+    : impl(std::make_unique<Impl>(options)) {}
 
 llxd::~llxd() = default;
 
@@ -778,3 +852,11 @@ bool llxd::start() {
 void llxd::stop() {
     impl->stop();
 }
+
+bool llxd::shutdown_requested() const {
+    return impl->shutdown_requested();
+}
+
+int llxd::exit_code() const {
+    return impl->exit_code();
+}
@@ -2,19 +2,70 @@
 #define LLXD_H
 
 #include <string>
+#include <vector>
+#include <utility>
 #include <memory>
 
+// Daemon configuration
+struct llxd_options {
+    std::string model_path;             // Default model, always resident
+    std::vector<std::pair<std::string, std::string>> models; // Extra models, id and path
+    std::string models_dir;             // Unknown ids load <models_dir>/<id>.gguf
+    size_t model_budget_mb = 0;         // Weights kept resident, 0 for no limit
+    bool debug_mode = false;            // Log at debug level
+    std::string log_level;              // debug, info, warn or error, info if empty
+    std::string log_file;               // Empty logs to stderr
+    bool log_system = false;            // Also log to syslog, os_log is always on on macOS
+    int n_parallel = 4;         // Concurrent sequences in the shared context
+    bool constrained_output = false; // Grammar-constrained ```bash block output
+    std::string draft_model_path;       // Empty disables speculative decoding
+    bool lookup = false;                // N-gram lookup drafts, no draft model needed
+    int n_draft = 8;                    // Maximum draft tokens per step
+    std::string response_cache_path;    // Empty disables the response cache
+    size_t response_cache_mb = 64;
+    bool semantic_cache = false;        // Serve paraphrases from the response cache
+    std::string embed_model_path;       // Empty embeds with the serving model
+    float semantic_threshold = 0.95f;
+    int semantic_capacity = 2048;       // Prompts kept in the vector index
+    bool warmup = false;                // Page in weights and run a dummy request before serving
+    int listen_fd = -1;                 // Already listening socket to serve, else bind /tmp/llx.sock
+    int ready_fd = -1;                  // Receives load progress and readiness, see protocol.h
+    size_t coalesce_bytes = 4096;       // Streamed text held back per connection, at most this much
+    int coalesce_us = 1000;             // and for at most this long, 0 writes every piece at once
+    int max_queue = 64;                 // Requests waiting per model before new ones are shed, 0 for no limit
+    int deadline_ms = 30000;            // Default time a request may wait to start, 0 for no limit
+    bool trace = false;                 // Record spans from the start, see trace.h
+    bool mock = false;                  // Serve from the mock engine, no model is loaded
+    std::string mock_script;            // Mock answer, a fenced command if empty
+    double mock_tokens_per_sec = 50;    // Mock decode steps per second
+    double mock_prefill_tokens_per_sec = 2000;
+    int mock_latency_ms = 0;            // Added to every mock decode
+    int n_threads = 0;                  // Decode threads, 0 picks them for the CPU
+    int n_threads_batch = 0;            // Prefill threads, likewise
+    bool pin_threads = true;            // One inference thread per core on Linux
+    bool autotune = false;              // Measure thread counts per model at load and save them
+};
+
 class llxd {
 public:
     llxd(const std::string& model_path, bool debug_mode = false);
+    explicit llxd(const llxd_options& options);
     ~llxd();
 
     // Start the daemon
     bool start();
 
-    // Stop the daemon
+    // Stop the daemon, draining requests in flight. Returns once
+    // everything is freed, the log included, later calls do nothing.
     void stop();
 
+    // A client sent SHUTDOWN or the model failed to load, the caller
+    // should stop() the daemon
+    bool shutdown_requested() const;
+
+    // 1 when the model failed to load
+    int exit_code() const;
+
 private:
     class Impl;
     std::unique_ptr<Impl> impl;
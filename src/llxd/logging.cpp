@@ -0,0 +1,281 @@
+#include "logging.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <vector>
+#include <unordered_map>
+
+#ifdef __APPLE__
+#include <os/log.h>
+#else
+#include <syslog.h>
+#endif
+
+namespace llxd_log {
+
+std::atomic<int> g_level{ static_cast<int>(Level::Info) };
+
+namespace {
+
+// Messages waiting for the drain thread, a power of two
+constexpr size_t RING_CAPACITY = 8192;
+
+// Drain thread sleep while the ring is empty
+constexpr int DRAIN_INTERVAL_MS = 10;
+
+struct Entry {
+    Level level = Level::Info;
+    const char* category = "";
+    int64_t time_us = 0;        // Since the epoch
+    std::string text;
+};
+
+// Bounded multi-producer queue. Each cell's sequence tells whose turn it
+// is: equal to a position, the cell is free for the producer claiming
+// that position, one past it, the entry is ready for the consumer.
+class Ring {
+public:
+    Ring() : cells_(RING_CAPACITY) {
+        for (size_t i = 0; i < RING_CAPACITY; i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // False when full
+    bool push(Entry&& entry) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & (RING_CAPACITY - 1)];
+            const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.entry = std::move(entry);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Only called by the drain thread
+    bool pop(Entry& entry) {
+        Cell& cell = cells_[head_ & (RING_CAPACITY - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != head_ + 1) {
+            return false;
+        }
+        entry = std::move(cell.entry);
+        cell.sequence.store(head_ + RING_CAPACITY, std::memory_order_release);
+        head_++;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence{ 0 };
+        Entry entry;
+    };
+
+    std::vector<Cell> cells_;
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+    alignas(64) size_t head_ = 0;
+};
+
+struct Logger {
+    Ring ring;
+    std::atomic<uint64_t> n_dropped{ 0 };
+
+    // Owned by the drain thread while it runs
+    std::thread thread;
+    std::atomic<bool> running{ false };
+    FILE* out = stderr;
+    bool system_log = false;
+#ifdef __APPLE__
+    std::unordered_map<const char*, os_log_t> os_logs;  // By category, they are literals
+#endif
+};
+
+Logger& logger() {
+    static Logger instance;
+    return instance;
+}
+
+const char* level_name(Level level) {
+    switch (level) {
+        case Level::Debug: return "DEBUG";
+        case Level::Info:  return "INFO";
+        case Level::Warn:  return "WARN";
+        case Level::Error: return "ERROR";
+    }
+    return "";
+}
+
+void write_entry(Logger& log, const Entry& entry) {
+    const time_t seconds = static_cast<time_t>(entry.time_us / 1000000);
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    // Reports that end their last line would leave an empty one
+    int length = static_cast<int>(entry.text.size());
+    while (length > 0 && entry.text[length - 1] == '\n') {
+        length--;
+    }
+    fprintf(log.out, "%s.%03d %-5s %s: %.*s\n", stamp, static_cast<int>(entry.time_us / 1000 % 1000),
+            level_name(entry.level), entry.category, length, entry.text.c_str());
+
+#ifdef __APPLE__
+    os_log_t& os_logger = log.os_logs[entry.category];
+    if (!os_logger) {
+        os_logger = os_log_create("com.llx.daemon", entry.category);
+    }
+    os_log_type_t type = OS_LOG_TYPE_DEFAULT;
+    switch (entry.level) {
+        case Level::Debug: type = OS_LOG_TYPE_DEBUG; break;
+        case Level::Info:  type = OS_LOG_TYPE_INFO; break;
+        case Level::Warn:  type = OS_LOG_TYPE_DEFAULT; break;
+        case Level::Error: type = OS_LOG_TYPE_ERROR; break;
+    }
+    os_log_with_type(os_logger, type, "%{public}s", entry.text.c_str());
+#else
+    if (log.system_log) {
+        int priority = LOG_INFO;
+        switch (entry.level) {
+            case Level::Debug: priority = LOG_DEBUG; break;
+            case Level::Info:  priority = LOG_INFO; break;
+            case Level::Warn:  priority = LOG_WARNING; break;
+            case Level::Error: priority = LOG_ERR; break;
+        }
+        syslog(priority, "%s: %s", entry.category, entry.text.c_str());
+    }
+#endif
+}
+
+// Write everything queued, true if there was anything
+bool drain(Logger& log) {
+    Entry entry;
+    bool any = false;
+    while (log.ring.pop(entry)) {
+        write_entry(log, entry);
+        any = true;
+    }
+
+    const uint64_t n_dropped = log.n_dropped.exchange(0, std::memory_order_relaxed);
+    if (n_dropped > 0) {
+        fprintf(log.out, "Log ring full, dropped %llu messages\n", static_cast<unsigned long long>(n_dropped));
+        any = true;
+    }
+    if (any) {
+        fflush(log.out);
+    }
+    return any;
+}
+
+void drain_loop(Logger& log) {
+    while (log.running.load(std::memory_order_acquire)) {
+        if (!drain(log)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+        }
+    }
+    drain(log);
+}
+
+} // namespace
+
+bool parse_level(const std::string& name, Level& level) {
+    if (name == "debug") {
+        level = Level::Debug;
+    } else if (name == "info") {
+        level = Level::Info;
+    } else if (name == "warn") {
+        level = Level::Warn;
+    } else if (name == "error") {
+        level = Level::Error;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void set_level(Level level) {
+    g_level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+bool start(const Config& config) {
+    Logger& log = logger();
+    if (log.running) {
+        return true;
+    }
+    set_level(config.level);
+
+    bool ok = true;
+    if (!config.file_path.empty()) {
+        FILE* file = fopen(config.file_path.c_str(), "a");
+        if (file) {
+            log.out = file;
+        } else {
+            fprintf(stderr, "Failed to open log file %s, logging to stderr\n", config.file_path.c_str());
+            ok = false;
+        }
+    }
+
+    log.system_log = config.system_log;
+#ifndef __APPLE__
+    if (log.system_log) {
+        openlog("llxd", LOG_PID, LOG_DAEMON);
+    }
+#endif
+
+    log.running = true;
+    log.thread = std::thread(drain_loop, std::ref(log));
+    return ok;
+}
+
+void stop() {
+    Logger& log = logger();
+    if (!log.running.exchange(false)) {
+        return;
+    }
+    log.thread.join();
+
+    if (log.out != stderr) {
+        fclose(log.out);
+        log.out = stderr;
+    }
+#ifndef __APPLE__
+    if (log.system_log) {
+        closelog();
+    }
+#endif
+}
+
+std::ostringstream& stream() {
+    thread_local std::ostringstream out;
+    out.str(std::string());
+    out.clear();
+    return out;
+}
+
+void submit(Level level, const char* category, std::ostringstream& stream) {
+    Entry entry;
+    entry.level = level;
+    entry.category = category;
+    entry.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    entry.text = stream.str();
+
+    Logger& log = logger();
+    if (!log.ring.push(std::move(entry))) {
+        log.n_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+} // namespace llxd_log
@@ -1,46 +1,84 @@
-#pragma once
+#ifndef LLXD_LOGGING_H
+#define LLXD_LOGGING_H
 
-#include <os/log.h>
+#include <atomic>
 #include <sstream>
 #include <string>
 
-// Define OS_LOG_CATEGORY_INIT if not already defined (for macOS)
-#ifndef OS_LOG_CATEGORY_INIT
-#define OS_LOG_CATEGORY_INIT(name) name
+// Asynchronous logging.
+//
+// A message is formatted on the calling thread into a thread-local
+// stream and pushed to a bounded lock-free ring, a background thread
+// drains the ring into the sinks. Callers never wait on a sink or a
+// lock: when the ring is full the message is dropped and counted, and
+// the drain thread reports how many were lost.
+//
+// Levels below LLXD_LOG_MIN_LEVEL are compiled out, the statements stay
+// type checked but generate no code. Levels below the runtime level
+// cost one relaxed load and never format their arguments.
+//
+// Sinks are stderr or a file, and optionally the system log: syslog,
+// which journald collects, on Linux and os_log on macOS, where it is
+// always on.
+
+// 0 debug, 1 info, 2 warn, 3 error
+#ifndef LLXD_LOG_MIN_LEVEL
+#define LLXD_LOG_MIN_LEVEL 0
 #endif
 
-// Macro to convert stream to string
-#define STREAM_TO_STRING(x) (static_cast<std::ostringstream&>(std::ostringstream() << x).str())
+namespace llxd_log {
 
-// Logging macros that properly handle stream operations and format strings
-#define LOG_INFO(format, ...) \
-    do { \
-        os_log_info(logger, format, ##__VA_ARGS__); \
-    } while(0)
+enum class Level { Debug = 0, Info = 1, Warn = 2, Error = 3 };
 
-#define LOG_ERROR(format, ...) \
-    do { \
-        os_log_error(logger, format, ##__VA_ARGS__); \
-    } while(0)
+struct Config {
+    Level level = Level::Info;
+    std::string file_path;      // Append here instead of stderr
+    bool system_log = false;    // Also send to syslog, always on with os_log on macOS
+};
 
-#define LOG_DEBUG(format, ...) \
-    do { \
-        os_log_debug(logger, format, ##__VA_ARGS__); \
-    } while(0)
+extern std::atomic<int> g_level;
 
-#define LOG_FAULT(format, ...) \
-    do { \
-        os_log_fault(logger, format, ##__VA_ARGS__); \
-    } while(0)
+inline bool enabled(Level level) {
+    return static_cast<int>(level) >= g_level.load(std::memory_order_relaxed);
+}
+
+// Parse debug, info, warn or error
+bool parse_level(const std::string& name, Level& level);
+
+void set_level(Level level);
+
+// Open the sinks and start the drain thread. Messages logged earlier
+// wait in the ring.
+bool start(const Config& config);
 
-// Debug logging macro that handles stream operations
-#define DEBUG_LOG(x) \
+// Drain what is left and stop the thread
+void stop();
+
+// Cleared stream of the calling thread, to format one message into
+std::ostringstream& stream();
+
+// Queue the message formatted into stream()
+void submit(Level level, const char* category, std::ostringstream& stream);
+
+} // namespace llxd_log
+
+#define LLXD_LOG(level, category, x) \
     do { \
-        if (debug_mode_) { \
-            std::ostringstream ss; \
-            ss << x; \
-            std::string msg = ss.str(); \
-            std::cout << "[DEBUG] " << msg << std::endl; \
-            os_log_debug(logger, "%{public}s", msg.c_str()); \
+        if constexpr (static_cast<int>(level) >= LLXD_LOG_MIN_LEVEL) { \
+            if (llxd_log::enabled(level)) { \
+                std::ostringstream& llxd_log_stream = llxd_log::stream(); \
+                llxd_log_stream << x; \
+                llxd_log::submit(level, category, llxd_log_stream); \
+            } \
         } \
-    } while(0) 
\ No newline at end of file
+    } while (0)
+
+// Stream-style logging under the file's LOG_CATEGORY
+#define LOG_DEBUG(x) LLXD_LOG(llxd_log::Level::Debug, LOG_CATEGORY, x)
+#define LOG_INFO(x) LLXD_LOG(llxd_log::Level::Info, LOG_CATEGORY, x)
+#define LOG_WARN(x) LLXD_LOG(llxd_log::Level::Warn, LOG_CATEGORY, x)
+#define LOG_ERROR(x) LLXD_LOG(llxd_log::Level::Error, LOG_CATEGORY, x)
+
+#define DEBUG_LOG(x) LOG_DEBUG(x)
+
+#endif // LLXD_LOGGING_H
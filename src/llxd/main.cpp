@@ -1,4 +1,6 @@
 #include "llxd.h"
+#include "trace.h"
+#include "logging.h"
 #include <signal.h>
 #include <unistd.h>
 #include <iostream>
@@ -8,6 +10,7 @@
 #include <cstdlib>
 #include <curl/curl.h>
 #include <fstream>
+#include <iterator>
 
 #ifndef LLX_VERSION
 #define LLX_VERSION "unknown"
@@ -44,15 +47,17 @@ bool download_file(const std::string& url, const std::string& output_path) {
     return res == CURLE_OK;
 }
 
-static llxd* g_daemon = nullptr;
+static const char* const LOG_CATEGORY = "main";
+
 static std::atomic<bool> g_running(true);
+static std::atomic<int> g_signal(0);
+static std::atomic<bool> g_dump_trace(false);
 
+// Only flags the main loop, which stops the daemon: stopping takes locks
+// and joins threads, none of which is safe in a handler
 void signal_handler(int sig) {
-    if (g_daemon) {
-        std::cout << "\nReceived signal " << sig << ", shutting down..." << std::endl;
-        g_daemon->stop();
-        g_running = false;  // Signal the main loop to exit
-    }
+    g_signal = sig;
+    g_running = false;
 }
 
 int main(int argc, char** argv) {
@@ -65,23 +70,124 @@ int main(int argc, char** argv) {
         }
     }
 
-    std::string model_path;
-    bool debug_mode = false;
+    llxd_options options;
+    bool use_response_cache = true;
     const std::string DEFAULT_MODEL = "Llama-3.2-3B-Instruct-Q4_K_M.gguf";
     const std::string MODEL_URL = "https://huggingface.co/bartowski/Llama-3.2-3B-Instruct-GGUF/resolve/main/Llama-3.2-3B-Instruct-Q4_K_M.gguf";
 
+    // A daemon started by llx has no flags to set the level with
+    if (const char* log_level = std::getenv("LLXD_LOG_LEVEL")) {
+        options.log_level = log_level;
+    }
+
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
         if (arg == "-m" && i + 1 < argc) {
-            model_path = argv[++i];
+            options.model_path = argv[++i];
+        } else if (arg == "--model" && i + 1 < argc) {
+            // Extra model as id=path, loaded on first use
+            std::string spec = argv[++i];
+            size_t eq = spec.find('=');
+            if (eq == std::string::npos || eq == 0) {
+                std::cerr << "Expected --model <id>=<path>, got: " << spec << std::endl;
+                return 1;
+            }
+            options.models.emplace_back(spec.substr(0, eq), spec.substr(eq + 1));
+        } else if (arg == "--models-dir" && i + 1 < argc) {
+            options.models_dir = argv[++i];
+        } else if (arg == "--model-budget-mb" && i + 1 < argc) {
+            options.model_budget_mb = std::strtoul(argv[++i], nullptr, 10);
         } else if (arg == "-d") {
-            debug_mode = true;
+            options.debug_mode = true;
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            options.log_level = argv[++i];
+        } else if (arg == "--log-file" && i + 1 < argc) {
+            options.log_file = argv[++i];
+        } else if (arg == "--syslog") {
+            options.log_system = true;
+        } else if ((arg == "-np" || arg == "--parallel") && i + 1 < argc) {
+            options.n_parallel = std::atoi(argv[++i]);
+        } else if (arg == "-md" && i + 1 < argc) {
+            options.draft_model_path = argv[++i];
+        } else if (arg == "--lookup") {
+            options.lookup = true;
+        } else if (arg == "--draft-max" && i + 1 < argc) {
+            options.n_draft = std::atoi(argv[++i]);
+        } else if (arg == "--grammar") {
+            options.constrained_output = true;
+        } else if (arg == "--response-cache" && i + 1 < argc) {
+            options.response_cache_path = argv[++i];
+        } else if (arg == "--response-cache-mb" && i + 1 < argc) {
+            options.response_cache_mb = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--no-response-cache") {
+            use_response_cache = false;
+        } else if (arg == "--semantic-cache") {
+            options.semantic_cache = true;
+        } else if (arg == "--embed-model" && i + 1 < argc) {
+            options.embed_model_path = argv[++i];
+            options.semantic_cache = true;
+        } else if (arg == "--semantic-threshold" && i + 1 < argc) {
+            options.semantic_threshold = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--warmup") {
+            options.warmup = true;
+        } else if (arg == "--listen-fd" && i + 1 < argc) {
+            options.listen_fd = std::atoi(argv[++i]);
+        } else if (arg == "--ready-fd" && i + 1 < argc) {
+            options.ready_fd = std::atoi(argv[++i]);
+        } else if (arg == "--coalesce-bytes" && i + 1 < argc) {
+            options.coalesce_bytes = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--coalesce-us" && i + 1 < argc) {
+            options.coalesce_us = std::atoi(argv[++i]);
+        } else if (arg == "--max-queue" && i + 1 < argc) {
+            options.max_queue = std::atoi(argv[++i]);
+        } else if (arg == "--deadline-ms" && i + 1 < argc) {
+            options.deadline_ms = std::atoi(argv[++i]);
+        } else if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+            options.n_threads = std::atoi(argv[++i]);
+        } else if ((arg == "-tb" || arg == "--threads-batch") && i + 1 < argc) {
+            options.n_threads_batch = std::atoi(argv[++i]);
+        } else if (arg == "--no-pin") {
+            options.pin_threads = false;
+        } else if (arg == "--autotune") {
+            options.autotune = true;
+        } else if (arg == "--trace") {
+            options.trace = true;
+        } else if (arg == "--mock") {
+            options.mock = true;
+        } else if (arg == "--mock-script" && i + 1 < argc) {
+            std::ifstream script(argv[++i], std::ios::binary);
+            if (!script) {
+                std::cerr << "Failed to open mock script: " << argv[i] << std::endl;
+                return 1;
+            }
+            options.mock_script.assign(std::istreambuf_iterator<char>(script), std::istreambuf_iterator<char>());
+            options.mock = true;
+        } else if (arg == "--mock-tps" && i + 1 < argc) {
+            options.mock_tokens_per_sec = std::strtod(argv[++i], nullptr);
+            options.mock = true;
+        } else if (arg == "--mock-prefill-tps" && i + 1 < argc) {
+            options.mock_prefill_tokens_per_sec = std::strtod(argv[++i], nullptr);
+            options.mock = true;
+        } else if (arg == "--mock-latency-ms" && i + 1 < argc) {
+            options.mock_latency_ms = std::atoi(argv[++i]);
+            options.mock = true;
         }
     }
 
+    llxd_log::Level log_level;
+    if (!options.log_level.empty() && !llxd_log::parse_level(options.log_level, log_level)) {
+        std::cerr << "Expected --log-level debug, info, warn or error, got: " << options.log_level << std::endl;
+        return 1;
+    }
+
+    // The mock engine needs no model file, it only names the default model
+    if (options.mock && options.model_path.empty()) {
+        options.model_path = "mock";
+    }
+
     // If no model path provided, use cached model
-    if (model_path.empty()) {
+    if (options.model_path.empty()) {
         // Get home directory
         const char* home = std::getenv("HOME");
         if (!home) {
@@ -109,28 +215,75 @@ int main(int argc, char** argv) {
             std::cout << "Model download complete." << std::endl;
         }
 
-        model_path = model_file.string();
+        options.model_path = model_file.string();
+    }
+
+    // Same models directory as llx uses for downloads
+    if (options.models_dir.empty()) {
+        const char* env_models_dir = std::getenv("LLX_MODELS_DIR");
+        const char* home = std::getenv("HOME");
+        if (env_models_dir && *env_models_dir) {
+            options.models_dir = env_models_dir;
+        } else if (home) {
+            options.models_dir = (fs::path(home) / ".cache" / "llx" / "models").string();
+        }
+    }
+
+    // Response cache lives next to the default model unless overridden
+    if (!use_response_cache) {
+        options.response_cache_path.clear();
+    } else if (options.response_cache_path.empty()) {
+        if (const char* home = std::getenv("HOME")) {
+            fs::path cache_dir = fs::path(home) / ".cache" / "llx";
+            std::error_code ec;
+            fs::create_directories(cache_dir, ec);
+            options.response_cache_path = (cache_dir / "responses.cache").string();
+        }
+    }
+
+    // Socket activation: a service manager passes the listening socket as
+    // fd 3 and names the receiving process in LISTEN_PID, as systemd does
+    const char* listen_pid = std::getenv("LISTEN_PID");
+    const char* listen_fds = std::getenv("LISTEN_FDS");
+    if (options.listen_fd < 0 && listen_pid && listen_fds &&
+        std::atoi(listen_pid) == getpid() && std::atoi(listen_fds) >= 1) {
+        options.listen_fd = 3;
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
     }
 
     // Set up signal handlers
+    signal(SIGPIPE, SIG_IGN);  // A starter that stopped waiting closes the ready fd
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
+    signal(SIGUSR1, [](int) { g_dump_trace = true; });  // Written by the main loop
 
     // Create and start daemon
-    llxd daemon(model_path, debug_mode);
-    g_daemon = &daemon;
+    llxd daemon(options);
 
     if (!daemon.start()) {
-        std::cerr << "Failed to start daemon" << std::endl;
+        LOG_ERROR("Failed to start daemon");
         return 1;
     }
 
     // Wait for signals, but check g_running flag
-    while (g_running) {
-        sleep(1);  // Sleep for short intervals instead of indefinite pause
+    while (g_running && !daemon.shutdown_requested()) {
+        sleep(1);  // Sleep for short intervals instead of indefinite pause, signals cut it short
+        if (g_dump_trace.exchange(false)) {
+            std::string path = "/tmp/llxd-trace-" + std::to_string(getpid()) + ".json";
+            if (llxd_trace::dump_file(path)) {
+                LOG_INFO("Wrote trace to " << path);
+            }
+        }
+    }
+
+    if (g_signal != 0) {
+        LOG_INFO("Received signal " << g_signal << ", shutting down...");
     }
+    daemon.stop();
 
+    // The log is stopped with the daemon
     std::cout << "Cleanup complete, exiting." << std::endl;
-    return 0;
+    return daemon.exit_code();
 } 
\ No newline at end of file
@@ -0,0 +1,396 @@
+#ifndef LLXD_METRICS_H
+#define LLXD_METRICS_H
+
+#include "ggml.h"
+#include "histogram.h"
+#include "logging.h"
+
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <atomic>
+
+// Per-request metrics, owned by the slot serving the request
+struct RequestMetrics {
+    uint64_t n_prompt_tokens_processed = 0;
+    uint64_t n_prompt_tokens_cached = 0;         // reused from the system prompt KV
+    uint64_t t_prompt_processing = 0;            // us
+    uint64_t n_tokens_predicted = 0;
+    uint64_t t_tokens_generation = 0;            // us
+
+    // From arrival at the scheduler, 0 when nothing was streamed
+    uint64_t t_first_token = 0;                  // us
+    uint64_t t_total = 0;                        // us
+    bool failed = false;                         // Ended with an error
+
+    // Follow-up reformat pass, accounted separately from the first pass
+    bool in_repair = false;
+    uint64_t n_repair_prompt_tokens = 0;
+    uint64_t t_repair_prompt = 0;                // us
+    uint64_t n_repair_tokens_predicted = 0;
+    uint64_t t_repair_generation = 0;            // us
+
+    // Speculative decoding
+    uint64_t n_draft_tokens = 0;
+    uint64_t n_draft_accepted = 0;
+
+    // The client went away before the answer was complete
+    bool cancelled = false;
+    uint64_t n_cancelled_tokens = 0;             // decoded for it, wasted
+
+    void on_prompt_eval(int n_tokens, int64_t t_start_us, int64_t t_end_us) {
+        if (in_repair) {
+            n_repair_prompt_tokens += n_tokens;
+            t_repair_prompt += t_end_us - t_start_us;
+            return;
+        }
+        n_prompt_tokens_processed += n_tokens;
+        t_prompt_processing += t_end_us - t_start_us;
+    }
+
+    // n_tokens is more than one when a decode verified accepted draft tokens
+    void on_token_generated(int64_t t_start_us, int64_t t_end_us, int n_tokens = 1) {
+        if (in_repair) {
+            n_repair_tokens_predicted += n_tokens;
+            t_repair_generation += t_end_us - t_start_us;
+            return;
+        }
+        n_tokens_predicted += n_tokens;
+        t_tokens_generation += t_end_us - t_start_us;
+    }
+
+    void on_draft(int n_drafted, int n_accepted) {
+        n_draft_tokens += n_drafted;
+        n_draft_accepted += n_accepted;
+    }
+};
+
+// Daemon wide metrics, shared by every scheduler. Updates are lock-free
+// atomics, cheap enough for the token loop, and a snapshot can be taken
+// at any time without stopping generation.
+struct Metrics {
+    using Counter = std::atomic<uint64_t>;
+
+    int64_t t_start = 0;
+
+    // Total metrics since daemon start
+    Counter n_prompt_tokens_processed_total{ 0 };
+    Counter n_prompt_tokens_cached_total{ 0 };
+    Counter t_prompt_processing_total{ 0 };      // us
+    Counter n_tokens_predicted_total{ 0 };
+    Counter t_tokens_generation_total{ 0 };      // us
+    Counter n_errors{ 0 };
+
+    // Slot pool
+    Counter n_context_leases{ 0 };
+    Counter n_context_waits{ 0 };
+    Counter t_context_wait_total{ 0 };           // us
+
+    // Continuous batching
+    Counter n_batches{ 0 };
+    Counter n_batch_tokens_total{ 0 };
+    Counter n_batch_sequences_total{ 0 };
+    Counter t_batch_total{ 0 };                  // us
+
+    // Repair passes
+    Counter n_repair_passes{ 0 };
+    Counter n_repair_prompt_tokens_total{ 0 };
+    Counter n_repair_tokens_predicted_total{ 0 };
+    Counter t_repair_total{ 0 };                 // us
+
+    // Speculative decoding
+    Counter n_draft_tokens_total{ 0 };
+    Counter n_draft_accepted_total{ 0 };
+
+    // Response cache
+    Counter n_cache_hits{ 0 };
+    Counter n_cache_misses{ 0 };
+    Counter n_semantic_hits{ 0 };
+    Counter n_semantic_misses{ 0 };
+    Histogram semantic_lookup;                   // us, embedding plus index scan
+
+    // Admission control
+    Counter n_shed_full{ 0 };                    // Queue at max depth
+    Counter n_shed_deadline{ 0 };                // Estimated wait past the deadline
+    Counter n_expired{ 0 };                      // Deadline passed while queued
+    Counter max_queue_depth{ 0 };
+
+    // Clients that went away, while queued or in flight
+    Counter n_cancelled_queued{ 0 };
+    Counter n_cancelled_running{ 0 };
+    Counter n_cancelled_tokens_total{ 0 };
+    Counter n_aborted_decodes{ 0 };
+
+    // Stats
+    Counter n_requests_processed{ 0 };
+    Counter n_active_requests{ 0 };
+
+    // Latency distributions, us unless noted
+    Histogram queue_wait;
+    Histogram time_to_first_token;               // From arrival at the scheduler
+    Histogram inter_token;
+    Histogram end_to_end;
+    Histogram prefill_rate;                      // Prompt tokens per second
+
+    void init() {
+        t_start = ggml_time_us();
+    }
+
+    static void record_max(Counter& target, uint64_t value) {
+        uint64_t current = target.load(std::memory_order_relaxed);
+        while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    void on_context_lease(bool waited, int64_t t_wait_us) {
+        n_context_leases++;
+        if (waited) {
+            n_context_waits++;
+            t_context_wait_total += t_wait_us;
+        }
+    }
+
+    void on_batch(int n_tokens, int n_sequences, int64_t t_start_us, int64_t t_end_us) {
+        n_batches++;
+        n_batch_tokens_total += n_tokens;
+        n_batch_sequences_total += n_sequences;
+        t_batch_total += t_end_us - t_start_us;
+    }
+
+    void on_cache_lookup(bool hit) {
+        if (hit) {
+            n_cache_hits++;
+        } else {
+            n_cache_misses++;
+        }
+    }
+
+    void on_semantic_lookup(bool hit, int64_t t_lookup_us) {
+        if (hit) {
+            n_semantic_hits++;
+        } else {
+            n_semantic_misses++;
+        }
+        semantic_lookup.record(t_lookup_us);
+    }
+
+    void on_queued(size_t depth) {
+        record_max(max_queue_depth, depth);
+    }
+
+    void on_dequeued(int64_t t_wait_us) {
+        queue_wait.record(t_wait_us);
+    }
+
+    // Gap since the previous decode of a request that produced n_tokens
+    void on_inter_token(int64_t t_gap_us, int n_tokens) {
+        if (n_tokens > 0) {
+            inter_token.record(t_gap_us / n_tokens, n_tokens);
+        }
+    }
+
+    void on_shed(bool queue_full) {
+        if (queue_full) {
+            n_shed_full++;
+        } else {
+            n_shed_deadline++;
+        }
+    }
+
+    void on_expired() {
+        n_expired++;
+    }
+
+    // A request turned down before reaching a scheduler
+    void on_error() {
+        n_errors++;
+    }
+
+    void on_cancelled_in_queue() {
+        n_cancelled_queued++;
+    }
+
+    void on_decode_aborted() {
+        n_aborted_decodes++;
+    }
+
+    void on_request_start() {
+        n_active_requests++;
+        n_requests_processed++;
+    }
+
+    void on_request_end(const RequestMetrics& request) {
+        n_active_requests--;
+
+        n_prompt_tokens_processed_total += request.n_prompt_tokens_processed;
+        n_prompt_tokens_cached_total += request.n_prompt_tokens_cached;
+        t_prompt_processing_total += request.t_prompt_processing;
+        n_tokens_predicted_total += request.n_tokens_predicted;
+        t_tokens_generation_total += request.t_tokens_generation;
+
+        n_draft_tokens_total += request.n_draft_tokens;
+        n_draft_accepted_total += request.n_draft_accepted;
+
+        if (request.failed) {
+            n_errors++;
+        }
+        if (request.cancelled) {
+            n_cancelled_running++;
+            n_cancelled_tokens_total += request.n_cancelled_tokens;
+        }
+
+        if (request.in_repair) {
+            n_repair_passes++;
+            n_repair_prompt_tokens_total += request.n_repair_prompt_tokens;
+            n_repair_tokens_predicted_total += request.n_repair_tokens_predicted;
+            t_repair_total += request.t_repair_prompt + request.t_repair_generation;
+        }
+
+        if (request.t_first_token > 0) {
+            time_to_first_token.record(request.t_first_token);
+        }
+        if (request.t_total > 0) {
+            end_to_end.record(request.t_total);
+        }
+        if (request.n_prompt_tokens_processed > 0 && request.t_prompt_processing > 0) {
+            prefill_rate.record(request.n_prompt_tokens_processed * 1000000 / request.t_prompt_processing);
+        }
+
+        // Reports are formatted only when their level is on, the totals
+        // every ten requests
+        if (request.n_tokens_predicted > 0 || request.cancelled || request.in_repair) {
+            LLXD_LOG(llxd_log::Level::Debug, "metrics", format_request(request));
+        }
+        const uint64_t n_requests = n_requests_processed;
+        if (n_requests % 10 == 0) {
+            LLXD_LOG(llxd_log::Level::Info, "metrics", format_totals(n_requests));
+        }
+    }
+
+    static std::string format_request(const RequestMetrics& request) {
+        std::ostringstream out;
+        out << "Request Metrics:\n";
+        if (request.n_tokens_predicted > 0) {
+            double prompt_tokens_per_sec = request.n_prompt_tokens_processed / (request.t_prompt_processing / 1e6);
+            double gen_tokens_per_sec = request.n_tokens_predicted / (request.t_tokens_generation / 1e6);
+            out << "Prompt processing: " << request.n_prompt_tokens_processed << " tokens, "
+                << request.t_prompt_processing / 1e3 << " ms (" << prompt_tokens_per_sec << " tokens/sec), "
+                << request.n_prompt_tokens_cached << " cached prefix tokens\n";
+            out << "Token generation: " << request.n_tokens_predicted << " tokens, "
+                << request.t_tokens_generation / 1e3 << " ms (" << gen_tokens_per_sec << " tokens/sec)\n";
+            if (request.n_draft_tokens > 0) {
+                out << "Speculative: " << request.n_draft_accepted << "/" << request.n_draft_tokens
+                    << " draft tokens accepted (" << 100.0 * request.n_draft_accepted / request.n_draft_tokens
+                    << "%)\n";
+            }
+        }
+        if (request.cancelled) {
+            out << "Cancelled: client went away after " << request.n_cancelled_tokens << " decoded tokens\n";
+        }
+        if (request.in_repair) {
+            out << "Repair pass: " << request.n_repair_prompt_tokens << " prompt tokens in "
+                << request.t_repair_prompt / 1e3 << " ms, " << request.n_repair_tokens_predicted << " tokens in "
+                << request.t_repair_generation / 1e3 << " ms\n";
+        }
+        return out.str();
+    }
+
+    std::string format_totals(uint64_t n_requests) {
+        std::ostringstream out;
+        double total_prompt_tokens_per_sec = n_prompt_tokens_processed_total / (t_prompt_processing_total / 1e6);
+        double total_gen_tokens_per_sec = n_tokens_predicted_total / (t_tokens_generation_total / 1e6);
+
+        out << "Total Metrics:\n";
+        out << "Total requests processed: " << n_requests << " (" << n_errors << " errors)\n";
+        out << "Total prompt tokens: " << n_prompt_tokens_processed_total
+            << " (" << total_prompt_tokens_per_sec << " tokens/sec)\n";
+        out << "Total generated tokens: " << n_tokens_predicted_total
+            << " (" << total_gen_tokens_per_sec << " tokens/sec)\n";
+        if (n_draft_tokens_total > 0) {
+            out << "Speculative: " << n_draft_accepted_total << "/" << n_draft_tokens_total
+                << " draft tokens accepted (" << 100.0 * n_draft_accepted_total / n_draft_tokens_total
+                << "%)\n";
+        }
+        out << "Response cache: " << n_cache_hits << " hits, " << n_cache_misses << " misses\n";
+        Histogram::Summary lookup = semantic_lookup.summary();
+        if (lookup.count > 0) {
+            out << "Semantic cache: " << n_semantic_hits << " hits, " << n_semantic_misses << " misses, "
+                << lookup.mean / 1e3 << " ms avg lookup (" << lookup.max / 1e3 << " ms max)\n";
+        }
+        out << "Repair passes: " << n_repair_passes << " (" << 100.0 * n_repair_passes / n_requests
+            << "% of requests, " << n_repair_prompt_tokens_total << " prompt tokens, "
+            << n_repair_tokens_predicted_total << " generated tokens, " << t_repair_total / 1e3 << " ms)\n";
+        Histogram::Summary wait = queue_wait.summary();
+        out << "Queue: " << max_queue_depth << " max depth, " << wait.mean / 1e3 << " ms avg wait ("
+            << wait.max / 1e3 << " ms max), shed " << n_shed_full << " when full and "
+            << n_shed_deadline << " over deadline, " << n_expired << " expired\n";
+        Histogram::Summary ttft = time_to_first_token.summary();
+        out << "First token: " << ttft.p50 / 1e3 << " ms p50, " << ttft.p99 / 1e3 << " ms p99\n";
+        out << "Cancelled: " << n_cancelled_running << " running (" << n_cancelled_tokens_total
+            << " tokens wasted, " << n_aborted_decodes << " decodes aborted), " << n_cancelled_queued
+            << " queued\n";
+        out << "Slot leases: " << n_context_leases << " (" << n_context_waits << " waited, "
+            << t_context_wait_total / 1e3 << " ms total wait)\n";
+        if (n_batches > 0) {
+            out << "Batches: " << n_batches << " (" << (double)n_batch_tokens_total / n_batches
+                << " tokens, " << (double)n_batch_sequences_total / n_batches
+                << " sequences per batch, " << n_batch_tokens_total / (t_batch_total / 1e6)
+                << " aggregate tokens/sec)\n";
+        }
+        return out.str();
+    }
+
+    // Snapshot of the counters and latency percentiles as one JSON
+    // object, latencies in ms
+    std::string format_json() const {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\"uptime_s\":" << (ggml_time_us() - t_start) / 1e6;
+        out << ",\"requests\":{\"total\":" << n_requests_processed
+            << ",\"active\":" << n_active_requests
+            << ",\"errors\":" << n_errors
+            << ",\"cancelled_running\":" << n_cancelled_running
+            << ",\"cancelled_queued\":" << n_cancelled_queued
+            << ",\"shed_full\":" << n_shed_full
+            << ",\"shed_deadline\":" << n_shed_deadline
+            << ",\"expired\":" << n_expired
+            << ",\"repair_passes\":" << n_repair_passes << "}";
+        out << ",\"cache\":{\"hits\":" << n_cache_hits
+            << ",\"misses\":" << n_cache_misses
+            << ",\"semantic_hits\":" << n_semantic_hits
+            << ",\"semantic_misses\":" << n_semantic_misses << "}";
+        out << ",\"tokens\":{\"prompt\":" << n_prompt_tokens_processed_total
+            << ",\"cached\":" << n_prompt_tokens_cached_total
+            << ",\"generated\":" << n_tokens_predicted_total
+            << ",\"draft\":" << n_draft_tokens_total
+            << ",\"draft_accepted\":" << n_draft_accepted_total
+            << ",\"cancelled\":" << n_cancelled_tokens_total << "}";
+        out << ",\"queue\":{\"max_depth\":" << max_queue_depth << "}";
+        out << ",\"latency_ms\":{";
+        append_json(out, "queue_wait", queue_wait.summary(), 1e3);
+        out << ",";
+        append_json(out, "time_to_first_token", time_to_first_token.summary(), 1e3);
+        out << ",";
+        append_json(out, "inter_token", inter_token.summary(), 1e3);
+        out << ",";
+        append_json(out, "end_to_end", end_to_end.summary(), 1e3);
+        out << ",";
+        append_json(out, "semantic_lookup", semantic_lookup.summary(), 1e3);
+        out << "},";
+        append_json(out, "prefill_tokens_per_sec", prefill_rate.summary(), 1);
+        out << "}\n";
+        return out.str();
+    }
+
+    static void append_json(std::ostream& out, const char* name, const Histogram::Summary& summary, double scale) {
+        out << "\"" << name << "\":{\"count\":" << summary.count
+            << ",\"mean\":" << summary.mean / scale
+            << ",\"p50\":" << summary.p50 / scale
+            << ",\"p95\":" << summary.p95 / scale
+            << ",\"p99\":" << summary.p99 / scale
+            << ",\"max\":" << summary.max / scale << "}";
+    }
+};
+
+#endif // LLXD_METRICS_H
@@ -0,0 +1,288 @@
+#include "mock_engine.h"
+#include "hash.h"
+
+#include <cctype>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+// Answer used when no script is given
+const char* const DEFAULT_SCRIPT =
+    "```bash\nfind . -type f -exec du -h {} + | sort -rh | head -n 10\n```\n";
+
+// Token ids: prompt tokens are never detokenized and share one id, the
+// script pieces follow the special tokens
+constexpr llama_token BOS_TOKEN = 0;
+constexpr llama_token EOS_TOKEN = 1;
+constexpr llama_token PROMPT_TOKEN = 2;
+constexpr llama_token FIRST_SCRIPT_TOKEN = 3;
+
+// Prompt bytes per token
+constexpr size_t BYTES_PER_TOKEN = 4;
+
+constexpr int N_BATCH = 512;
+
+// Same share per sequence as the llama.cpp engine, so prompts are
+// admitted alike
+constexpr int SEQ_CELLS = 1024;
+
+// Longest sleep between checks of the abort callback
+constexpr int64_t ABORT_POLL_US = 1000;
+
+struct MockBatchToken {
+    llama_token token;
+    llama_seq_id seq_id;
+};
+
+// Where a sequence is in the script
+struct MockSequence {
+    size_t i_script = 0;
+};
+
+class MockEngine : public Engine {
+public:
+    explicit MockEngine(const MockEngineParams& params)
+        : params_(params) {
+        if (params_.script.empty()) {
+            params_.script = DEFAULT_SCRIPT;
+        }
+
+        // A piece starts at whitespace that follows text, so it carries
+        // its leading whitespace like most vocabularies do
+        const std::string& script = params_.script;
+        size_t start = 0;
+        for (size_t i = 1; i <= script.size(); i++) {
+            if (i == script.size() ||
+                (isspace(static_cast<unsigned char>(script[i])) && !isspace(static_cast<unsigned char>(script[i - 1])))) {
+                pieces_.push_back(script.substr(start, i - start));
+                start = i;
+            }
+        }
+    }
+
+    bool init(int n_seq) override {
+        // Sequence 0 would hold the prefix, requests use 1..n_seq
+        sequences_.resize(n_seq + 1);
+        for (int i = n_seq; i >= 1; i--) {
+            free_.push_back(i);
+        }
+        n_seq_ = n_seq;
+        return true;
+    }
+
+    bool prefill_prefix(const std::string& text) override {
+        prefix_text_ = text;
+        prefix_tokens_ = tokenize(text, true);
+        return true;
+    }
+
+    const std::string& prefix_text() const override {
+        return prefix_text_;
+    }
+
+    const std::vector<llama_token>& prefix_tokens() const override {
+        return prefix_tokens_;
+    }
+
+    uint64_t fingerprint() const override {
+        uint64_t hash = llxd_hash::fnv1a("mock");
+        return llxd_hash::fnv1a(params_.script, hash);
+    }
+
+    float temperature() const override {
+        return 0.0f;
+    }
+
+    // ChatML, every rendering of a conversation extends that of its start
+    bool format_chat(const std::vector<llama_chat_message>& messages, bool add_ass,
+                     std::string& out) const override {
+        out.clear();
+        for (const llama_chat_message& message : messages) {
+            out += "<|im_start|>";
+            out += message.role;
+            out += "\n";
+            out += message.content;
+            out += "<|im_end|>\n";
+        }
+        if (add_ass) {
+            out += "<|im_start|>assistant\n";
+        }
+        return true;
+    }
+
+    std::vector<llama_token> tokenize(const std::string& text, bool add_special) const override {
+        std::vector<llama_token> tokens;
+        if (add_special) {
+            tokens.push_back(BOS_TOKEN);
+        }
+        tokens.resize(tokens.size() + (text.size() + BYTES_PER_TOKEN - 1) / BYTES_PER_TOKEN, PROMPT_TOKEN);
+        return tokens;
+    }
+
+    std::string detokenize(llama_token token) const override {
+        const size_t i = static_cast<size_t>(token - FIRST_SCRIPT_TOKEN);
+        return token >= FIRST_SCRIPT_TOKEN && i < pieces_.size() ? pieces_[i] : std::string();
+    }
+
+    bool is_eog(llama_token token) const override {
+        return token == EOS_TOKEN;
+    }
+
+    bool is_bos(llama_token token) const override {
+        return token == BOS_TOKEN;
+    }
+
+    int n_seq_cells() const override {
+        return SEQ_CELLS;
+    }
+
+    size_t n_seq() const override {
+        return n_seq_;
+    }
+
+    size_t n_free() const override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return free_.size();
+    }
+
+    bool begin(llama_seq_id seq_id, float temperature) override {
+        (void)temperature;  // The script is all there is to sample
+        sequences_[seq_id] = MockSequence();
+        return true;
+    }
+
+    void seq_reset(llama_seq_id seq_id, bool with_prefix) override {
+        (void)with_prefix;
+        sequences_[seq_id] = MockSequence();
+    }
+
+    void seq_truncate(llama_seq_id seq_id, llama_pos pos) override {
+        (void)seq_id;
+        (void)pos;
+    }
+
+    int n_batch() const override {
+        return N_BATCH;
+    }
+
+    int batch_size() const override {
+        return static_cast<int>(batch_.size());
+    }
+
+    void batch_clear() override {
+        batch_.clear();
+    }
+
+    void batch_add(llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) override {
+        (void)pos;
+        (void)logits;
+        if (token == PROMPT_TOKEN) {
+            // A new prompt, the answer starts over after it
+            sequences_[seq_id].i_script = 0;
+        }
+        batch_.push_back({ token, seq_id });
+    }
+
+    int decode() override {
+        size_t n_prompt = 0;
+        bool generating = false;
+        for (const MockBatchToken& item : batch_) {
+            if (item.token == PROMPT_TOKEN || item.token == BOS_TOKEN) {
+                n_prompt++;
+            } else {
+                generating = true;
+            }
+        }
+
+        double t_decode_us = static_cast<double>(params_.latency_us);
+        if (params_.prefill_tokens_per_sec > 0) {
+            t_decode_us += n_prompt * 1e6 / params_.prefill_tokens_per_sec;
+        }
+        if (generating && params_.tokens_per_sec > 0) {
+            t_decode_us += 1e6 / params_.tokens_per_sec;
+        }
+
+        // Sleep in short naps so an abort is noticed as quickly as by llama_decode
+        const auto t_end = std::chrono::steady_clock::now() + std::chrono::microseconds(static_cast<int64_t>(t_decode_us));
+        while (true) {
+            if (abort_callback_ && abort_callback_(abort_user_data_)) {
+                return 2;
+            }
+            const auto t_now = std::chrono::steady_clock::now();
+            if (t_now >= t_end) {
+                return 0;
+            }
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                t_end - t_now, std::chrono::microseconds(ABORT_POLL_US)));
+        }
+    }
+
+    void set_abort_callback(bool (*callback)(void* user_data), void* user_data) override {
+        abort_callback_ = callback;
+        abort_user_data_ = user_data;
+    }
+
+    llama_token sample(llama_seq_id seq_id, int i_batch) override {
+        (void)i_batch;
+        MockSequence& sequence = sequences_[seq_id];
+        if (sequence.i_script >= pieces_.size()) {
+            return EOS_TOKEN;
+        }
+        return FIRST_SCRIPT_TOKEN + static_cast<llama_token>(sequence.i_script++);
+    }
+
+    void accept(llama_seq_id seq_id, llama_token token) override {
+        (void)seq_id;
+        (void)token;
+    }
+
+    std::vector<llama_token> sample_and_accept_n(llama_seq_id seq_id, const std::vector<int>& idxs,
+                                                 const std::vector<llama_token>& draft) override {
+        // draft() proposes nothing, so no draft is ever accepted
+        (void)draft;
+        return { sample(seq_id, idxs.empty() ? -1 : idxs.front()) };
+    }
+
+protected:
+    llama_seq_id acquire() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            return -1;
+        }
+        llama_seq_id seq_id = free_.back();
+        free_.pop_back();
+        return seq_id;
+    }
+
+    void release(llama_seq_id seq_id) override {
+        sequences_[seq_id] = MockSequence();
+        std::unique_lock<std::mutex> lock(mutex_);
+        free_.push_back(seq_id);
+    }
+
+private:
+    MockEngineParams params_;
+    std::vector<std::string> pieces_;   // Script tokens, by id - FIRST_SCRIPT_TOKEN
+    std::string prefix_text_;
+    std::vector<llama_token> prefix_tokens_;
+
+    // Only touched by the scheduler thread
+    std::vector<MockSequence> sequences_;
+    std::vector<MockBatchToken> batch_;
+    bool (*abort_callback_)(void* user_data) = nullptr;
+    void* abort_user_data_ = nullptr;
+
+    size_t n_seq_ = 0;
+    std::vector<llama_seq_id> free_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace
+
+std::unique_ptr<Engine> make_mock_engine(const MockEngineParams& params) {
+    return std::make_unique<MockEngine>(params);
+}
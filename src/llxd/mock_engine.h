@@ -0,0 +1,31 @@
+#ifndef LLXD_MOCK_ENGINE_H
+#define LLXD_MOCK_ENGINE_H
+
+#include "engine.h"
+
+#include <cstdint>
+#include <string>
+#include <memory>
+
+// Mock engine configuration
+struct MockEngineParams {
+    std::string script;                 // Answer to every prompt, a fenced command if empty
+    double tokens_per_sec = 50;         // Decode steps per second while any sequence generates
+    double prefill_tokens_per_sec = 2000;
+    int64_t latency_us = 0;             // Fixed cost of every decode
+};
+
+// Engine that needs no model. Every prompt is answered with the script,
+// split into tokens at whitespace, and each decode sleeps for as long as
+// the batch would take at the configured rates: one step time when it
+// carries generated tokens, however many sequences it has, plus the
+// prefill time of its prompt tokens, plus the fixed latency. A sleeping
+// decode still polls the abort callback.
+//
+// Prompts are counted as one token per four bytes, close to real
+// vocabularies, and are otherwise ignored. Runs are deterministic, so
+// they compare the daemon's queueing, batching and streaming overhead
+// across commits on any machine.
+std::unique_ptr<Engine> make_mock_engine(const MockEngineParams& params);
+
+#endif // LLXD_MOCK_ENGINE_H
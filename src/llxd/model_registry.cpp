@@ -0,0 +1,497 @@
+#include "model_registry.h"
+#include "logging.h"
+
+#include <sys/stat.h>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <list>
+#include <thread>
+#include <chrono>
+
+static const char* const LOG_CATEGORY = "models";
+
+namespace {
+
+struct ModelEntry {
+    ModelStats stats;
+    llama_model* model = nullptr;
+    std::shared_ptr<Scheduler> scheduler;
+    uint64_t last_used = 0;
+    int64_t t_resident_since = 0;   // us
+    bool loading = false;           // Loading without the registry lock
+};
+
+// Swapped out model finishing its in-flight requests
+struct DrainingModel {
+    std::string id;
+    llama_model* model = nullptr;
+    std::shared_ptr<Scheduler> scheduler;
+    uint64_t size_bytes = 0;
+};
+
+// How often draining models are checked for remaining requests
+constexpr int DRAIN_POLL_MS = 20;
+
+uint64_t file_size(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+} // namespace
+
+class ModelRegistry::Impl {
+public:
+    Impl(const llama_model_params& model_params,
+         size_t budget_bytes,
+         const std::string& models_dir,
+         SchedulerFactory factory,
+         bool load_weights)
+        : model_params_(model_params)
+        , budget_bytes_(budget_bytes)
+        , models_dir_(models_dir)
+        , factory_(std::move(factory))
+        , load_weights_(load_weights) {}
+
+    ~Impl() {
+        clear();
+    }
+
+    void add(const std::string& id, const std::string& path, bool pinned) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ModelEntry& entry = entries_[id];
+        entry.stats.id = id;
+        entry.stats.path = path;
+        entry.stats.pinned = pinned;
+        entry.stats.size_bytes = file_size(path);
+    }
+
+    std::shared_ptr<Scheduler> acquire(const std::string& id) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            if (!resolve(id)) {
+                LOG_WARN("Unknown model: " << id);
+                return nullptr;
+            }
+            it = entries_.find(id);
+        }
+
+        ModelEntry& entry = it->second;
+        entry.last_used = ++clock_;
+        loaded_.wait(lock, [&entry] { return !entry.loading; });
+        if (!entry.scheduler && !load(entry, lock)) {
+            return nullptr;
+        }
+        entry.stats.n_hits++;
+        return entry.scheduler;
+    }
+
+    std::shared_ptr<Scheduler> acquire_resident(const std::string& id) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end() || !it->second.scheduler) {
+            return nullptr;
+        }
+        ModelEntry& entry = it->second;
+        entry.last_used = ++clock_;
+        entry.stats.n_hits++;
+        return entry.scheduler;
+    }
+
+    bool swap(const std::string& id, const std::string& path) {
+        std::unique_lock<std::mutex> swap_lock(swap_mutex_);
+        uint64_t size = file_size(path);
+        if (size == 0) {
+            LOG_ERROR("Model file not found: " << path);
+            return false;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return false;
+            }
+            ModelEntry& entry = entries_[id];
+            entry.stats.id = id;
+            loaded_.wait(lock, [&entry] { return !entry.loading; });
+            if (!entry.scheduler) {
+                // Not resident, the next request loads the new file
+                entry.stats.path = path;
+                entry.stats.size_bytes = size;
+                LOG_INFO("Model " << id << " now points to " << path);
+                return true;
+            }
+            // Both models are resident until the old one drains
+            make_room(size);
+        }
+
+        // Load without the lock, requests keep going to the old model
+        int64_t t_start = ggml_time_us();
+        llama_model* model = nullptr;
+        if (!load_model(path, model)) {
+            return false;
+        }
+        std::shared_ptr<Scheduler> scheduler = factory_(id, path, model);
+        if (!scheduler) {
+            LOG_ERROR("Failed to start scheduler for model: " << id);
+            free_model(model);
+            return false;
+        }
+        int64_t t_end = ggml_time_us();
+
+        std::list<DrainingModel>::iterator draining;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stopping_) {
+                scheduler->stop();
+                scheduler.reset();
+                free_model(model);
+                return false;
+            }
+
+            // Switch over, from here on acquire() hands out the new scheduler
+            ModelEntry& entry = entries_[id];
+            DrainingModel old;
+            old.id = id;
+            old.model = entry.model;
+            old.scheduler = std::move(entry.scheduler);
+            old.size_bytes = entry.stats.size_bytes;
+            if (entry.stats.resident) {
+                entry.stats.t_resident += (t_end - entry.t_resident_since) / 1e3;
+            }
+
+            entry.model = model;
+            entry.scheduler = std::move(scheduler);
+            entry.stats.path = path;
+            entry.stats.size_bytes = size;
+            entry.stats.resident = true;
+            entry.stats.n_loads++;
+            entry.stats.t_load_last = (t_end - t_start) / 1e3;
+            entry.stats.t_load_total += entry.stats.t_load_last;
+            entry.t_resident_since = t_end;
+            bytes_resident_ += size;
+
+            LOG_INFO("Swapped model " << id << " to " << path << " in " << entry.stats.t_load_last << " ms");
+            if (!old.scheduler) {
+                // Evicted while the new model was loading
+                return true;
+            }
+            draining = draining_.insert(draining_.end(), std::move(old));
+        }
+
+        // Requests already handed to the old scheduler finish on it. It is
+        // done once idle with nobody else holding it, so none can arrive.
+        DrainingModel old;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (stopping_) {
+                    // clear() frees it
+                    return true;
+                }
+                if (draining->scheduler.use_count() == 1 && draining->scheduler->idle()) {
+                    old = std::move(*draining);
+                    draining_.erase(draining);
+                    break;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_POLL_MS));
+        }
+
+        old.scheduler->stop();
+        old.scheduler.reset();
+        free_model(old.model);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            bytes_resident_ -= old.size_bytes;
+        }
+        LOG_INFO("Drained previous model " << id);
+        return true;
+    }
+
+    bool wait_idle(int timeout_ms) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                bool idle = true;
+                for (const auto& item : entries_) {
+                    if (item.second.scheduler && !item.second.scheduler->idle()) {
+                        idle = false;
+                    }
+                }
+                for (const DrainingModel& model : draining_) {
+                    if (!model.scheduler->idle()) {
+                        idle = false;
+                    }
+                }
+                if (idle) {
+                    return true;
+                }
+            }
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_POLL_MS));
+        }
+    }
+
+    // Register <models_dir>/<id>.gguf if it exists
+    bool resolve(const std::string& id) {
+        if (id.empty() || models_dir_.empty() || id.find("..") != std::string::npos) {
+            return false;
+        }
+        std::string path = models_dir_ + "/" + id + ".gguf";
+        uint64_t size = file_size(path);
+        if (size == 0) {
+            return false;
+        }
+
+        ModelEntry& entry = entries_[id];
+        entry.stats.id = id;
+        entry.stats.path = path;
+        entry.stats.size_bytes = size;
+        return true;
+    }
+
+    // Load the entry's model with lock released, like swap(), so other
+    // models keep being acquired meanwhile. Its bytes are counted from the
+    // start, loads running side by side must fit the budget together.
+    bool load(ModelEntry& entry, std::unique_lock<std::mutex>& lock) {
+        if (stopping_) {
+            return false;
+        }
+        make_room(entry.stats.size_bytes);
+        const std::string id = entry.stats.id;
+        const std::string path = entry.stats.path;
+        const uint64_t size = entry.stats.size_bytes;
+        entry.loading = true;
+        bytes_resident_ += size;
+        lock.unlock();
+
+        int64_t t_start = ggml_time_us();
+        llama_model* model = nullptr;
+        std::shared_ptr<Scheduler> scheduler;
+        if (load_model(path, model)) {
+            scheduler = factory_(id, path, model);
+            if (!scheduler) {
+                LOG_ERROR("Failed to start scheduler for model: " << id);
+                free_model(model);
+            }
+        }
+        int64_t t_end = ggml_time_us();
+
+        lock.lock();
+        entry.loading = false;
+        loaded_.notify_all();
+        if (scheduler && stopping_) {
+            scheduler->stop();
+            scheduler.reset();
+            free_model(model);
+        }
+        if (!scheduler) {
+            bytes_resident_ -= size;
+            return false;
+        }
+
+        entry.model = model;
+        entry.scheduler = std::move(scheduler);
+        entry.stats.resident = true;
+        entry.stats.n_loads++;
+        entry.stats.t_load_last = (t_end - t_start) / 1e3;
+        entry.stats.t_load_total += entry.stats.t_load_last;
+        entry.t_resident_since = t_end;
+
+        LOG_INFO("Loaded model " << entry.stats.id << " in " << entry.stats.t_load_last << " ms ("
+                 << bytes_resident_ / (1024 * 1024) << " MB resident"
+                 << (budget_bytes_ > 0 ? " of " + std::to_string(budget_bytes_ / (1024 * 1024)) + " MB budget" : "")
+                 << ")");
+        return true;
+    }
+
+    // Load the weights at path, leaves model null without load_weights_
+    bool load_model(const std::string& path, llama_model*& model) {
+        model = nullptr;
+        if (!load_weights_) {
+            return true;
+        }
+        model = llama_model_load_from_file(path.c_str(), model_params_);
+        if (!model) {
+            LOG_ERROR("Failed to load model: " << path);
+            return false;
+        }
+        return true;
+    }
+
+    static void free_model(llama_model* model) {
+        if (model) {
+            llama_model_free(model);
+        }
+    }
+
+    // Evict idle models, least recently used first, until needed bytes fit.
+    // A scheduler someone still holds may be handed a request any moment,
+    // it is not idle even with nothing queued.
+    void make_room(uint64_t needed) {
+        if (budget_bytes_ == 0) {
+            return;
+        }
+
+        while (bytes_resident_ + needed > budget_bytes_) {
+            ModelEntry* victim = nullptr;
+            for (auto& item : entries_) {
+                ModelEntry& entry = item.second;
+                if (!entry.scheduler || entry.stats.pinned || entry.scheduler.use_count() != 1 ||
+                    !entry.scheduler->idle()) {
+                    continue;
+                }
+                if (!victim || entry.last_used < victim->last_used) {
+                    victim = &entry;
+                }
+            }
+            if (!victim) {
+                LOG_WARN("Model budget exceeded, no idle model to evict");
+                return;
+            }
+            evict(*victim);
+        }
+    }
+
+    void evict(ModelEntry& entry) {
+        LOG_INFO("Evicting model " << entry.stats.id);
+        unload(entry);
+        entry.stats.n_evictions++;
+    }
+
+    void unload(ModelEntry& entry) {
+        if (entry.scheduler) {
+            entry.scheduler->stop();
+            entry.scheduler.reset();
+        }
+        if (entry.model) {
+            llama_model_free(entry.model);
+            entry.model = nullptr;
+        }
+        if (entry.stats.resident) {
+            bytes_resident_ -= entry.stats.size_bytes;
+            entry.stats.t_resident += (ggml_time_us() - entry.t_resident_since) / 1e3;
+            entry.stats.resident = false;
+        }
+    }
+
+    void stop_schedulers() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopping_ = true;
+        for (auto& item : entries_) {
+            if (item.second.scheduler) {
+                item.second.scheduler->stop();
+            }
+        }
+        for (DrainingModel& model : draining_) {
+            model.scheduler->stop();
+        }
+    }
+
+    void clear() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopping_ = true;
+        for (auto& item : entries_) {
+            unload(item.second);
+        }
+        for (DrainingModel& model : draining_) {
+            model.scheduler->stop();
+            model.scheduler.reset();
+            free_model(model.model);
+            bytes_resident_ -= model.size_bytes;
+        }
+        draining_.clear();
+    }
+
+    std::vector<ModelStats> stats() const {
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::vector<ModelStats> result;
+        int64_t t_now = ggml_time_us();
+        for (const auto& item : entries_) {
+            ModelStats stats = item.second.stats;
+            if (stats.resident) {
+                stats.t_resident += (t_now - item.second.t_resident_since) / 1e3;
+            }
+            result.push_back(stats);
+        }
+        return result;
+    }
+
+    llama_model_params model_params_;
+    size_t budget_bytes_;
+    std::string models_dir_;
+    SchedulerFactory factory_;
+    bool load_weights_;
+
+    std::map<std::string, ModelEntry> entries_;
+    std::list<DrainingModel> draining_;
+    uint64_t bytes_resident_ = 0;
+    uint64_t clock_ = 0;
+    bool stopping_ = false;
+    mutable std::mutex mutex_;
+    std::condition_variable loaded_;    // An entry finished loading
+    std::mutex swap_mutex_;         // One swap at a time
+};
+
+ModelRegistry::ModelRegistry(const llama_model_params& model_params,
+                             size_t budget_bytes,
+                             const std::string& models_dir,
+                             SchedulerFactory factory,
+                             bool load_weights)
+    : impl(std::make_unique<Impl>(model_params, budget_bytes, models_dir, std::move(factory), load_weights)) {}
+
+ModelRegistry::~ModelRegistry() = default;
+
+void ModelRegistry::add(const std::string& id, const std::string& path, bool pinned) {
+    impl->add(id, path, pinned);
+}
+
+std::shared_ptr<Scheduler> ModelRegistry::acquire(const std::string& id) {
+    return impl->acquire(id);
+}
+
+std::shared_ptr<Scheduler> ModelRegistry::acquire_resident(const std::string& id) {
+    return impl->acquire_resident(id);
+}
+
+bool ModelRegistry::swap(const std::string& id, const std::string& path) {
+    return impl->swap(id, path);
+}
+
+bool ModelRegistry::wait_idle(int timeout_ms) {
+    return impl->wait_idle(timeout_ms);
+}
+
+void ModelRegistry::stop_schedulers() {
+    impl->stop_schedulers();
+}
+
+void ModelRegistry::clear() {
+    impl->clear();
+}
+
+std::vector<ModelStats> ModelRegistry::stats() const {
+    return impl->stats();
+}
+
+std::string ModelRegistry::format_stats() const {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    for (const ModelStats& stats : impl->stats()) {
+        out << stats.id << (stats.pinned ? " (pinned)" : "") << ": "
+            << (stats.resident ? "resident" : "not resident") << ", "
+            << stats.size_bytes / (1024 * 1024) << " MB, "
+            << stats.n_hits << " requests, "
+            << stats.n_loads << " loads (last " << stats.t_load_last << " ms), "
+            << stats.n_evictions << " evictions, "
+            << stats.t_resident / 1e3 << " s resident\n";
+    }
+    return out.str();
+}
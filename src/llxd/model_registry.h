@@ -0,0 +1,94 @@
+#ifndef LLXD_MODEL_REGISTRY_H
+#define LLXD_MODEL_REGISTRY_H
+
+#include "llama.h"
+#include "scheduler.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+// Residency and usage counters of one registered model
+struct ModelStats {
+    std::string id;
+    std::string path;
+    bool resident = false;
+    bool pinned = false;
+    uint64_t size_bytes = 0;        // Weights file size, what the budget counts
+    uint64_t n_loads = 0;
+    uint64_t n_evictions = 0;
+    uint64_t n_hits = 0;            // Requests routed to the model
+    double t_load_last = 0;         // ms
+    double t_load_total = 0;        // ms
+    double t_resident = 0;          // ms, including the current stint
+};
+
+// Models served by the daemon, keyed by id.
+//
+// Models are loaded on first use, each with its own scheduler, and kept
+// resident while their weights fit the memory budget. Loading a model
+// that does not fit evicts idle models, least recently used first: the
+// scheduler is stopped and the model freed, which unmaps its weights.
+// Pinned models are never evicted.
+//
+// A model can also be swapped for another file while it serves: the new
+// one loads alongside, new requests switch over once it is ready, and the
+// old one is freed after its in-flight requests finish.
+class ModelRegistry {
+public:
+    // Creates and starts the scheduler of a freshly loaded model
+    using SchedulerFactory = std::function<std::unique_ptr<Scheduler>(
+        const std::string& id, const std::string& path, llama_model* model)>;
+
+    // Without load_weights models are registered and scheduled but never
+    // loaded, and the factory gets a null model, for the mock engine
+    ModelRegistry(const llama_model_params& model_params,
+                  size_t budget_bytes,
+                  const std::string& models_dir,
+                  SchedulerFactory factory,
+                  bool load_weights = true);
+    ~ModelRegistry();
+
+    // Register a model file under id
+    void add(const std::string& id, const std::string& path, bool pinned = false);
+
+    // Scheduler serving id, loading the model first if needed. Unknown ids
+    // are looked up as <models_dir>/<id>.gguf. Returns nullptr when the
+    // model cannot be found or loaded. A swapped out scheduler is kept
+    // until every reference to it is released. The load blocks only the
+    // caller, and callers for the same model wait for it.
+    std::shared_ptr<Scheduler> acquire(const std::string& id);
+
+    // Scheduler serving id if its model is resident, nullptr otherwise.
+    // Never loads, so it does not block.
+    std::shared_ptr<Scheduler> acquire_resident(const std::string& id);
+
+    // Serve id from the model file at path. Blocks while the new model
+    // loads and the old one drains, acquire() keeps working meanwhile.
+    // A model that is not resident only has its path updated.
+    bool swap(const std::string& id, const std::string& path);
+
+    // Wait up to timeout_ms for every scheduler to finish its requests
+    bool wait_idle(int timeout_ms);
+
+    // Stop every scheduler, closing their requests, and abort swaps in
+    // progress. Models stay loaded until clear(), so state built on them
+    // can be torn down in between.
+    void stop_schedulers();
+
+    // Stop every scheduler and free every model
+    void clear();
+
+    std::vector<ModelStats> stats() const;
+
+    // Stats as a human readable table
+    std::string format_stats() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // LLXD_MODEL_REGISTRY_H
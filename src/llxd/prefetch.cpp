@@ -0,0 +1,66 @@
+#include "prefetch.h"
+#include "ggml.h"
+#include "logging.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+static const char* const LOG_CATEGORY = "prefetch";
+
+// Read ahead and report progress in chunks of this size
+static const size_t PREFETCH_CHUNK = 256 * 1024 * 1024;
+
+bool prefetch_weights(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open " << path << " for prefetch: " << strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    const size_t size = st.st_size;
+
+    void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("Failed to map " << path << " for prefetch: " << strerror(errno));
+        return false;
+    }
+
+    // The page cache is shared, so pages read through this mapping are
+    // the ones the model's own mapping will hit
+    const volatile char* data = static_cast<const char*>(base);
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    int64_t t_start = ggml_time_us();
+    int last_percent = -1;
+    char sink = 0;
+    for (size_t offset = 0; offset < size; offset += PREFETCH_CHUNK) {
+        const size_t len = std::min(PREFETCH_CHUNK, size - offset);
+        madvise(static_cast<char*>(base) + offset, len, MADV_WILLNEED);
+        for (size_t i = offset; i < offset + len; i += page_size) {
+            sink ^= data[i];
+        }
+
+        int percent = static_cast<int>((offset + len) * 100 / size);
+        if (percent / 10 != last_percent / 10) {
+            LOG_INFO("Prefetching " << path << ": " << percent << "%");
+            last_percent = percent;
+        }
+    }
+    (void) sink;
+    munmap(base, size);
+
+    double t_ms = (ggml_time_us() - t_start) / 1e3;
+    LOG_INFO("Prefetched " << size / (1024 * 1024) << " MB in " << t_ms << " ms ("
+             << (t_ms > 0 ? size / (1024.0 * 1024.0) / (t_ms / 1e3) : 0.0) << " MB/s)");
+    return true;
+}
@@ -0,0 +1,12 @@
+#ifndef LLXD_PREFETCH_H
+#define LLXD_PREFETCH_H
+
+#include <string>
+
+// Read a model file into the page cache ahead of use, so the mmap'd
+// weights do not page fault on the first request. Maps the file, asks the
+// kernel to read it ahead with madvise and touches every page, printing
+// progress. Returns false if the file cannot be mapped.
+bool prefetch_weights(const std::string& path);
+
+#endif // LLXD_PREFETCH_H
@@ -0,0 +1,126 @@
+#include "prefix_cache.h"
+#include "hash.h"
+#include "common/common.h"
+#include "logging.h"
+
+#include <cstdio>
+
+static const char* const LOG_CATEGORY = "prefix_cache";
+
+class PrefixCache::Impl {
+public:
+    Impl(llama_model* model, const std::string& model_path, const std::string& prefix_text)
+        : model_(model)
+        , model_path_(model_path)
+        , text_(prefix_text) {
+        tokens_ = common_tokenize(llama_model_get_vocab(model_), text_, true, true);
+
+        uint64_t model_hash = llxd_hash::model_fingerprint(model_path_);
+        uint64_t prompt_hash = llxd_hash::fnv1a(text_);
+        path_ = model_path_ + ".prefix-" + llxd_hash::to_hex(model_hash) + "-" +
+                llxd_hash::to_hex(prompt_hash) + ".kv";
+    }
+
+    bool init(llama_context* ctx, llama_seq_id seq_id) {
+        if (tokens_.empty()) {
+            LOG_ERROR("System prompt prefix tokenized to nothing");
+            return false;
+        }
+
+        loaded_from_disk_ = load(ctx, seq_id, path_);
+        if (!loaded_from_disk_) {
+            if (!prefill(ctx, seq_id)) {
+                return false;
+            }
+            save(ctx, seq_id, path_);
+        }
+        return true;
+    }
+
+    bool load(llama_context* ctx, llama_seq_id seq_id, const std::string& path) {
+        FILE* probe = fopen(path.c_str(), "rb");
+        if (!probe) {
+            return false;
+        }
+        fclose(probe);
+
+        std::vector<llama_token> saved(llama_n_ctx(ctx));
+        size_t n_saved = 0;
+        if (llama_state_seq_load_file(ctx, path.c_str(), seq_id, saved.data(), saved.size(), &n_saved) == 0) {
+            LOG_WARN("Ignoring unreadable system prompt snapshot: " << path);
+            return false;
+        }
+
+        // Guard against stale files and hash collisions
+        saved.resize(n_saved);
+        if (saved != tokens_) {
+            LOG_WARN("Ignoring mismatched system prompt snapshot: " << path);
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            return false;
+        }
+        return true;
+    }
+
+    bool prefill(llama_context* ctx, llama_seq_id seq_id) {
+        const int n_batch = llama_n_batch(ctx);
+        llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+        bool ok = true;
+        for (size_t i = 0; ok && i < tokens_.size(); i += n_batch) {
+            common_batch_clear(batch);
+            for (size_t j = i; j < tokens_.size() && j < i + n_batch; j++) {
+                common_batch_add(batch, tokens_[j], j, { seq_id }, false);
+            }
+            ok = llama_decode(ctx, batch) == 0;
+        }
+        llama_batch_free(batch);
+
+        if (!ok) {
+            LOG_ERROR("Failed to prefill system prompt");
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        }
+        return ok;
+    }
+
+    void save(llama_context* ctx, llama_seq_id seq_id, const std::string& path) {
+        // Write to a temporary file first so readers never see a partial snapshot
+        std::string tmp_path = path + ".tmp";
+        if (llama_state_seq_save_file(ctx, tmp_path.c_str(), seq_id, tokens_.data(), tokens_.size()) == 0 ||
+            rename(tmp_path.c_str(), path.c_str()) != 0) {
+            LOG_ERROR("Failed to save system prompt snapshot: " << path);
+            remove(tmp_path.c_str());
+        }
+    }
+
+    llama_model* model_;
+    std::string model_path_;
+    std::string text_;
+    std::string path_;
+    std::vector<llama_token> tokens_;
+    bool loaded_from_disk_ = false;
+};
+
+PrefixCache::PrefixCache(llama_model* model, const std::string& model_path, const std::string& prefix_text)
+    : impl(std::make_unique<Impl>(model, model_path, prefix_text)) {}
+
+PrefixCache::~PrefixCache() = default;
+
+bool PrefixCache::init(llama_context* ctx, llama_seq_id seq_id) {
+    return impl->init(ctx, seq_id);
+}
+
+const std::string& PrefixCache::text() const {
+    return impl->text_;
+}
+
+const std::vector<llama_token>& PrefixCache::tokens() const {
+    return impl->tokens_;
+}
+
+bool PrefixCache::loaded_from_disk() const {
+    return impl->loaded_from_disk_;
+}
+
+std::string PrefixCache::file_path() const {
+    return impl->path_;
+}
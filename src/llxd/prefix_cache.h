@@ -0,0 +1,40 @@
+#ifndef LLXD_PREFIX_CACHE_H
+#define LLXD_PREFIX_CACHE_H
+
+#include "llama.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+
+// KV snapshot of the formatted system-prompt prefix.
+//
+// The prefix is prefilled once per model and chat template into one
+// sequence of the shared context, which requests copy it from. The
+// snapshot is written next to the model file, keyed by model and prompt
+// hash, so a freshly started daemon skips the prefill entirely.
+class PrefixCache {
+public:
+    PrefixCache(llama_model* model, const std::string& model_path, const std::string& prefix_text);
+    ~PrefixCache();
+
+    // Build the snapshot on seq_id of ctx, loading it from disk when a
+    // matching file exists and prefilling (and saving) it otherwise
+    bool init(llama_context* ctx, llama_seq_id seq_id);
+
+    // Formatted prefix text and its tokens (including BOS)
+    const std::string& text() const;
+    const std::vector<llama_token>& tokens() const;
+
+    // Whether init() was served from the on-disk snapshot
+    bool loaded_from_disk() const;
+
+    // Path of the on-disk snapshot
+    std::string file_path() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // LLXD_PREFIX_CACHE_H
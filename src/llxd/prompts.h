@@ -5,7 +5,7 @@
 
 
 // System prompt for Unix command generation
-const char* UNIX_COMMAND_SYSTEM_PROMPT = R"(You are a command-line expert that provides precise MacOS terminal commands. Follow these rules strictly:
+const char* const UNIX_COMMAND_SYSTEM_PROMPT = R"(You are a command-line expert that provides precise MacOS terminal commands. Follow these rules strictly:
 1. Respond ONLY with the exact command(s) needed - no explanations
 2. Use standard MacOS commands (ls, grep, find, etc.)
 3. Each command must be valid and complete
@@ -17,4 +17,9 @@ const char* UNIX_COMMAND_SYSTEM_PROMPT = R"(You are a command-line expert that p
 9. Always provide a single, definitive answer - do not list multiple options or alternatives
 10. Choose the most appropriate and efficient solution when multiple approaches exist
 11. Please provide all answers in bash scripting language, unless otherwise specified in the prompt
-12. DO NOT provide multiple answers, only one answer is allowed)"; 
\ No newline at end of file
+12. DO NOT provide multiple answers, only one answer is allowed)";
+
+// GBNF grammar for constrained output: exactly one ```bash fenced block,
+// generation ends at the closing fence
+const char* const BASH_BLOCK_GRAMMAR = R"(root ::= "```bash\n" line+ "```"
+line ::= [^`\n] [^\n]* "\n")";
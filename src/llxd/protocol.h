@@ -3,26 +3,389 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <arpa/inet.h>
 
 namespace llxd_protocol {
 
 // Message types
 enum class MessageType : uint8_t {
     PROMPT = 0,     // Text generation prompt
-    CONTROL = 1     // Control command
+    CONTROL = 1,    // Control command
+    PROMPT_EX = 2,  // Prompt preceded by PromptOptions
+    HELLO = 3       // Hello, switches the connection to protocol v2
+};
+
+// Built-in stop sets, selectable per request
+enum class StopSet : uint8_t {
+    CODE_BLOCK = 0, // End right after the closing fence of the first code block
+    NONE = 1        // Only end of generation and the token limit
 };
 
 // Control command types
 enum class ControlCommand : uint8_t {
-    SHUTDOWN = 0
+    SHUTDOWN = 0,
+    MODELS = 1,     // Reply with per-model residency stats
+    SWAP = 2,       // Followed by "<id>=<path>" or "<path>" for the default model
+    STATS = 3,      // Reply with a JSON snapshot of counters and latency percentiles
+    TRACE = 4       // Followed by "on" or "off" to start or stop tracing, or nothing to reply with the trace JSON
 };
 
+// Lines llxd writes to the --ready-fd it was started with: READY_PROGRESS
+// and a percentage while the default model loads, then READY_OK or
+// READY_ERROR and a message, after which the fd is closed
+constexpr const char* READY_PROGRESS = "progress ";
+constexpr const char* READY_OK = "ready";
+constexpr const char* READY_ERROR = "error ";
+
+// A v1 response that fails, turned away busy or past its deadline
+// included, ends with this byte, the message and a newline before the
+// connection closes. Generated text never holds the control character.
+constexpr char V1_ERROR = '\x15';
+
 // Message header structure
 struct MessageHeader {
     MessageType type;
     uint32_t payload_size;
 };
 
+// Fixed part of a PROMPT_EX payload. It is followed by the model id
+// (model_len bytes, empty for the default model), then n_stop extra stop
+// strings, each a uint16_t length (network byte order) and its bytes, and
+// then by the prompt itself.
+struct PromptOptions {
+    StopSet stop_set;
+    uint8_t n_stop;
+    uint8_t model_len;
+};
+
+// Build a PROMPT_EX payload
+inline std::string encode_prompt_ex(StopSet stop_set, const std::vector<std::string>& stop,
+                                    const std::string& model, const std::string& prompt) {
+    std::string payload;
+    PromptOptions options = { stop_set, static_cast<uint8_t>(std::min<size_t>(stop.size(), UINT8_MAX)),
+                              static_cast<uint8_t>(std::min<size_t>(model.size(), UINT8_MAX)) };
+    payload.append(reinterpret_cast<const char*>(&options), sizeof(options));
+    payload.append(model, 0, options.model_len);
+    for (size_t i = 0; i < options.n_stop; i++) {
+        uint16_t length = htons(static_cast<uint16_t>(std::min<size_t>(stop[i].size(), UINT16_MAX)));
+        payload.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        payload.append(stop[i], 0, ntohs(length));
+    }
+    payload += prompt;
+    return payload;
+}
+
+// Split a PROMPT_EX payload, returns false if it is malformed
+inline bool decode_prompt_ex(const std::string& payload, StopSet& stop_set, std::vector<std::string>& stop,
+                             std::string& model, std::string& prompt) {
+    PromptOptions options;
+    if (payload.size() < sizeof(options)) {
+        return false;
+    }
+    memcpy(&options, payload.data(), sizeof(options));
+    if (options.stop_set != StopSet::CODE_BLOCK && options.stop_set != StopSet::NONE) {
+        return false;
+    }
+
+    size_t offset = sizeof(options);
+    if (payload.size() < offset + options.model_len) {
+        return false;
+    }
+    model = payload.substr(offset, options.model_len);
+    offset += options.model_len;
+
+    stop.clear();
+    for (uint8_t i = 0; i < options.n_stop; i++) {
+        uint16_t length;
+        if (payload.size() < offset + sizeof(length)) {
+            return false;
+        }
+        memcpy(&length, payload.data() + offset, sizeof(length));
+        offset += sizeof(length);
+        length = ntohs(length);
+        if (payload.size() < offset + length) {
+            return false;
+        }
+        stop.push_back(payload.substr(offset, length));
+        offset += length;
+    }
+
+    stop_set = options.stop_set;
+    prompt = payload.substr(offset);
+    return true;
+}
+
+// Protocol v2
+//
+// A client opts in by sending a v1 HELLO message whose payload is an
+// encoded Hello. The daemon answers with a HELLO frame naming the version
+// it speaks, and from then on both directions carry frames. Frames of
+// different requests interleave, so one persistent connection serves any
+// number of concurrent requests, told apart by client-chosen request ids.
+// An id may be reused once its END arrived, a request reusing one still in
+// flight is ended with an error right away. All integers are in network
+// byte order.
+
+constexpr uint32_t PROTOCOL_MAGIC = 0x4c4c5832;    // "LLX2"
+constexpr uint16_t PROTOCOL_VERSION = 2;
+
+struct Hello {
+    uint32_t magic = PROTOCOL_MAGIC;
+    uint16_t version = PROTOCOL_VERSION;
+};
+constexpr size_t HELLO_SIZE = 8;    // magic, version, two reserved bytes
+
+enum class FrameType : uint8_t {
+    // Client to daemon
+    REQUEST = 0x01,     // Encoded RequestParams
+    CONTROL = 0x02,     // A ControlCommand and its argument, answered like a request
+
+    // Daemon to client
+    HELLO = 0x80,       // Encoded Hello with the version the daemon speaks
+    TOKEN = 0x81,       // Piece of response text
+    USAGE = 0x82,       // Encoded Usage, right before END
+    END = 0x83          // FinishReason, then an error message if any. Last frame of a request.
+};
+
+// Header of every v2 frame, explicitly laid out without padding
+struct FrameHeader {
+    uint32_t length;        // Payload bytes following the header
+    uint32_t request_id;    // Chosen by the client, echoed in every reply
+    FrameType type;
+    uint8_t flags;          // Zero
+    uint16_t reserved;      // Zero
+};
+static_assert(sizeof(FrameHeader) == 12, "v2 frame header must stay 12 bytes");
+
+// Typed parameters of a REQUEST frame, each encoded as the tag, a uint32_t
+// length and the value. Unknown tags are skipped.
+enum class Param : uint8_t {
+    PROMPT = 1,         // Text
+    MAX_TOKENS = 2,     // uint32_t
+    TEMPERATURE = 3,    // IEEE 754 float bits as uint32_t
+    STOP = 4,           // Text, may repeat
+    STOP_SET = 5,       // StopSet as one byte
+    MODEL = 6,          // Text
+    PRIORITY = 7,       // int8_t, higher is served first
+    DEADLINE_MS = 8     // uint32_t, give up if not started within this long
+};
+
+struct RequestParams {
+    std::string prompt;
+    uint32_t max_tokens = 0;            // 0 for the daemon default
+    float temperature = -1.0f;          // Negative for the daemon default
+    std::vector<std::string> stop;
+    StopSet stop_set = StopSet::CODE_BLOCK;
+    std::string model;                  // Empty for the default model
+    int8_t priority = 0;
+    uint32_t deadline_ms = 0;           // 0 for the daemon default
+};
+
+enum class FinishReason : uint8_t {
+    STOP = 0,           // Stop sequence or end of the code block
+    EOS = 1,            // End of generation token
+    LENGTH = 2,         // Token limit
+    ERROR = 3,          // See the message
+    CANCELLED = 4,      // Client went away or the daemon is stopping
+    BUSY = 5,           // Would miss its deadline, rejected without queueing. See the message.
+    EXPIRED = 6         // Deadline passed while queued
+};
+
+struct Usage {
+    uint32_t prompt_tokens = 0;         // Decoded for this request
+    uint32_t cached_tokens = 0;         // Reused from the system prompt KV
+    uint32_t generated_tokens = 0;
+    uint32_t t_first_token_us = 0;      // From admission to the first token
+    uint32_t t_total_us = 0;
+    uint8_t from_cache = 0;             // Served by the response cache
+};
+constexpr size_t USAGE_SIZE = 24;
+
+inline void append_u32(std::string& out, uint32_t value) {
+    value = htonl(value);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline uint32_t read_u32(const char* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+// Append one frame to out
+inline void append_frame(std::string& out, FrameType type, uint32_t request_id, const char* payload, size_t len) {
+    FrameHeader header = { htonl(static_cast<uint32_t>(len)), htonl(request_id), type, 0, 0 };
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(payload, len);
+}
+
+inline std::string encode_frame(FrameType type, uint32_t request_id, const std::string& payload) {
+    std::string out;
+    append_frame(out, type, request_id, payload.data(), payload.size());
+    return out;
+}
+
+// Parse a frame header, with length and request_id in host byte order
+inline FrameHeader decode_frame_header(const char* data) {
+    FrameHeader header;
+    memcpy(&header, data, sizeof(header));
+    header.length = ntohl(header.length);
+    header.request_id = ntohl(header.request_id);
+    return header;
+}
+
+inline std::string encode_hello(const Hello& hello) {
+    std::string out;
+    append_u32(out, hello.magic);
+    append_u32(out, static_cast<uint32_t>(hello.version) << 16);
+    return out;
+}
+
+inline bool decode_hello(const std::string& payload, Hello& hello) {
+    if (payload.size() < HELLO_SIZE) {
+        return false;
+    }
+    hello.magic = read_u32(payload.data());
+    hello.version = read_u32(payload.data() + 4) >> 16;
+    return hello.magic == PROTOCOL_MAGIC;
+}
+
+inline void append_param(std::string& out, Param tag, const char* value, size_t len) {
+    out += static_cast<char>(tag);
+    append_u32(out, static_cast<uint32_t>(len));
+    out.append(value, len);
+}
+
+inline void append_param(std::string& out, Param tag, uint32_t value) {
+    value = htonl(value);
+    append_param(out, tag, reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Build a REQUEST payload, defaults are left out
+inline std::string encode_request(const RequestParams& params) {
+    std::string out;
+    if (params.max_tokens > 0) {
+        append_param(out, Param::MAX_TOKENS, params.max_tokens);
+    }
+    if (params.temperature >= 0.0f) {
+        uint32_t bits;
+        memcpy(&bits, &params.temperature, sizeof(bits));
+        append_param(out, Param::TEMPERATURE, bits);
+    }
+    for (const std::string& stop : params.stop) {
+        append_param(out, Param::STOP, stop.data(), stop.size());
+    }
+    if (params.stop_set != StopSet::CODE_BLOCK) {
+        char stop_set = static_cast<char>(params.stop_set);
+        append_param(out, Param::STOP_SET, &stop_set, 1);
+    }
+    if (!params.model.empty()) {
+        append_param(out, Param::MODEL, params.model.data(), params.model.size());
+    }
+    if (params.priority != 0) {
+        char priority = static_cast<char>(params.priority);
+        append_param(out, Param::PRIORITY, &priority, 1);
+    }
+    if (params.deadline_ms > 0) {
+        append_param(out, Param::DEADLINE_MS, params.deadline_ms);
+    }
+    append_param(out, Param::PROMPT, params.prompt.data(), params.prompt.size());
+    return out;
+}
+
+// Parse a REQUEST payload, returns false if it is malformed
+inline bool decode_request(const std::string& payload, RequestParams& params) {
+    size_t offset = 0;
+    while (offset < payload.size()) {
+        if (payload.size() - offset < 5) {
+            return false;
+        }
+        Param tag = static_cast<Param>(payload[offset]);
+        uint32_t len = read_u32(payload.data() + offset + 1);
+        offset += 5;
+        if (payload.size() - offset < len) {
+            return false;
+        }
+        const char* value = payload.data() + offset;
+        offset += len;
+
+        switch (tag) {
+            case Param::PROMPT:
+                params.prompt.assign(value, len);
+                break;
+            case Param::MAX_TOKENS:
+                if (len != 4) {
+                    return false;
+                }
+                params.max_tokens = read_u32(value);
+                break;
+            case Param::TEMPERATURE: {
+                if (len != 4) {
+                    return false;
+                }
+                uint32_t bits = read_u32(value);
+                memcpy(&params.temperature, &bits, sizeof(bits));
+                break;
+            }
+            case Param::STOP:
+                params.stop.emplace_back(value, len);
+                break;
+            case Param::STOP_SET:
+                if (len != 1 || (value[0] != static_cast<char>(StopSet::CODE_BLOCK) &&
+                                 value[0] != static_cast<char>(StopSet::NONE))) {
+                    return false;
+                }
+                params.stop_set = static_cast<StopSet>(value[0]);
+                break;
+            case Param::MODEL:
+                params.model.assign(value, len);
+                break;
+            case Param::PRIORITY:
+                if (len != 1) {
+                    return false;
+                }
+                params.priority = static_cast<int8_t>(value[0]);
+                break;
+            case Param::DEADLINE_MS:
+                if (len != 4) {
+                    return false;
+                }
+                params.deadline_ms = read_u32(value);
+                break;
+            default:
+                break;  // Newer parameter, ignore
+        }
+    }
+    return true;
+}
+
+inline std::string encode_usage(const Usage& usage) {
+    std::string out;
+    append_u32(out, usage.prompt_tokens);
+    append_u32(out, usage.cached_tokens);
+    append_u32(out, usage.generated_tokens);
+    append_u32(out, usage.t_first_token_us);
+    append_u32(out, usage.t_total_us);
+    append_u32(out, static_cast<uint32_t>(usage.from_cache) << 24);
+    return out;
+}
+
+inline bool decode_usage(const std::string& payload, Usage& usage) {
+    if (payload.size() < USAGE_SIZE) {
+        return false;
+    }
+    usage.prompt_tokens = read_u32(payload.data());
+    usage.cached_tokens = read_u32(payload.data() + 4);
+    usage.generated_tokens = read_u32(payload.data() + 8);
+    usage.t_first_token_us = read_u32(payload.data() + 12);
+    usage.t_total_us = read_u32(payload.data() + 16);
+    usage.from_cache = read_u32(payload.data() + 20) >> 24;
+    return true;
+}
+
 } // namespace llxd_protocol
 
 #endif // LLXD_PROTOCOL_H 
\ No newline at end of file
@@ -0,0 +1,772 @@
+#include "reactor.h"
+#include "trace.h"
+#include "logging.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <arpa/inet.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+static const char* const LOG_CATEGORY = "reactor";
+
+namespace {
+
+// Largest payload accepted from a client, prompts are short
+constexpr uint32_t MAX_PAYLOAD = 1024 * 1024;
+
+constexpr int MAX_EVENTS = 64;
+
+// Queued pieces written per sendmsg
+constexpr int MAX_IOV = 64;
+
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0 &&
+           fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+struct Event {
+    int fd;
+    bool readable;
+    bool writable;
+    bool hangup;
+};
+
+// Readiness notification, epoll on Linux and kqueue elsewhere. Interest
+// is level triggered and set per fd for reading and writing. Hangups are
+// reported without read interest too: epoll always reports them, with
+// kqueue an edge triggered write filter stands in.
+class Poller {
+public:
+    Poller() {
+#if defined(__linux__)
+        fd_ = epoll_create1(EPOLL_CLOEXEC);
+#else
+        fd_ = kqueue();
+#endif
+    }
+
+    ~Poller() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool valid() const { return fd_ >= 0; }
+
+    bool add(int fd) {
+#if defined(__linux__)
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        return epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+#else
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+        return kevent(fd_, &ev, 1, nullptr, 0, nullptr) == 0;
+#endif
+    }
+
+    void update(int fd, bool read, bool write, bool was_read, bool was_write) {
+#if defined(__linux__)
+        (void) was_read;
+        (void) was_write;
+        struct epoll_event ev = {};
+        ev.events = 0;
+        if (read) {
+            ev.events |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (write) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.fd = fd;
+        epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &ev);
+#else
+        // Without read interest, the write filter reports EV_EOF once the
+        // client closed its end. Edge triggered unless writing is wanted.
+        const bool write_filter = write || !read;
+        const bool was_write_filter = was_write || !was_read;
+        struct kevent ev[2];
+        int n = 0;
+        if (read != was_read) {
+            EV_SET(&ev[n++], fd, EVFILT_READ, read ? EV_ADD : EV_DELETE, 0, 0, nullptr);
+        }
+        if (write_filter) {
+            EV_SET(&ev[n++], fd, EVFILT_WRITE, EV_ADD | (write ? 0 : EV_CLEAR), 0, 0, nullptr);
+        } else if (was_write_filter) {
+            EV_SET(&ev[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+        }
+        if (n > 0) {
+            kevent(fd_, ev, n, nullptr, 0, nullptr);
+        }
+#endif
+    }
+
+    // Wait up to timeout_us, forever if negative. Closing an fd drops its
+    // registration, nothing to do before that.
+    int wait(std::vector<Event>& events, int64_t timeout_us) {
+        events.clear();
+#if defined(__linux__)
+        // Rounded up to whole milliseconds
+        int timeout_ms = timeout_us < 0 ? -1 : static_cast<int>((timeout_us + 999) / 1000);
+        struct epoll_event ready[MAX_EVENTS];
+        int n = epoll_wait(fd_, ready, MAX_EVENTS, timeout_ms);
+        for (int i = 0; i < n; i++) {
+            const uint32_t flags = ready[i].events;
+            events.push_back({ ready[i].data.fd,
+                               (flags & (EPOLLIN | EPOLLRDHUP)) != 0,
+                               (flags & EPOLLOUT) != 0,
+                               (flags & (EPOLLHUP | EPOLLERR)) != 0 });
+        }
+#else
+        struct timespec timeout = { static_cast<time_t>(timeout_us / 1000000),
+                                    static_cast<long>(timeout_us % 1000000) * 1000 };
+        struct kevent ready[MAX_EVENTS];
+        int n = kevent(fd_, nullptr, 0, ready, MAX_EVENTS, timeout_us < 0 ? nullptr : &timeout);
+        for (int i = 0; i < n; i++) {
+            const bool read = ready[i].filter == EVFILT_READ;
+            events.push_back({ static_cast<int>(ready[i].ident),
+                               read,
+                               !read,
+                               !read && (ready[i].flags & EV_EOF) != 0 });
+        }
+#endif
+        return n;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+} // namespace
+
+Connection::Connection(int fd, Reactor* reactor)
+    : fd_(fd)
+    , reactor_(reactor) {}
+
+Connection::~Connection() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool Connection::send(const char* data, size_t len, bool coalesce) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (gone_ || close_requested_ || fd_ < 0) {
+        return false;
+    }
+    if (len == 0) {
+        return true;
+    }
+
+    out_.emplace_back(data, len);
+    out_bytes_ += len;
+    if (reactor_) {
+        reactor_->on_send();
+    }
+    if (blocked_) {
+        return true;    // Written once the socket is writable
+    }
+
+    // Hold it back while within budget, a timer writes it otherwise
+    if (coalesce && reactor_ && reactor_->budget().max_delay_us > 0 &&
+        out_bytes_ < reactor_->budget().max_bytes) {
+        if (!flush_scheduled_) {
+            flush_scheduled_ = true;
+            reactor_->schedule_flush(shared_from_this());
+        }
+        return true;
+    }
+
+    if (!flush_locked()) {
+        if (reactor_) {
+            reactor_->post(shared_from_this());
+        }
+        return false;
+    }
+    if (blocked_ && reactor_) {
+        reactor_->post(shared_from_this());
+    }
+    return true;
+}
+
+void Connection::close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    close_locked();
+}
+
+void Connection::close_locked() {
+    if (close_requested_) {
+        return;
+    }
+    close_requested_ = true;
+    if (reactor_) {
+        reactor_->post(shared_from_this());
+    } else if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+        gone_ = true;
+    }
+}
+
+bool Connection::gone() const {
+    return gone_.load(std::memory_order_relaxed);
+}
+
+bool Connection::begin_request(uint32_t id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return open_ids_.insert(id).second;
+}
+
+void Connection::end_request(uint32_t id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    open_ids_.erase(id);
+    if (open_ids_.empty() && peer_done_) {
+        close_locked();
+    }
+}
+
+bool Connection::flush_locked() {
+    blocked_ = false;
+    while (!out_.empty()) {
+        // Everything queued in one call, up to MAX_IOV pieces
+        struct iovec iov[MAX_IOV];
+        int n_iov = 0;
+        for (auto it = out_.begin(); it != out_.end() && n_iov < MAX_IOV; ++it, ++n_iov) {
+            const size_t offset = n_iov == 0 ? out_offset_ : 0;
+            iov[n_iov].iov_base = const_cast<char*>(it->data() + offset);
+            iov[n_iov].iov_len = it->size() - offset;
+        }
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+
+        ssize_t n = ::sendmsg(fd_, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                blocked_ = true;
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            gone_ = true;
+            out_.clear();
+            out_offset_ = 0;
+            out_bytes_ = 0;
+            return false;
+        }
+        if (reactor_) {
+            reactor_->on_write(n);
+        }
+
+        // Drop what was written
+        out_bytes_ -= n;
+        size_t written = n;
+        while (written > 0) {
+            const size_t left = out_.front().size() - out_offset_;
+            if (written < left) {
+                out_offset_ += written;
+                break;
+            }
+            written -= left;
+            out_.pop_front();
+            out_offset_ = 0;
+        }
+    }
+    return true;
+}
+
+class Reactor::Impl {
+public:
+    Impl(Reactor* owner, MessageHandler handler, const WriteBudget& budget)
+        : owner_(owner)
+        , handler_(std::move(handler))
+        , budget_(budget) {}
+
+    ~Impl() {
+        stop();
+    }
+
+    bool start(int listen_fd) {
+        listen_fd_ = listen_fd;
+        if (!poller_.valid()) {
+            LOG_ERROR("Failed to create event poller: " << strerror(errno));
+            return false;
+        }
+        if (pipe(wake_pipe_) != 0 || !set_nonblocking(wake_pipe_[0]) || !set_nonblocking(wake_pipe_[1])) {
+            LOG_ERROR("Failed to create wake pipe: " << strerror(errno));
+            return false;
+        }
+        if (!set_nonblocking(listen_fd_) || !poller_.add(listen_fd_) || !poller_.add(wake_pipe_[0])) {
+            LOG_ERROR("Failed to watch listening socket: " << strerror(errno));
+            return false;
+        }
+
+        running_ = true;
+        thread_ = std::thread(&Impl::run, this);
+        return true;
+    }
+
+    void stop_accepting() {
+        stop_accepting_ = true;
+        wake();
+    }
+
+    void stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        running_ = false;
+        wake();
+        thread_.join();
+
+        // Connections held elsewhere close on their own from here on
+        for (auto& item : connections_) {
+            std::unique_lock<std::mutex> lock(item.second->mutex_);
+            item.second->reactor_ = nullptr;
+            if (item.second->fd_ >= 0) {
+                ::close(item.second->fd_);
+                item.second->fd_ = -1;
+            }
+            item.second->gone_ = true;
+        }
+        connections_.clear();
+        n_connections_ = 0;
+        {
+            std::unique_lock<std::mutex> lock(posted_mutex_);
+            posted_.clear();
+            timers_.clear();
+        }
+
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+        }
+        for (int& fd : wake_pipe_) {
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    void post(std::shared_ptr<Connection> client) {
+        {
+            std::unique_lock<std::mutex> lock(posted_mutex_);
+            posted_.push_back(std::move(client));
+        }
+        wake();
+    }
+
+    void schedule_flush(std::shared_ptr<Connection> client) {
+        bool first;
+        {
+            std::unique_lock<std::mutex> lock(posted_mutex_);
+            first = timers_.empty();
+
+            // Deadlines come in order, the delay is the same for all
+            timers_.push_back({ now_us() + budget_.max_delay_us, std::move(client) });
+        }
+
+        // Otherwise the loop already waits for an earlier deadline
+        if (first) {
+            wake();
+        }
+    }
+
+    void wake() {
+        const char byte = 0;
+        if (wake_pipe_[1] >= 0 && write(wake_pipe_[1], &byte, 1) < 0 && errno != EAGAIN) {
+            LOG_ERROR("Failed to wake reactor: " << strerror(errno));
+        }
+    }
+
+    void run() {
+        llxd_trace::set_thread_name("reactor");
+        std::vector<Event> events;
+        events.reserve(MAX_EVENTS);
+        while (running_) {
+            if (poller_.wait(events, next_timeout_us()) < 0 && errno != EINTR) {
+                LOG_ERROR("Event wait failed: " << strerror(errno));
+                break;
+            }
+
+            for (const Event& event : events) {
+                if (event.fd == wake_pipe_[0]) {
+                    drain_wake_pipe();
+                } else if (event.fd == listen_fd_) {
+                    accept_all();
+                } else {
+                    handle_event(event);
+                }
+            }
+            handle_posted();
+            handle_timers();
+        }
+    }
+
+    // Time until the earliest flush deadline, negative for none
+    int64_t next_timeout_us() {
+        std::unique_lock<std::mutex> lock(posted_mutex_);
+        if (timers_.empty()) {
+            return -1;
+        }
+        return std::max<int64_t>(0, timers_.front().deadline_us - now_us());
+    }
+
+    // Write held output whose delay has passed
+    void handle_timers() {
+        std::vector<std::weak_ptr<Connection>> due;
+        {
+            std::unique_lock<std::mutex> lock(posted_mutex_);
+            const int64_t t_now = now_us();
+            while (!timers_.empty() && timers_.front().deadline_us <= t_now) {
+                due.push_back(std::move(timers_.front().client));
+                timers_.pop_front();
+            }
+        }
+        for (const auto& weak : due) {
+            std::shared_ptr<Connection> client = weak.lock();
+            if (!client) {
+                continue;
+            }
+            {
+                std::unique_lock<std::mutex> lock(client->mutex_);
+                client->flush_scheduled_ = false;
+                if (client->out_.empty()) {
+                    continue;
+                }
+            }
+            n_timer_flushes_++;
+            update(client);
+        }
+    }
+
+    void drain_wake_pipe() {
+        char buffer[256];
+        while (read(wake_pipe_[0], buffer, sizeof(buffer)) > 0) {
+        }
+        if (stop_accepting_ && listen_fd_ >= 0) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+        }
+    }
+
+    void accept_all() {
+        llxd_trace::Span span("accept");
+        while (listen_fd_ >= 0) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Failed to accept connection: " << strerror(errno));
+                }
+                return;
+            }
+            if (!set_nonblocking(fd) || !poller_.add(fd)) {
+                LOG_ERROR("Failed to watch connection: " << strerror(errno));
+                close(fd);
+                continue;
+            }
+            connections_[fd] = std::make_shared<Connection>(fd, owner_);
+            n_connections_ = connections_.size();
+        }
+    }
+
+    void handle_event(const Event& event) {
+        auto it = connections_.find(event.fd);
+        if (it == connections_.end()) {
+            return;
+        }
+        std::shared_ptr<Connection> client = it->second;
+        llxd_trace::Span span("client event");
+
+        if (event.readable && !read_messages(client)) {
+            close_connection(client);
+            return;
+        }
+        if (event.hangup) {
+            // Both directions are closed, nothing can be delivered
+            close_connection(client);
+            return;
+        }
+        if (event.writable) {
+            update(client);
+        }
+    }
+
+    // Read what is available and pass on complete messages. Returns false
+    // if the connection should be closed.
+    bool read_messages(const std::shared_ptr<Connection>& client) {
+        char buffer[64 * 1024];
+        while (client->reading_) {
+            ssize_t n = read(client->fd_, buffer, sizeof(buffer));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return false;
+            }
+            if (n == 0) {
+                // The client is done sending. Probes that never sent a
+                // message are closed, others still get their answer.
+                client->reading_ = false;
+                set_interest(client);
+                if (!client->received_) {
+                    return false;
+                }
+                if (client->framed_) {
+                    // Closed once the last open request has ended
+                    std::unique_lock<std::mutex> lock(client->mutex_);
+                    client->peer_done_ = true;
+                    if (client->open_ids_.empty()) {
+                        client->close_locked();
+                    }
+                }
+                break;
+            }
+            client->in_.append(buffer, n);
+            if (!parse_messages(client)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse_messages(const std::shared_ptr<Connection>& client) {
+        size_t offset = 0;
+        while (true) {
+            // A v1 header, or a v2 frame header after the HELLO
+            ClientMessage message;
+            size_t header_size;
+            uint32_t payload_size;
+            const size_t available = client->in_.size() - offset;
+            if (client->framed_) {
+                header_size = sizeof(llxd_protocol::FrameHeader);
+                if (available < header_size) {
+                    break;
+                }
+                llxd_protocol::FrameHeader header = llxd_protocol::decode_frame_header(client->in_.data() + offset);
+                message.version = llxd_protocol::PROTOCOL_VERSION;
+                message.frame_type = header.type;
+                message.request_id = header.request_id;
+                payload_size = header.length;
+            } else {
+                llxd_protocol::MessageHeader header;
+                header_size = sizeof(header);
+                if (available < header_size) {
+                    break;
+                }
+                memcpy(&header, client->in_.data() + offset, sizeof(header));
+                message.type = header.type;
+                payload_size = ntohl(header.payload_size);
+            }
+            if (payload_size > MAX_PAYLOAD) {
+                LOG_WARN("Payload of " << payload_size << " bytes exceeds the limit");
+                return false;
+            }
+            if (available - header_size < payload_size) {
+                break;  // Rest arrives with a later read
+            }
+
+            message.payload = client->in_.substr(offset + header_size, payload_size);
+            offset += header_size + payload_size;
+            client->received_ = true;
+            if (!client->framed_ && message.type == llxd_protocol::MessageType::HELLO) {
+                if (!hello(client, message.payload)) {
+                    return false;
+                }
+                continue;
+            }
+            llxd_trace::Span span("handle message");
+            handler_(client, std::move(message));
+        }
+        client->in_.erase(0, offset);
+        return true;
+    }
+
+    // Switch the connection to v2 frames and answer with our version
+    bool hello(const std::shared_ptr<Connection>& client, const std::string& payload) {
+        llxd_protocol::Hello hello;
+        if (!llxd_protocol::decode_hello(payload, hello) || hello.version < llxd_protocol::PROTOCOL_VERSION) {
+            LOG_WARN("Unsupported protocol hello");
+            return false;
+        }
+        client->framed_ = true;
+        client->send(llxd_protocol::encode_frame(llxd_protocol::FrameType::HELLO, 0,
+                                                 llxd_protocol::encode_hello(llxd_protocol::Hello())));
+        return true;
+    }
+
+    // Flush or close connections other threads wrote to or closed
+    void handle_posted() {
+        std::vector<std::shared_ptr<Connection>> posted;
+        {
+            std::unique_lock<std::mutex> lock(posted_mutex_);
+            posted.swap(posted_);
+        }
+        for (const auto& client : posted) {
+            update(client);
+        }
+    }
+
+    void update(const std::shared_ptr<Connection>& client) {
+        bool close_now = false;
+        {
+            std::unique_lock<std::mutex> lock(client->mutex_);
+            if (client->fd_ < 0) {
+                return;
+            }
+            if (!client->flush_locked()) {
+                close_now = true;
+            } else if (client->out_.empty() && client->close_requested_) {
+                close_now = true;
+            } else {
+                set_interest_locked(client);
+            }
+        }
+        if (close_now) {
+            close_connection(client);
+        }
+    }
+
+    void set_interest(const std::shared_ptr<Connection>& client) {
+        std::unique_lock<std::mutex> lock(client->mutex_);
+        set_interest_locked(client);
+    }
+
+    void set_interest_locked(const std::shared_ptr<Connection>& client) {
+        const bool write = client->blocked_;
+        if (client->reading_ == client->watch_read_ && write == client->watch_write_) {
+            return;
+        }
+        poller_.update(client->fd_, client->reading_, write, client->watch_read_, client->watch_write_);
+        client->watch_read_ = client->reading_;
+        client->watch_write_ = write;
+    }
+
+    void close_connection(const std::shared_ptr<Connection>& client) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(client->mutex_);
+            fd = client->fd_;
+            if (fd < 0) {
+                return;
+            }
+            ::close(fd);
+            client->fd_ = -1;
+            client->gone_ = true;
+            client->out_.clear();
+            client->out_bytes_ = 0;
+        }
+        connections_.erase(fd);
+        n_connections_ = connections_.size();
+    }
+
+    Reactor* owner_;
+    MessageHandler handler_;
+    WriteBudget budget_;
+    Poller poller_;
+    int listen_fd_ = -1;
+    int wake_pipe_[2] = { -1, -1 };
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+    std::atomic<bool> stop_accepting_{ false };
+
+    // Reactor thread only
+    std::unordered_map<int, std::shared_ptr<Connection>> connections_;
+    std::atomic<size_t> n_connections_{ 0 };
+
+    std::mutex posted_mutex_;
+    std::vector<std::shared_ptr<Connection>> posted_;
+
+    // Pending flushes by deadline, one per connection holding output
+    struct Timer {
+        int64_t deadline_us;
+        std::weak_ptr<Connection> client;
+    };
+    std::deque<Timer> timers_;
+
+    std::atomic<uint64_t> n_sends_{ 0 };
+    std::atomic<uint64_t> n_writes_{ 0 };
+    std::atomic<uint64_t> n_bytes_{ 0 };
+    std::atomic<uint64_t> n_timer_flushes_{ 0 };
+};
+
+Reactor::Reactor(MessageHandler handler, const WriteBudget& budget)
+    : impl(std::make_unique<Impl>(this, std::move(handler), budget)) {}
+
+Reactor::~Reactor() = default;
+
+bool Reactor::start(int listen_fd) {
+    return impl->start(listen_fd);
+}
+
+void Reactor::stop_accepting() {
+    impl->stop_accepting();
+}
+
+void Reactor::stop() {
+    impl->stop();
+}
+
+size_t Reactor::n_connections() const {
+    return impl->n_connections_;
+}
+
+WriteStats Reactor::write_stats() const {
+    WriteStats stats;
+    stats.n_sends = impl->n_sends_;
+    stats.n_writes = impl->n_writes_;
+    stats.n_bytes = impl->n_bytes_;
+    stats.n_timer_flushes = impl->n_timer_flushes_;
+    return stats;
+}
+
+void Reactor::post(std::shared_ptr<Connection> client) {
+    impl->post(std::move(client));
+}
+
+void Reactor::schedule_flush(std::shared_ptr<Connection> client) {
+    impl->schedule_flush(std::move(client));
+}
+
+const WriteBudget& Reactor::budget() const {
+    return impl->budget_;
+}
+
+void Reactor::on_send() {
+    impl->n_sends_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Reactor::on_write(size_t n_bytes) {
+    impl->n_writes_.fetch_add(1, std::memory_order_relaxed);
+    impl->n_bytes_.fetch_add(n_bytes, std::memory_order_relaxed);
+}
@@ -0,0 +1,153 @@
+#ifndef LLXD_REACTOR_H
+#define LLXD_REACTOR_H
+
+#include "protocol.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+class Reactor;
+
+// How long output may be held back to go out with later output. Held
+// output is written once max_bytes are pending or the oldest of it is
+// max_delay_us old, whichever comes first.
+struct WriteBudget {
+    size_t max_bytes = 4096;
+    int max_delay_us = 1000;    // 0 writes everything right away
+};
+
+// Socket write counters, to tune the WriteBudget
+struct WriteStats {
+    uint64_t n_sends = 0;       // Pieces handed to Connection::send
+    uint64_t n_writes = 0;      // sendmsg calls that wrote something
+    uint64_t n_bytes = 0;
+    uint64_t n_timer_flushes = 0; // Writes due to max_delay_us
+};
+
+// A complete message read from a client
+struct ClientMessage {
+    int version = 1;                // Protocol version of the connection
+    llxd_protocol::MessageType type = llxd_protocol::MessageType::PROMPT;   // v1
+    llxd_protocol::FrameType frame_type = llxd_protocol::FrameType::REQUEST; // v2
+    uint32_t request_id = 0;        // v2
+    std::string payload;
+};
+
+// Client connection owned by the reactor.
+//
+// Output is written straight to the non-blocking socket when it accepts
+// it, anything left is queued and written by the reactor thread once the
+// socket is writable, so a slow reader never blocks the caller. Output
+// sent with coalesce set is held within the reactor's WriteBudget and
+// goes out with whatever follows it in a single sendmsg. The socket is
+// only ever closed on the reactor thread.
+//
+// A v1 connection carries one request and is closed by its owner. A v2
+// connection stays open for any number of requests until the client is
+// done sending and every request opened on it has ended.
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    Connection(int fd, Reactor* reactor);
+    ~Connection();
+
+    // Queue data for the client, returns false once the client is gone.
+    // Without coalesce everything queued is written right away.
+    bool send(const char* data, size_t len, bool coalesce = false);
+    bool send(const std::string& data, bool coalesce = false) { return send(data.data(), data.size(), coalesce); }
+
+    // Close the connection once queued output is written
+    void close();
+
+    // The client hung up, or the connection failed or was closed. Lock
+    // free, cheap enough to poll from compute threads.
+    bool gone() const;
+
+    // Track requests in flight on a v2 connection by id. False when the id
+    // is in flight already, its frames could not be told apart.
+    bool begin_request(uint32_t id);
+    void end_request(uint32_t id);
+
+private:
+    friend class Reactor;
+
+    // Write queued output until the socket would block, false on error
+    bool flush_locked();
+    void close_locked();
+
+    mutable std::mutex mutex_;
+    int fd_;
+    Reactor* reactor_;              // Null once the reactor let go of it
+    std::deque<std::string> out_;
+    size_t out_offset_ = 0;         // Bytes of out_.front() already written
+    size_t out_bytes_ = 0;          // Bytes in out_ not written yet
+    bool blocked_ = false;          // The socket did not take all of out_
+    bool flush_scheduled_ = false;  // A timer writes held output
+    bool close_requested_ = false;
+    std::atomic<bool> gone_{ false };   // Set whenever fd_ is closed
+    std::unordered_set<uint32_t> open_ids_;     // v2 requests not ended yet
+    bool peer_done_ = false;        // v2 client is done sending
+
+    // Reactor thread only
+    std::string in_;                // Bytes of an incomplete message
+    bool reading_ = true;           // Client may still send
+    bool received_ = false;         // A complete message arrived
+    bool framed_ = false;           // Switched to v2 frames by a HELLO
+    bool watch_read_ = true;        // Registered interest
+    bool watch_write_ = false;
+};
+
+// Event loop serving the daemon socket on one thread.
+//
+// Accepts connections, reads messages with partial reads reassembled and
+// hands every complete message to the handler on the reactor thread, the
+// payload moved in. Answers the v2 HELLO itself, the handler only sees
+// requests. Keeps watching for hangup after the client is done sending,
+// so work for a client that went away can be cancelled right away. Idle
+// and slow clients cost a registered fd each and never hold up others.
+// Uses epoll on Linux and kqueue elsewhere.
+class Reactor {
+public:
+    using MessageHandler = std::function<void(std::shared_ptr<Connection> client, ClientMessage message)>;
+
+    explicit Reactor(MessageHandler handler, const WriteBudget& budget = WriteBudget());
+    ~Reactor();
+
+    // Serve the listening socket, taking ownership of it
+    bool start(int listen_fd);
+
+    // Close the listening socket, open connections keep being served
+    void stop_accepting();
+
+    // Close every connection and stop the loop
+    void stop();
+
+    size_t n_connections() const;
+
+    WriteStats write_stats() const;
+
+private:
+    friend class Connection;
+
+    // Have the reactor thread flush or close client
+    void post(std::shared_ptr<Connection> client);
+
+    // Have the reactor thread write client's held output once the budget's
+    // delay has passed
+    void schedule_flush(std::shared_ptr<Connection> client);
+
+    const WriteBudget& budget() const;
+    void on_send();
+    void on_write(size_t n_bytes);
+
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // LLXD_REACTOR_H
@@ -0,0 +1,292 @@
+#include "response_cache.h"
+#include "logging.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+
+static const char* const LOG_CATEGORY = "response_cache";
+
+namespace {
+
+constexpr uint64_t FILE_MAGIC = 0x3130304352584c4cULL;   // "LLXRC001"
+constexpr uint32_t FILE_VERSION = 1;
+constexpr uint32_t RECORD_MAGIC = 0x31524352;            // "RCR1"
+constexpr uint32_t RECORD_DEAD = 1;
+
+struct FileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t tail;          // End of the last complete record
+    uint64_t clock;         // Last-used stamp source
+    uint8_t padding[24];
+};
+static_assert(sizeof(FileHeader) == 64, "cache file header must stay 64 bytes");
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t key;
+    uint64_t last_used;
+    uint32_t value_size;
+    uint32_t reserved;
+};
+static_assert(sizeof(RecordHeader) == 32, "cache record header must stay 32 bytes");
+
+size_t record_size(size_t value_size) {
+    // Keep every record 8-byte aligned
+    return (sizeof(RecordHeader) + value_size + 7) & ~size_t(7);
+}
+
+} // namespace
+
+class ResponseCache::Impl {
+public:
+    Impl(const std::string& path, size_t capacity)
+        : path_(path)
+        , capacity_(std::max(capacity, sizeof(FileHeader) + record_size(4096))) {}
+
+    ~Impl() {
+        if (base_) {
+            msync(base_, capacity_, MS_ASYNC);
+            munmap(base_, capacity_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool open() {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0) {
+            LOG_ERROR("Failed to open response cache " << path_ << ": " << strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        bool fresh = fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) != capacity_;
+        if (fresh && ftruncate(fd_, capacity_) != 0) {
+            LOG_ERROR("Failed to size response cache " << path_ << ": " << strerror(errno));
+            return false;
+        }
+
+        void* base = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            LOG_ERROR("Failed to map response cache " << path_ << ": " << strerror(errno));
+            return false;
+        }
+        base_ = static_cast<char*>(base);
+
+        // A resized or foreign file starts over empty
+        FileHeader* header = file_header();
+        if (fresh || header->magic != FILE_MAGIC || header->version != FILE_VERSION ||
+            header->capacity != capacity_ || header->tail > capacity_) {
+            memset(header, 0, sizeof(FileHeader));
+            header->magic = FILE_MAGIC;
+            header->version = FILE_VERSION;
+            header->capacity = capacity_;
+            header->tail = sizeof(FileHeader);
+        }
+
+        rebuild_index();
+        return true;
+    }
+
+    bool lookup(uint64_t key, std::string& value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (!base_ || it == index_.end()) {
+            n_misses_++;
+            return false;
+        }
+
+        RecordHeader* record = record_at(it->second);
+        record->last_used = ++file_header()->clock;
+        value.assign(reinterpret_cast<const char*>(record + 1), record->value_size);
+        n_hits_++;
+        return true;
+    }
+
+    void insert(uint64_t key, const std::string& value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t size = record_size(value.size());
+        if (!base_ || size > (capacity_ - sizeof(FileHeader)) / 2) {
+            return;
+        }
+
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            kill(it->second);
+            index_.erase(it);
+        }
+
+        if (file_header()->tail + size > capacity_) {
+            compact();
+        }
+
+        // Write the record before publishing it through the tail
+        uint64_t offset = file_header()->tail;
+        RecordHeader* record = record_at(offset);
+        record->magic = RECORD_MAGIC;
+        record->flags = 0;
+        record->key = key;
+        record->last_used = ++file_header()->clock;
+        record->value_size = value.size();
+        record->reserved = 0;
+        memcpy(record + 1, value.data(), value.size());
+
+        file_header()->tail = offset + size;
+        index_[key] = offset;
+        bytes_used_ += size;
+    }
+
+    FileHeader* file_header() const {
+        return reinterpret_cast<FileHeader*>(base_);
+    }
+
+    RecordHeader* record_at(uint64_t offset) const {
+        return reinterpret_cast<RecordHeader*>(base_ + offset);
+    }
+
+    void kill(uint64_t offset) {
+        RecordHeader* record = record_at(offset);
+        record->flags |= RECORD_DEAD;
+        bytes_used_ -= record_size(record->value_size);
+    }
+
+    // Walk the log, later records for a key replace earlier ones. A torn
+    // record at the end (crash mid-append) truncates the log there.
+    void rebuild_index() {
+        index_.clear();
+        bytes_used_ = 0;
+
+        uint64_t offset = sizeof(FileHeader);
+        const uint64_t tail = file_header()->tail;
+        while (offset + sizeof(RecordHeader) <= tail) {
+            RecordHeader* record = record_at(offset);
+            size_t size = record_size(record->value_size);
+            if (record->magic != RECORD_MAGIC || offset + size > tail) {
+                break;
+            }
+
+            if (!(record->flags & RECORD_DEAD)) {
+                auto it = index_.find(record->key);
+                if (it != index_.end()) {
+                    kill(it->second);
+                }
+                index_[record->key] = offset;
+                bytes_used_ += size;
+            }
+            offset += size;
+        }
+        file_header()->tail = offset;
+    }
+
+    // Rewrite live records most recently used first, evicting the least
+    // recently used ones once half of the capacity is taken
+    void compact() {
+        std::vector<RecordHeader*> live;
+        live.reserve(index_.size());
+        for (const auto& entry : index_) {
+            live.push_back(record_at(entry.second));
+        }
+        std::sort(live.begin(), live.end(), [](const RecordHeader* a, const RecordHeader* b) {
+            return a->last_used > b->last_used;
+        });
+
+        const size_t budget = (capacity_ - sizeof(FileHeader)) / 2;
+        std::vector<char> kept;
+        kept.reserve(budget);
+        size_t n_kept = 0;
+        for (const RecordHeader* record : live) {
+            size_t size = record_size(record->value_size);
+            if (kept.size() + size > budget) {
+                break;
+            }
+            const char* src = reinterpret_cast<const char*>(record);
+            kept.insert(kept.end(), src, src + size);
+            n_kept++;
+        }
+        n_evictions_ += live.size() - n_kept;
+
+        // Oldest kept records go first so the log order matches recency
+        std::vector<char> ordered(kept.size());
+        size_t write = kept.size();
+        size_t read = 0;
+        while (read < kept.size()) {
+            const RecordHeader* record = reinterpret_cast<const RecordHeader*>(kept.data() + read);
+            size_t size = record_size(record->value_size);
+            write -= size;
+            memcpy(ordered.data() + write, kept.data() + read, size);
+            read += size;
+        }
+
+        memcpy(base_ + sizeof(FileHeader), ordered.data(), ordered.size());
+        file_header()->tail = sizeof(FileHeader) + ordered.size();
+        rebuild_index();
+        msync(base_, capacity_, MS_ASYNC);
+    }
+
+    std::string path_;
+    size_t capacity_;
+    int fd_ = -1;
+    char* base_ = nullptr;
+
+    std::unordered_map<uint64_t, uint64_t> index_;     // key -> record offset
+    size_t bytes_used_ = 0;
+    mutable std::mutex mutex_;
+
+    uint64_t n_hits_ = 0;
+    uint64_t n_misses_ = 0;
+    uint64_t n_evictions_ = 0;
+};
+
+ResponseCache::ResponseCache(const std::string& path, size_t capacity_bytes)
+    : impl(std::make_unique<Impl>(path, capacity_bytes)) {}
+
+ResponseCache::~ResponseCache() = default;
+
+bool ResponseCache::open() {
+    return impl->open();
+}
+
+bool ResponseCache::lookup(uint64_t key, std::string& value) {
+    return impl->lookup(key, value);
+}
+
+void ResponseCache::insert(uint64_t key, const std::string& value) {
+    impl->insert(key, value);
+}
+
+uint64_t ResponseCache::n_hits() const {
+    std::unique_lock<std::mutex> lock(impl->mutex_);
+    return impl->n_hits_;
+}
+
+uint64_t ResponseCache::n_misses() const {
+    std::unique_lock<std::mutex> lock(impl->mutex_);
+    return impl->n_misses_;
+}
+
+uint64_t ResponseCache::n_evictions() const {
+    std::unique_lock<std::mutex> lock(impl->mutex_);
+    return impl->n_evictions_;
+}
+
+size_t ResponseCache::n_entries() const {
+    std::unique_lock<std::mutex> lock(impl->mutex_);
+    return impl->index_.size();
+}
+
+size_t ResponseCache::bytes_used() const {
+    std::unique_lock<std::mutex> lock(impl->mutex_);
+    return impl->bytes_used_;
+}
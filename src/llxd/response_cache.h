@@ -0,0 +1,40 @@
+#ifndef LLXD_RESPONSE_CACHE_H
+#define LLXD_RESPONSE_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <memory>
+
+// Persistent response cache backed by an append-only, memory-mapped file.
+//
+// Records are appended to a fixed-size mapping and indexed in memory by a
+// 64-bit key. Lookups bump a last-used stamp in place. When the file is
+// full it is compacted: live records are kept most recently used first
+// until half the capacity is used, the rest are evicted.
+class ResponseCache {
+public:
+    ResponseCache(const std::string& path, size_t capacity_bytes);
+    ~ResponseCache();
+
+    // Map the file, creating it if needed, and rebuild the index
+    bool open();
+
+    // Copy the cached value for key into value, returns false on a miss
+    bool lookup(uint64_t key, std::string& value);
+
+    // Store value under key, replacing any previous value
+    void insert(uint64_t key, const std::string& value);
+
+    // Counters since open()
+    uint64_t n_hits() const;
+    uint64_t n_misses() const;
+    uint64_t n_evictions() const;
+    size_t n_entries() const;
+    size_t bytes_used() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // LLXD_RESPONSE_CACHE_H
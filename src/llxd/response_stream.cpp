@@ -0,0 +1,65 @@
+#include "response_stream.h"
+
+#include <cstring>
+
+ResponseStream::ResponseStream(std::shared_ptr<Connection> client)
+    : client_(std::move(client)) {}
+
+ResponseStream::ResponseStream(std::shared_ptr<Connection> client, uint32_t request_id)
+    : client_(std::move(client))
+    , request_id_(request_id)
+    , framed_(true) {
+    open_ = client_->begin_request(request_id_);
+}
+
+ResponseStream::~ResponseStream() {
+    end(llxd_protocol::FinishReason::CANCELLED);
+}
+
+bool ResponseStream::send(const char* data, size_t len) {
+    if (len == 0) {
+        return !client_->gone();
+    }
+
+    // The first token shows up at once, lines as soon as they are complete
+    const bool coalesce = sent_ && memchr(data, '\n', len) == nullptr;
+    sent_ = true;
+    if (!framed_) {
+        return client_->send(data, len, coalesce);
+    }
+    std::string frame;
+    llxd_protocol::append_frame(frame, llxd_protocol::FrameType::TOKEN, request_id_, data, len);
+    return client_->send(frame, coalesce);
+}
+
+void ResponseStream::usage(const llxd_protocol::Usage& usage) {
+    if (framed_ && !ended_) {
+        // END follows right away and writes it
+        client_->send(llxd_protocol::encode_frame(llxd_protocol::FrameType::USAGE, request_id_,
+                                                  llxd_protocol::encode_usage(usage)), true);
+    }
+}
+
+void ResponseStream::end(llxd_protocol::FinishReason reason, const std::string& message) {
+    if (ended_.exchange(true)) {
+        return;
+    }
+    if (!framed_) {
+        if (!message.empty()) {
+            client_->send(std::string(1, llxd_protocol::V1_ERROR) + message + "\n");
+        }
+        client_->close();
+        return;
+    }
+
+    std::string payload(1, static_cast<char>(reason));
+    payload += message;
+    client_->send(llxd_protocol::encode_frame(llxd_protocol::FrameType::END, request_id_, payload));
+    if (open_) {
+        client_->end_request(request_id_);
+    }
+}
+
+bool ResponseStream::gone() const {
+    return client_->gone();
+}
@@ -0,0 +1,62 @@
+#ifndef LLXD_RESPONSE_STREAM_H
+#define LLXD_RESPONSE_STREAM_H
+
+#include "protocol.h"
+#include "reactor.h"
+
+#include <string>
+#include <memory>
+#include <atomic>
+
+// Where the response to one request goes.
+//
+// On a v1 connection the text is written as is and the connection closed
+// at the end, an end message becomes a line marked with V1_ERROR. On a v2
+// connection text, usage and the end go out as frames tagged with the
+// request id, and the connection stays open for other requests.
+//
+// The first piece of text, pieces with a newline and the end are written
+// right away, other pieces may be coalesced with what follows them.
+//
+// A stream dropped without end() ends as cancelled.
+class ResponseStream {
+public:
+    // v1, the request owns the connection
+    explicit ResponseStream(std::shared_ptr<Connection> client);
+
+    // v2, one of possibly many requests on the connection
+    ResponseStream(std::shared_ptr<Connection> client, uint32_t request_id);
+
+    ~ResponseStream();
+
+    ResponseStream(const ResponseStream&) = delete;
+    ResponseStream& operator=(const ResponseStream&) = delete;
+
+    // Stream response text, returns false once the client is gone
+    bool send(const char* data, size_t len);
+    bool send(const std::string& text) { return send(text.data(), text.size()); }
+
+    // Report token counts and timings, v2 only
+    void usage(const llxd_protocol::Usage& usage);
+
+    // Finish the response, only the first call counts. A message explains
+    // why it failed.
+    void end(llxd_protocol::FinishReason reason, const std::string& message = "");
+
+    bool gone() const;
+    bool framed() const { return framed_; }
+
+    // v2 request whose id was already in flight on the connection, to be
+    // ended right away
+    bool duplicate() const { return framed_ && !open_; }
+
+private:
+    std::shared_ptr<Connection> client_;
+    uint32_t request_id_ = 0;
+    bool framed_ = false;
+    bool open_ = false;             // Holds its id on the connection
+    bool sent_ = false;             // Text went out already
+    std::atomic<bool> ended_{ false };
+};
+
+#endif // LLXD_RESPONSE_STREAM_H
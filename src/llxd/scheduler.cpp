@@ -0,0 +1,1101 @@
+#include "scheduler.h"
+#include "response_cache.h"
+#include "semantic_cache.h"
+#include "stop_matcher.h"
+#include "hash.h"
+#include "prompts.h"
+#include "logging.h"
+#include "trace.h"
+
+#include <unistd.h>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdio>
+
+static const char* const LOG_CATEGORY = "scheduler";
+
+// Limit maximum tokens since commands should be short
+static const int MAX_TOKENS = 256;
+
+// Ceiling for a requested token limit, the slot's share of the context
+// also holds the system prompt and the prompt
+static const int MAX_TOKENS_LIMIT = 512;
+
+// Shortest retry hint given to a request turned away as busy
+static const int MIN_RETRY_AFTER_MS = 100;
+
+// Throwaway request run at start when warm-up is enabled
+static const char* WARMUP_PROMPT = "List the files in the current directory, largest first";
+static const int WARMUP_DECODE_STEPS = 8;
+
+// Collapse whitespace runs and trim, so trivially different spellings of
+// the same question share a cache entry. Case is kept, paths depend on it.
+static std::string normalize_prompt(const std::string& prompt) {
+    std::string normalized;
+    normalized.reserve(prompt.size());
+    bool pending_space = false;
+    for (char c : prompt) {
+        if (isspace(static_cast<unsigned char>(c))) {
+            pending_space = !normalized.empty();
+            continue;
+        }
+        if (pending_space) {
+            normalized += ' ';
+            pending_space = false;
+        }
+        normalized += c;
+    }
+    return normalized;
+}
+
+// A queued request waiting for a free slot
+struct PendingRequest {
+    Request request;
+    int64_t t_queued = 0;
+    bool waited = false;        // All slots were busy when it arrived
+};
+
+// State of one in-flight request bound to a sequence of the shared context
+struct Slot {
+    enum class State {
+        PROMPT,                 // Prompt tokens still being decoded
+        GENERATING              // Sampling one token per step
+    };
+
+    Engine::Lease lease;
+    Request request;
+    std::vector<float> embedding;   // Prompt embedding, for the semantic cache
+    State state = State::PROMPT;
+    int max_tokens = MAX_TOKENS;
+
+    std::string formatted_prompt;   // Chat up to the assistant turn
+    std::vector<llama_token> history;   // Tokens in the slot's sequence, by position
+    std::vector<llama_token> prompt_tokens;
+    size_t n_prompt_decoded = 0;
+    llama_pos n_past = 0;
+    llama_pos n_prompt_end = 0;     // KV position where the response starts
+    llama_pos n_shared = 0;         // Leading cells shared with the prefix, not the slot's own
+
+    // Where the slot stood before the current batch, to roll it back
+    llama_pos step_n_past = 0;
+    size_t step_n_prompt_decoded = 0;
+
+    llama_token next_token = -1;    // Sampled but not yet decoded
+    int32_t i_batch = -1;           // Output index in the current batch
+    bool in_batch = false;          // Has tokens in the current batch
+    std::vector<llama_token> draft; // Draft tokens decoded after next_token
+    int n_accepted = 0;             // Draft tokens accepted by the last step
+
+    int n_generated = 0;
+    std::string response;
+    std::string transcript;         // Everything streamed to the client
+    StopMatcher stop;               // Holds back partial stop sequences
+    bool found_newline = false;
+    bool found_backticks = false;
+    bool followup_sent = false;
+    bool client_gone = false;
+    llxd_protocol::FinishReason finish_reason = llxd_protocol::FinishReason::STOP;
+
+    RequestMetrics metrics;
+    int64_t t_queued = 0;
+    int64_t t_admitted = 0;
+    int64_t t_first_token = 0;
+    int64_t t_last_decode = 0;          // Last decode that finished a step for the slot
+    int64_t t_start_prompt = 0;
+};
+
+class Scheduler::Impl {
+public:
+    Impl(std::unique_ptr<Engine> engine, const SchedulerParams& params, Metrics& metrics)
+        : engine_(std::move(engine))
+        , params_(params)
+        , metrics_(metrics)
+        , running_(false) {}
+
+    ~Impl() {
+        stop();
+    }
+
+    bool start() {
+        const int n_parallel = std::max(1, params_.n_parallel);
+        if (!engine_->init(n_parallel)) {
+            LOG_ERROR("Failed to initialize engine");
+            return false;
+        }
+
+        // Lets a decode stop early once nobody waits for its result
+        engine_->set_abort_callback(&Impl::should_abort, this);
+
+        // Prefill the system prompt once, every slot copies its KV
+        llama_chat_message system_msg;
+        system_msg.role = "system";
+        system_msg.content = UNIX_COMMAND_SYSTEM_PROMPT;
+        std::string prefix_text;
+        if (!format_chat({ system_msg }, false, prefix_text)) {
+            LOG_ERROR("Failed to apply chat template to system prompt");
+            return false;
+        }
+        if (!engine_->prefill_prefix(prefix_text)) {
+            return false;
+        }
+
+        // Everything besides the prompt that determines a response
+        cache_seed_ = llxd_hash::fnv1a(prefix_text, engine_->fingerprint());
+        cache_seed_ = llxd_hash::fnv1a(&MAX_TOKENS, sizeof(MAX_TOKENS), cache_seed_);
+
+        if (params_.warmup) {
+            warm_up();
+        }
+
+        running_ = true;
+        thread_ = std::thread(&Impl::run, this);
+        return true;
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            running_ = false;
+            stopping_ = true;   // Aborts a decode in progress
+            queue_condition_.notify_all();
+        }
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+
+        // Dropped streams end as cancelled, their leases go back first
+        active_.clear();
+        queue_.clear();
+
+        // Freed before the registry frees the model
+        if (engine_) {
+            engine_->save();
+            engine_.reset();
+        }
+    }
+
+    void submit(Request request) {
+        if (serve_from_cache(request)) {
+            return;
+        }
+
+        Request shed;   // Turned away, answered outside the lock
+        Request rejected;
+        bool queue_full = false;
+        int64_t t_retry_after = 0;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            const int64_t t_now = ggml_time_us();
+            const bool slot_free = !stopping_ && queue_.empty() && engine_->n_free() > 0;
+            if (stopping_) {
+                // Stopped, the engine may be gone already
+                rejected = std::move(request);
+            } else if (params_.max_queue > 0 && queue_.size() >= static_cast<size_t>(params_.max_queue)) {
+                // Full, the lowest priority request makes way or this one is shed
+                queue_full = true;
+                t_retry_after = estimate_wait_us(queue_.size());
+                if (queue_.back().request.priority < request.priority) {
+                    shed = std::move(queue_.back().request);
+                    queue_.pop_back();
+                } else {
+                    shed = std::move(request);
+                }
+            } else if (!slot_free && request.t_deadline > 0) {
+                const int64_t t_wait = estimate_wait_us(queue_ahead(request.priority));
+                if (t_now + t_wait > request.t_deadline) {
+                    t_retry_after = t_wait;
+                    shed = std::move(request);
+                }
+            }
+
+            if (request.stream) {
+                PendingRequest pending;
+                pending.waited = !slot_free;
+                pending.t_queued = t_now;
+                pending.request = std::move(request);
+
+                // Ahead of lower priorities, first come first served otherwise
+                queue_.insert(queue_.begin() + queue_ahead(pending.request.priority), std::move(pending));
+                metrics_.on_queued(queue_.size());
+                queue_condition_.notify_one();
+            }
+        }
+
+        if (rejected.stream) {
+            LOG_WARN("Request submitted to a stopped scheduler");
+            rejected.stream->end(llxd_protocol::FinishReason::ERROR, "model unloaded");
+            return;
+        }
+        if (shed.stream) {
+            const int64_t t_retry_after_ms = std::max<int64_t>(MIN_RETRY_AFTER_MS, t_retry_after / 1000);
+            DEBUG_LOG("Shedding request" << (queue_full ? ", queue full" : ", would miss its deadline")
+                      << ": " << shed.payload);
+            metrics_.on_shed(queue_full);
+            shed.stream->end(llxd_protocol::FinishReason::BUSY,
+                             "busy, retry after " + std::to_string(t_retry_after_ms) + " ms");
+        }
+    }
+
+    bool idle() {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        return queue_.empty() && n_active_ == 0;
+    }
+
+private:
+    uint64_t cache_key(const Request& request) const {
+        uint64_t key = llxd_hash::fnv1a(normalize_prompt(request.payload), cache_seed_);
+        key = llxd_hash::fnv1a(&request.stop_set, sizeof(request.stop_set), key);
+        for (const std::string& stop : request.stop) {
+            key = llxd_hash::fnv1a(stop, key);
+        }
+
+        // Overrides only, so default requests keep their keys
+        if (max_tokens_for(request) != MAX_TOKENS) {
+            int max_tokens = max_tokens_for(request);
+            key = llxd_hash::fnv1a(&max_tokens, sizeof(max_tokens), key);
+        }
+        if (has_temperature(request)) {
+            key = llxd_hash::fnv1a(&request.temperature, sizeof(request.temperature), key);
+        }
+        return key;
+    }
+
+    // Queued requests served before one of the given priority
+    size_t queue_ahead(int priority) const {
+        auto it = std::find_if(queue_.begin(), queue_.end(), [priority](const PendingRequest& queued) {
+            return queued.request.priority < priority;
+        });
+        return it - queue_.begin();
+    }
+
+    // Expected wait behind n_ahead queued requests, from the average time
+    // a request holds a slot. 0 until a request has finished.
+    int64_t estimate_wait_us(size_t n_ahead) const {
+        return avg_service_us_ * static_cast<int64_t>(n_ahead + 1) / static_cast<int64_t>(std::max<size_t>(1, engine_->n_seq()));
+    }
+
+    static int max_tokens_for(const Request& request) {
+        return request.max_tokens > 0 ? std::min(request.max_tokens, MAX_TOKENS_LIMIT) : MAX_TOKENS;
+    }
+
+    bool has_temperature(const Request& request) const {
+        return request.temperature >= 0.0f && request.temperature != engine_->temperature();
+    }
+
+    // Stream an exactly matching cached response back without touching the
+    // model. Only a hash and a lookup, submit() runs on the dispatcher.
+    bool serve_from_cache(Request& request) {
+        if (!params_.response_cache) {
+            return false;
+        }
+
+        std::string cached;
+        bool hit = params_.response_cache->lookup(cache_key(request), cached);
+        metrics_.on_cache_lookup(hit);
+        if (!hit) {
+            return false;
+        }
+        DEBUG_LOG("Response cache hit for: " << request.payload);
+        reply_from_cache(request, cached);
+        return true;
+    }
+
+    // Paraphrases of an earlier prompt share its cached response. The
+    // embedding decodes the prompt, so this runs on the scheduler thread at
+    // admission, where it only delays this model. On a miss embedding is
+    // kept to index the response under.
+    bool serve_from_semantic_cache(Request& request, std::vector<float>& embedding) {
+        if (!params_.response_cache || !params_.semantic_cache ||
+            request.stop_set != llxd_protocol::StopSet::CODE_BLOCK || !request.stop.empty() ||
+            max_tokens_for(request) != MAX_TOKENS || has_temperature(request)) {
+            return false;
+        }
+
+        int64_t t_start = ggml_time_us();
+        embedding = params_.semantic_cache->embed(normalize_prompt(request.payload));
+        int64_t t_embedded = ggml_time_us();
+
+        std::string cached;
+        bool hit = false;
+        uint64_t key = 0;
+        float similarity = 0.0f;
+        if (!embedding.empty() && params_.semantic_cache->search(embedding, key, similarity) &&
+            similarity >= params_.semantic_threshold) {
+            hit = params_.response_cache->lookup(key, cached);
+        }
+        int64_t t_end = ggml_time_us();
+        metrics_.on_semantic_lookup(hit, t_end - t_start);
+        DEBUG_LOG("Semantic cache " << (hit ? "hit" : "miss") << " for: " << request.payload
+                  << " (similarity " << similarity << ", embed " << (t_embedded - t_start) / 1e3
+                  << " ms, search " << (t_end - t_embedded) / 1e3 << " ms)");
+        if (!hit) {
+            return false;
+        }
+        reply_from_cache(request, cached);
+        return true;
+    }
+
+    void reply_from_cache(Request& request, const std::string& cached) {
+        metrics_.on_request_start();
+        request.stream->send(cached);
+        llxd_protocol::Usage usage;
+        usage.from_cache = 1;
+        request.stream->usage(usage);
+        request.stream->end(llxd_protocol::FinishReason::STOP);
+        metrics_.on_request_end(RequestMetrics());
+    }
+
+    void run() {
+        llxd_trace::set_thread_name("scheduler " + params_.model_path);
+        while (true) {
+            std::vector<PendingRequest> expired;
+
+            // Admit queued requests into free slots between steps
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex_);
+                queue_condition_.wait(lock, [this] {
+                    return !running_ || !active_.empty() || !queue_.empty();
+                });
+
+                if (!running_) {
+                    break;
+                }
+
+                // Nobody waits for these any more
+                const int64_t t_now = ggml_time_us();
+                for (auto it = queue_.begin(); it != queue_.end();) {
+                    if (it->request.stream->gone()) {
+                        DEBUG_LOG("Client went away while queued: " << it->request.payload);
+                        metrics_.on_cancelled_in_queue();
+                        it = queue_.erase(it);
+                    } else if (it->request.t_deadline > 0 && t_now > it->request.t_deadline) {
+                        expired.push_back(std::move(*it));
+                        it = queue_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+
+                while (!queue_.empty()) {
+                    Engine::Lease lease = engine_->try_acquire();
+                    if (!lease) {
+                        break;
+                    }
+                    PendingRequest pending = std::move(queue_.front());
+                    queue_.pop_front();
+                    metrics_.on_dequeued(ggml_time_us() - pending.t_queued);
+                    n_active_++;    // Not idle while the slot starts
+
+                    lock.unlock();
+                    start_slot(std::move(lease), std::move(pending));
+                    lock.lock();
+                    n_active_ = active_.size();
+                }
+            }
+
+            for (PendingRequest& pending : expired) {
+                const int64_t t_waited_ms = (ggml_time_us() - pending.t_queued) / 1000;
+                DEBUG_LOG("Deadline passed after " << t_waited_ms << " ms in queue: " << pending.request.payload);
+                metrics_.on_expired();
+                pending.request.stream->end(llxd_protocol::FinishReason::EXPIRED,
+                                            "deadline passed after " + std::to_string(t_waited_ms) + " ms in queue");
+            }
+
+            if (!active_.empty()) {
+                step();
+                n_active_ = active_.size();
+            }
+        }
+    }
+
+    // Prefill a short prompt and decode a few tokens on a pooled slot
+    // before the loop starts, so compute buffers, kernels and weight pages
+    // are ready when the first request arrives. Releasing the lease drops
+    // the sequence again.
+    void warm_up() {
+        Engine::Lease lease = engine_->try_acquire();
+        if (!lease) {
+            return;
+        }
+        const llama_seq_id seq_id = lease.seq_id();
+
+        llama_chat_message system_msg;
+        system_msg.role = "system";
+        system_msg.content = UNIX_COMMAND_SYSTEM_PROMPT;
+        llama_chat_message user_msg;
+        user_msg.role = "user";
+        user_msg.content = WARMUP_PROMPT;
+        std::string formatted_prompt;
+        if (!format_chat({ system_msg, user_msg }, true, formatted_prompt)) {
+            return;
+        }
+
+        llama_pos n_past = 0;
+        std::vector<llama_token> tokens;
+        const std::string& prefix_text = engine_->prefix_text();
+        if (formatted_prompt.compare(0, prefix_text.size(), prefix_text) == 0) {
+            engine_->seq_reset(seq_id, true);
+            n_past = engine_->prefix_tokens().size();
+            tokens = engine_->tokenize(formatted_prompt.substr(prefix_text.size()), false);
+        } else {
+            tokens = engine_->tokenize(formatted_prompt, true);
+        }
+        tokens.resize(std::min<size_t>(tokens.size(), engine_->n_batch()));
+        if (tokens.empty()) {
+            return;
+        }
+
+        int64_t t_start_prefill = ggml_time_us();
+        engine_->batch_clear();
+        for (size_t i = 0; i < tokens.size(); i++) {
+            engine_->batch_add(tokens[i], n_past++, seq_id, i == tokens.size() - 1);
+        }
+        if (engine_->decode() != 0) {
+            LOG_ERROR("Warm-up prefill failed");
+            return;
+        }
+
+        // Decode steps, the tokens are thrown away with the lease's sampler state
+        int64_t t_start_decode = ggml_time_us();
+        int n_decoded = 0;
+        for (; n_decoded < WARMUP_DECODE_STEPS; n_decoded++) {
+            llama_token token = engine_->sample(seq_id, -1);
+            engine_->batch_clear();
+            engine_->batch_add(token, n_past++, seq_id, true);
+            if (engine_->decode() != 0) {
+                LOG_ERROR("Warm-up decode failed");
+                break;
+            }
+        }
+        int64_t t_end = ggml_time_us();
+        engine_->batch_clear();
+
+        LOG_INFO("Warm-up " << params_.model_path << ": prefill " << tokens.size() << " tokens in "
+                  << (t_start_decode - t_start_prefill) / 1e3 << " ms, " << n_decoded << " decode steps in "
+                  << (t_end - t_start_decode) / 1e3 << " ms");
+    }
+
+    // Render messages with the model's chat template
+    bool format_chat(const std::vector<llama_chat_message>& messages, bool add_ass, std::string& out) const {
+        return engine_->format_chat(messages, add_ass, out);
+    }
+
+    // Cells the slot may still fill once its pending prompt is decoded
+    int cells_left(const Slot& slot) const {
+        const size_t n_used = slot.n_past - slot.n_shared + (slot.prompt_tokens.size() - slot.n_prompt_decoded);
+        return engine_->n_seq_cells() - static_cast<int>(n_used);
+    }
+
+    // Reset the slot's sequence to the resident system prompt KV when the
+    // formatted prompt starts with it, so only the rest has to be decoded
+    bool load_prompt(Slot& slot, const std::string& formatted_prompt) {
+        llxd_trace::Span span("tokenize");
+        llama_seq_id seq_id = slot.lease.seq_id();
+        engine_->reset_draft(seq_id);
+
+        const std::string& prefix_text = engine_->prefix_text();
+        if (formatted_prompt.compare(0, prefix_text.size(), prefix_text) == 0) {
+            engine_->seq_reset(seq_id, true);
+            slot.history = engine_->prefix_tokens();
+            slot.n_past = slot.history.size();
+            slot.n_shared = slot.n_past;
+            slot.prompt_tokens = engine_->tokenize(formatted_prompt.substr(prefix_text.size()), false);
+            slot.metrics.n_prompt_tokens_cached += slot.n_past;
+        } else {
+            DEBUG_LOG("Formatted prompt does not start with the cached prefix, prefilling in full");
+            engine_->seq_reset(seq_id, false);
+            slot.history.clear();
+            slot.n_past = 0;
+            slot.n_shared = 0;
+            slot.prompt_tokens = engine_->tokenize(formatted_prompt, true);
+        }
+        slot.n_prompt_decoded = 0;
+        return !slot.prompt_tokens.empty();
+    }
+
+    void start_slot(Engine::Lease lease, PendingRequest pending) {
+        std::vector<float> embedding;
+        if (serve_from_semantic_cache(pending.request, embedding)) {
+            return;     // The lease goes back unused
+        }
+
+        auto slot = std::make_unique<Slot>();
+        slot->lease = std::move(lease);
+        slot->request = std::move(pending.request);
+        slot->embedding = std::move(embedding);
+        slot->stop = make_stop_matcher(slot->request);
+        slot->max_tokens = max_tokens_for(slot->request);
+        slot->t_queued = pending.t_queued;
+        slot->t_start_prompt = ggml_time_us();
+        slot->t_admitted = slot->t_start_prompt;
+        llxd_trace::record("queued", slot->t_queued, slot->t_admitted, slot->request.id, true);
+        llxd_trace::Span span("start", slot->request.id);
+
+        metrics_.on_request_start();
+        metrics_.on_context_lease(pending.waited, slot->t_start_prompt - pending.t_queued);
+
+        if (!engine_->begin(slot->lease.seq_id(), has_temperature(slot->request) ? slot->request.temperature : -1.0f)) {
+            LOG_ERROR("Failed to initialize sampler");
+            slot->request.stream->end(llxd_protocol::FinishReason::ERROR, "failed to initialize sampler");
+            slot->metrics.failed = true;
+            metrics_.on_request_end(slot->metrics);
+            return;
+        }
+
+        DEBUG_LOG("Processing LLM request on seq " << slot->lease.seq_id() << ": " << slot->request.payload);
+
+        // Create chat messages
+        std::vector<llama_chat_message> messages;
+
+        // Add system message with more specific instructions
+        llama_chat_message system_msg;
+        system_msg.role = "system";
+        system_msg.content = UNIX_COMMAND_SYSTEM_PROMPT;
+        messages.push_back(system_msg);
+
+        // Add user message
+        llama_chat_message user_msg;
+        user_msg.role = "user";
+        user_msg.content = slot->request.payload.c_str();
+        messages.push_back(user_msg);
+
+        std::string formatted_prompt;
+        if (!format_chat(messages, true, formatted_prompt)) {
+            LOG_ERROR("Failed to apply chat template");
+            slot->request.stream->end(llxd_protocol::FinishReason::ERROR, "failed to apply chat template");
+            slot->metrics.failed = true;
+            metrics_.on_request_end(slot->metrics);
+            return;
+        }
+        DEBUG_LOG("Applied chat template successfully. Prompt size: " << formatted_prompt.size());
+        DEBUG_LOG("Formatted prompt:\n" << formatted_prompt);
+
+        slot->formatted_prompt = formatted_prompt;
+        if (!load_prompt(*slot, formatted_prompt)) {
+            LOG_ERROR("Failed to tokenize prompt");
+            slot->request.stream->end(llxd_protocol::FinishReason::ERROR, "failed to tokenize prompt");
+            slot->metrics.failed = true;
+            metrics_.on_request_end(slot->metrics);
+            return;
+        }
+        DEBUG_LOG("Tokenized prompt into " << slot->prompt_tokens.size() << " tokens after "
+                  << slot->n_past << " cached prefix tokens");
+
+        // The answer gets what room the prompt leaves in the slot's cells
+        const int room = cells_left(*slot);
+        if (room < 1) {
+            LOG_WARN("Prompt of " << slot->prompt_tokens.size() << " tokens does not fit the "
+                     << engine_->n_seq_cells() << " cells of a sequence");
+            slot->request.stream->end(llxd_protocol::FinishReason::ERROR, "prompt too long");
+            slot->metrics.failed = true;
+            metrics_.on_request_end(slot->metrics);
+            return;
+        }
+        slot->max_tokens = std::min(slot->max_tokens, room);
+
+        active_.push_back(std::move(slot));
+    }
+
+    // Build one batch from every active slot, decode it and advance each slot
+    void step() {
+        llxd_trace::Span span("step");
+        const int n_batch = engine_->n_batch();
+        int n_sequences = 0;
+
+        // Free the slots of clients that went away before spending more on them
+        for (auto it = active_.begin(); it != active_.end();) {
+            if ((*it)->request.stream->gone()) {
+                cancel_slot(**it);
+                it = active_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        engine_->batch_clear();
+
+        // Generating slots first, one token each plus any draft tokens, so
+        // inter-token latency stays flat while new prompts are prefilled
+        for (auto& slot : active_) {
+            slot->i_batch = -1;
+            slot->in_batch = false;
+            slot->draft.clear();
+            slot->step_n_past = slot->n_past;
+            slot->step_n_prompt_decoded = slot->n_prompt_decoded;
+            if (slot->state == Slot::State::GENERATING) {
+                slot->in_batch = true;
+                slot->i_batch = engine_->batch_size();
+                engine_->batch_add(slot->next_token, slot->n_past++, slot->lease.seq_id(), true);
+                slot->history.push_back(slot->next_token);
+                if (engine_->has_drafts()) {
+                    // Room is left for one token of every other slot
+                    int n_max = std::min(n_batch - engine_->batch_size() - static_cast<int>(active_.size()),
+                                         slot->max_tokens - slot->n_generated - 1);
+                    if (n_max > 0) {
+                        slot->draft = engine_->draft(slot->lease.seq_id(), slot->history, n_max);
+                    }
+                }
+                for (llama_token token : slot->draft) {
+                    engine_->batch_add(token, slot->n_past++, slot->lease.seq_id(), true);
+                }
+                n_sequences++;
+            }
+        }
+
+        // Fill the remaining capacity with pending prompt chunks
+        for (auto& slot : active_) {
+            if (slot->state != Slot::State::PROMPT || engine_->batch_size() >= n_batch) {
+                continue;
+            }
+
+            const size_t n_prompt = slot->prompt_tokens.size();
+            slot->in_batch = true;
+            while (slot->n_prompt_decoded < n_prompt && engine_->batch_size() < n_batch) {
+                bool last = slot->n_prompt_decoded == n_prompt - 1;
+                llama_token token = slot->prompt_tokens[slot->n_prompt_decoded++];
+                engine_->batch_add(token, slot->n_past++, slot->lease.seq_id(), last);
+                slot->history.push_back(token);
+            }
+            if (slot->n_prompt_decoded == n_prompt) {
+                slot->i_batch = engine_->batch_size() - 1;
+            }
+            n_sequences++;
+        }
+
+        const int n_tokens = engine_->batch_size();
+        if (n_tokens == 0) {
+            return;
+        }
+
+        batch_streams_.clear();
+        for (auto& slot : active_) {
+            if (slot->in_batch) {
+                batch_streams_.push_back(slot->request.stream.get());
+            }
+        }
+
+        int64_t t_start_decode = ggml_time_us();
+        int ret = engine_->decode();
+        batch_streams_.clear();
+        if (ret == 2) {
+            // Aborted, every client in the batch is gone or we are stopping.
+            // Their sequences are dropped with the slots.
+            DEBUG_LOG("Decode of " << n_tokens << " tokens aborted after "
+                      << (ggml_time_us() - t_start_decode) / 1e3 << " ms");
+            metrics_.on_decode_aborted();
+            for (auto it = active_.begin(); it != active_.end();) {
+                if ((*it)->in_batch) {
+                    cancel_slot(**it);
+                    it = active_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            return;
+        }
+        if (ret != 0) {
+            LOG_ERROR("Failed to decode batch of " << n_tokens << " tokens");
+            fail_decode();
+            return;
+        }
+        int64_t t_end_decode = ggml_time_us();
+        llxd_trace::record("decode", t_start_decode, t_end_decode);
+        metrics_.on_batch(n_tokens, n_sequences, t_start_decode, t_end_decode);
+
+        for (auto it = active_.begin(); it != active_.end();) {
+            Slot& slot = **it;
+            if (slot.i_batch < 0) {
+                ++it;   // More prompt chunks to go
+                continue;
+            }
+
+            bool generating = slot.state == Slot::State::GENERATING;
+            if (!generating) {
+                slot.metrics.on_prompt_eval(slot.prompt_tokens.size(), slot.t_start_prompt, t_end_decode);
+                llxd_trace::record(slot.metrics.in_repair ? "repair prefill" : "prefill", slot.t_start_prompt,
+                                   t_end_decode, slot.request.id, true);
+                slot.state = Slot::State::GENERATING;
+                slot.n_prompt_end = slot.n_past;
+            }
+
+            bool more = sample_next(slot);
+            if (!more) {
+                flush_stop(slot);
+            }
+            if (generating) {
+                slot.metrics.on_token_generated(t_start_decode, t_end_decode, 1 + slot.n_accepted);
+                metrics_.on_inter_token(t_end_decode - slot.t_last_decode, 1 + slot.n_accepted);
+            }
+            slot.t_last_decode = t_end_decode;
+
+            if (more || start_followup(slot)) {
+                ++it;
+                continue;
+            }
+
+            finish_slot(slot);
+            it = active_.erase(it);
+        }
+    }
+
+    // A batch failed to decode, most likely the shared KV cache ran out.
+    // Fail the batch's slot holding the most cells of its own and roll
+    // the others back to where they were before the batch, so they retry
+    // next step. Repeated failures shed one slot each.
+    void fail_decode() {
+        auto victim = active_.end();
+        for (auto it = active_.begin(); it != active_.end(); ++it) {
+            const Slot& slot = **it;
+            if (slot.in_batch && (victim == active_.end() ||
+                                  slot.n_past - slot.n_shared > (*victim)->n_past - (*victim)->n_shared)) {
+                victim = it;
+            }
+        }
+
+        for (auto& slot : active_) {
+            if (!slot->in_batch) {
+                continue;
+            }
+            slot->n_past = slot->step_n_past;
+            slot->n_prompt_decoded = slot->step_n_prompt_decoded;
+            slot->history.resize(slot->n_past);
+            slot->draft.clear();
+            slot->i_batch = -1;
+            engine_->seq_truncate(slot->lease.seq_id(), slot->n_past);
+            engine_->reset_draft(slot->lease.seq_id());
+        }
+
+        if (victim != active_.end()) {
+            Slot& slot = **victim;
+            slot.request.stream->end(llxd_protocol::FinishReason::ERROR, "failed to decode");
+            slot.metrics.failed = true;
+            metrics_.on_request_end(slot.metrics);
+            active_.erase(victim);
+        }
+    }
+
+    // Abort callback of the shared context, polled by the compute threads
+    // while a batch decodes. Aborts when every client in the batch is gone,
+    // a batch shared with live requests always completes.
+    static bool should_abort(void* user_data) {
+        Impl* self = static_cast<Impl*>(user_data);
+        if (self->stopping_) {
+            return true;
+        }
+        if (self->batch_streams_.empty()) {
+            return false;
+        }
+        for (const ResponseStream* stream : self->batch_streams_) {
+            if (!stream->gone()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // End a slot whose client went away
+    void cancel_slot(Slot& slot) {
+        DEBUG_LOG("Client went away, cancelling seq " << slot.lease.seq_id() << " after "
+                  << slot.history.size() << " tokens");
+        slot.client_gone = true;
+        slot.finish_reason = llxd_protocol::FinishReason::CANCELLED;
+        finish_slot(slot);
+    }
+
+    // Sample the slot's next token, or verify its draft tokens and sample
+    // past the accepted ones, and stream the pieces. Returns false when the
+    // slot's current generation has ended.
+    bool sample_next(Slot& slot) {
+        llxd_trace::Span span("sample", slot.request.id);
+        slot.n_accepted = 0;
+        if (slot.n_generated >= slot.max_tokens) {
+            slot.finish_reason = llxd_protocol::FinishReason::LENGTH;
+            return false;
+        }
+
+        const llama_seq_id seq_id = slot.lease.seq_id();
+        if (slot.draft.empty()) {
+            llama_token new_token = engine_->sample(seq_id, slot.i_batch);
+            if (!emit_token(slot, new_token)) {
+                return false;
+            }
+
+            // Accept token, it is decoded with the next batch
+            engine_->accept(seq_id, new_token);
+            slot.next_token = new_token;
+            return true;
+        }
+
+        // Logits of next_token and each draft token are consecutive outputs
+        std::vector<int> idxs(slot.draft.size() + 1);
+        for (size_t i = 0; i < idxs.size(); i++) {
+            idxs[i] = slot.i_batch + i;
+        }
+        std::vector<llama_token> ids = engine_->sample_and_accept_n(seq_id, idxs, slot.draft);
+
+        // Accepted draft tokens are already in the KV cache, drop the rest
+        slot.n_accepted = ids.size() - 1;
+        slot.metrics.on_draft(slot.draft.size(), slot.n_accepted);
+        slot.history.insert(slot.history.end(), ids.begin(), ids.end() - 1);
+        slot.n_past = slot.history.size();
+        engine_->seq_truncate(seq_id, slot.n_past);
+
+        for (llama_token id : ids) {
+            if (slot.n_generated >= slot.max_tokens) {
+                slot.finish_reason = llxd_protocol::FinishReason::LENGTH;
+                return false;
+            }
+            if (!emit_token(slot, id)) {
+                return false;
+            }
+        }
+        slot.next_token = ids.back();
+        return true;
+    }
+
+    // Stream one sampled token to the client, returns false on end of
+    // generation or when the client is gone
+    bool emit_token(Slot& slot, llama_token new_token) {
+        // Check for end conditions
+        if (engine_->is_eog(new_token) || (slot.found_newline && engine_->is_bos(new_token))) {
+            slot.finish_reason = llxd_protocol::FinishReason::EOS;
+            return false;
+        }
+
+        // Convert token to text
+        std::string piece = engine_->detokenize(new_token);
+
+        // Track backticks for follow-up prompt logic
+        if (piece.find("```") != std::string::npos) {
+            slot.found_backticks = true;
+        }
+
+        // Track if we've seen a newline
+        if (piece.find('\n') != std::string::npos) {
+            slot.found_newline = true;
+        }
+
+        // Send piece to client without any formatting, minus stop sequences
+        std::string out = slot.stop.feed(piece);
+        if (!send_text(slot, out)) {
+            return false;
+        }
+        if (slot.stop.stopped()) {
+            slot.finish_reason = llxd_protocol::FinishReason::STOP;
+            // The stopping token is never decoded, keep it out of the response
+            DEBUG_LOG("Stop sequence matched on seq " << slot.lease.seq_id());
+            return false;
+        }
+
+        // Collect response for validation
+        slot.response += piece;
+        slot.n_generated++;
+        return true;
+    }
+
+    bool send_text(Slot& slot, const std::string& text) {
+        if (text.empty()) {
+            return true;
+        }
+        llxd_trace::Span span("send", slot.request.id);
+        if (!slot.request.stream->send(text)) {
+            slot.client_gone = true;
+            slot.finish_reason = llxd_protocol::FinishReason::CANCELLED;
+            return false;
+        }
+        if (slot.t_first_token == 0) {
+            slot.t_first_token = ggml_time_us();
+        }
+        slot.transcript += text;
+        return true;
+    }
+
+    // Send text held back for a partial stop sequence once generation ends
+    void flush_stop(Slot& slot) {
+        if (!slot.client_gone) {
+            send_text(slot, slot.stop.flush());
+        }
+    }
+
+    StopMatcher make_stop_matcher(const Request& request) const {
+        std::vector<StopMatcher::Pattern> patterns;
+        if (request.stop_set == llxd_protocol::StopSet::CODE_BLOCK) {
+            patterns = StopMatcher::code_block();
+        }
+        for (const std::string& stop : request.stop) {
+            patterns.push_back({ stop, 0, false });
+        }
+        return StopMatcher(std::move(patterns));
+    }
+
+    // If no backticks were found, queue a follow-up prompt on the same slot.
+    // The KV cache already holds the prompt and the response, so only the
+    // delta (assistant end marker plus the reformat user turn) is decoded.
+    bool start_followup(Slot& slot) {
+        if (params_.constrained_output || slot.found_backticks || slot.followup_sent || slot.client_gone) {
+            return false;
+        }
+        llxd_trace::Span span("repair", slot.request.id);
+        slot.followup_sent = true;
+        slot.metrics.in_repair = true;
+        slot.stop.reset();
+
+        // Create follow-up message
+        std::vector<llama_chat_message> messages;
+        messages.push_back({ "system", UNIX_COMMAND_SYSTEM_PROMPT });
+        messages.push_back({ "user", slot.request.payload.c_str() });
+        messages.push_back({ "assistant", slot.response.c_str() });
+        messages.push_back({ "user", "Please reformat the above response to enclose the command in ```bash backticks." });
+
+        std::string formatted_followup;
+        if (!format_chat(messages, true, formatted_followup)) {
+            LOG_ERROR("Failed to apply chat template for follow-up");
+            return false;
+        }
+
+        // Send newline before follow-up response. A client gone by now is
+        // not worth the prefill, the slot finishes as cancelled.
+        if (!send_text(slot, "\n")) {
+            return false;
+        }
+
+        const std::string decoded = slot.formatted_prompt + slot.response;
+        if (formatted_followup.compare(0, decoded.size(), decoded) == 0) {
+            // Append after the response already in the KV cache
+            slot.prompt_tokens = engine_->tokenize(formatted_followup.substr(decoded.size()), false);
+            slot.n_prompt_decoded = 0;
+        } else if (formatted_followup.compare(0, slot.formatted_prompt.size(), slot.formatted_prompt) == 0) {
+            // The template rewrote the response (e.g. trimmed it), drop the
+            // response cells and keep the prompt
+            DEBUG_LOG("Follow-up diverges inside the response, rewinding to the prompt");
+            engine_->seq_truncate(slot.lease.seq_id(), slot.n_prompt_end);
+            slot.n_past = slot.n_prompt_end;
+            slot.history.resize(slot.n_past);
+            engine_->reset_draft(slot.lease.seq_id());
+            slot.prompt_tokens = engine_->tokenize(formatted_followup.substr(slot.formatted_prompt.size()), false);
+            slot.n_prompt_decoded = 0;
+        } else {
+            DEBUG_LOG("Follow-up diverges inside the prompt, prefilling from the system prompt");
+            if (!load_prompt(slot, formatted_followup)) {
+                slot.prompt_tokens.clear();
+            }
+        }
+        if (slot.prompt_tokens.empty()) {
+            LOG_ERROR("Failed to tokenize follow-up prompt");
+            return false;
+        }
+        const int room = cells_left(slot);
+        if (room < 1) {
+            DEBUG_LOG("No room for a repair pass on seq " << slot.lease.seq_id());
+            return false;
+        }
+        slot.max_tokens = std::min(max_tokens_for(slot.request), room);
+        DEBUG_LOG("Repair pass on seq " << slot.lease.seq_id() << ": " << slot.prompt_tokens.size()
+                  << " delta tokens after " << slot.n_past << " cached tokens");
+
+        // Generate follow-up response
+        slot.state = Slot::State::PROMPT;
+        slot.t_start_prompt = ggml_time_us();
+        slot.n_generated = 0;
+        slot.response.clear();
+        slot.found_newline = false;
+        slot.found_backticks = false;
+        return true;
+    }
+
+    void finish_slot(Slot& slot) {
+        // Lets the engine learn from the response, for future drafts
+        engine_->on_response(slot.history, slot.n_prompt_end);
+
+        DEBUG_LOG("Complete LLM response for request:\n" << slot.response);
+
+        if (slot.client_gone) {
+            slot.metrics.cancelled = true;
+            slot.metrics.n_cancelled_tokens = slot.history.size() > slot.metrics.n_prompt_tokens_cached
+                                                  ? slot.history.size() - slot.metrics.n_prompt_tokens_cached
+                                                  : 0;
+        }
+
+        // Only complete answers are worth replaying, not ones cut off by
+        // max_tokens, an error or a cancel
+        const bool complete = slot.finish_reason == llxd_protocol::FinishReason::STOP ||
+                              slot.finish_reason == llxd_protocol::FinishReason::EOS;
+        if (params_.response_cache && complete && !slot.client_gone && !slot.transcript.empty()) {
+            uint64_t key = cache_key(slot.request);
+            params_.response_cache->insert(key, slot.transcript);
+            if (params_.semantic_cache && !slot.embedding.empty()) {
+                params_.semantic_cache->insert(slot.embedding, key);
+            }
+        }
+
+        const int64_t t_end = ggml_time_us();
+        llxd_trace::record("request", slot.t_queued, t_end, slot.request.id, true);
+        if (!slot.client_gone) {
+            // Moving average of the time a request holds a slot, for wait estimates
+            const int64_t t_service = t_end - slot.t_admitted;
+            avg_service_us_ = avg_service_us_ == 0 ? t_service : (avg_service_us_ * 4 + t_service) / 5;
+        }
+
+        llxd_protocol::Usage usage;
+        usage.prompt_tokens = slot.metrics.n_prompt_tokens_processed + slot.metrics.n_repair_prompt_tokens;
+        usage.cached_tokens = slot.metrics.n_prompt_tokens_cached;
+        usage.generated_tokens = slot.metrics.n_tokens_predicted + slot.metrics.n_repair_tokens_predicted;
+        usage.t_first_token_us = slot.t_first_token > 0 ? slot.t_first_token - slot.t_queued : 0;
+        usage.t_total_us = t_end - slot.t_queued;
+        slot.request.stream->usage(usage);
+        slot.request.stream->end(slot.finish_reason);
+
+        if (!slot.client_gone) {
+            slot.metrics.t_first_token = usage.t_first_token_us;
+            slot.metrics.t_total = usage.t_total_us;
+        }
+
+        metrics_.on_request_end(slot.metrics);
+    }
+
+    std::unique_ptr<Engine> engine_;
+    SchedulerParams params_;
+    Metrics& metrics_;
+    std::atomic<bool> running_;
+    std::atomic<bool> stopping_{ false };
+    std::thread thread_;
+
+    uint64_t cache_seed_ = 0;
+
+    // Only touched by the scheduler thread
+    std::vector<std::unique_ptr<Slot>> active_;
+    std::vector<const ResponseStream*> batch_streams_;  // Read by should_abort during a decode
+    std::atomic<size_t> n_active_{0};   // active_.size() for other threads
+
+    std::deque<PendingRequest> queue_;     // By priority, then arrival
+    std::atomic<int64_t> avg_service_us_{ 0 };
+    std::mutex queue_mutex_;
+    std::condition_variable queue_condition_;
+};
+
+Scheduler::Scheduler(std::unique_ptr<Engine> engine, const SchedulerParams& params, Metrics& metrics)
+    : impl(std::make_unique<Impl>(std::move(engine), params, metrics)) {}
+
+Scheduler::~Scheduler() = default;
+
+bool Scheduler::start() {
+    return impl->start();
+}
+
+void Scheduler::stop() {
+    impl->stop();
+}
+
+void Scheduler::submit(Request request) {
+    impl->submit(std::move(request));
+}
+
+bool Scheduler::idle() const {
+    return impl->idle();
+}
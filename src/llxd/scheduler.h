@@ -0,0 +1,85 @@
+#ifndef LLXD_SCHEDULER_H
+#define LLXD_SCHEDULER_H
+
+#include "engine.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "response_stream.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+
+class ResponseCache;
+class SemanticCache;
+
+// Request structure to hold client request data
+struct Request {
+    std::unique_ptr<ResponseStream> stream;
+    uint64_t id = 0;            // Daemon wide sequence number, tags trace spans
+    llxd_protocol::MessageType type = llxd_protocol::MessageType::PROMPT;
+    std::string payload;        // The prompt
+
+    // Stop sequences, the built-in set plus any extra strings
+    llxd_protocol::StopSet stop_set = llxd_protocol::StopSet::CODE_BLOCK;
+    std::vector<std::string> stop;
+
+    // Model to serve the request, empty for the daemon's default model
+    std::string model;
+
+    // Sampling overrides, v2 only
+    int max_tokens = 0;         // 0 for the default
+    float temperature = -1.0f;  // Negative for the default
+    int priority = 0;           // Higher is admitted first
+
+    // Must start decoding by then, ggml_time_us() based, 0 for no deadline
+    int64_t t_deadline = 0;
+};
+
+// Scheduler configuration
+struct SchedulerParams {
+    std::string model_path;
+    int n_parallel = 1;         // Concurrent sequences in the shared context
+    bool constrained_output = false; // The engine forces one fenced bash block, no repair pass
+    ResponseCache* response_cache = nullptr; // Optional, shared across models
+    std::shared_ptr<SemanticCache> semantic_cache; // Optional, needs response_cache
+    float semantic_threshold = 0.95f;        // Minimum cosine similarity for a hit
+    bool warmup = false;        // Run a throwaway request in start()
+    int max_queue = 64;         // Requests waiting for a slot, more are shed
+};
+
+// Continuous-batching scheduler.
+//
+// Every in-flight request owns a sequence of the engine's shared context.
+// Each step adds the next token of every generating request, plus as much
+// pending prompt as fits, to a single batch, decodes it once and streams
+// each sequence's new piece to its own client. Requests join and leave
+// between steps, so a new query never waits for another to end.
+class Scheduler {
+public:
+    Scheduler(std::unique_ptr<Engine> engine, const SchedulerParams& params, Metrics& metrics);
+    ~Scheduler();
+
+    // Initialize the engine and prefill the system prompt, optionally warm
+    // up with a throwaway request and start the loop
+    bool start();
+
+    // Stop the loop and close every pending and in-flight request
+    void stop();
+
+    // Queue a PROMPT request behind those of equal or higher priority, the
+    // scheduler ends its stream when done. Response cache hits are
+    // answered right away without the model. Turned away as busy when the
+    // queue is full or the estimated wait would miss its deadline, and
+    // ended as expired if the deadline passes while it is queued.
+    void submit(Request request);
+
+    // No queued or in-flight requests
+    bool idle() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // LLXD_SCHEDULER_H
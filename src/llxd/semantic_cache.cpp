@@ -0,0 +1,322 @@
+#include "semantic_cache.h"
+#include "hash.h"
+#include "common/common.h"
+#include "logging.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+static const char* const LOG_CATEGORY = "semantic_cache";
+
+namespace {
+
+constexpr uint64_t INDEX_MAGIC = 0x3130304353584c4cULL;  // "LLXSC001"
+constexpr uint32_t INDEX_VERSION = 1;
+
+// Prompts are short, anything longer is truncated for the embedding
+constexpr int EMBED_MAX_TOKENS = 256;
+
+struct IndexHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t n_embd;
+    uint32_t capacity;
+    uint32_t count;         // Valid rows
+    uint32_t head;          // Next row to overwrite
+    uint8_t padding[36];
+};
+static_assert(sizeof(IndexHeader) == 64, "semantic index header must stay 64 bytes");
+
+// Dot product of two n-float vectors, both are L2 normalized so this is
+// their cosine similarity
+float dot(const float* a, const float* b, int n) {
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_movehdup_ps(half));
+    sum = _mm_cvtss_f32(half);
+#else
+    float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (; i + 4 <= n; i += 4) {
+        acc[0] += a[i] * b[i];
+        acc[1] += a[i + 1] * b[i + 1];
+        acc[2] += a[i + 2] * b[i + 2];
+        acc[3] += a[i + 3] * b[i + 3];
+    }
+    sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+} // namespace
+
+class SemanticCache::Impl {
+public:
+    Impl(llama_model* model, const std::string& model_path, int capacity)
+        : model_(model)
+        , n_embd_(llama_model_n_embd(model))
+        , capacity_(std::max(capacity, 1)) {
+        path_ = model_path + ".semantic-" + llxd_hash::to_hex(llxd_hash::model_fingerprint(model_path)) + ".idx";
+        // Keys first, then rows; keep rows 64-byte aligned for vector loads
+        keys_offset_ = sizeof(IndexHeader);
+        rows_offset_ = (keys_offset_ + capacity_ * sizeof(uint64_t) + 63) & ~size_t(63);
+        file_size_ = rows_offset_ + capacity_ * n_embd_ * sizeof(float);
+    }
+
+    ~Impl() {
+        if (ctx_) {
+            llama_free(ctx_);
+        }
+        if (base_) {
+            msync(base_, file_size_, MS_ASYNC);
+            munmap(base_, file_size_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool init() {
+        // Whole prompt in one ubatch so pooling sees every token
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = EMBED_MAX_TOKENS;
+        ctx_params.n_batch = EMBED_MAX_TOKENS;
+        ctx_params.n_ubatch = EMBED_MAX_TOKENS;
+        ctx_params.n_seq_max = 1;
+        ctx_params.n_threads = 4;
+        ctx_params.n_threads_batch = 4;
+        ctx_params.embeddings = true;
+        ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        ctx_ = llama_init_from_model(model_, ctx_params);
+        if (!ctx_) {
+            LOG_ERROR("Failed to create embedding context");
+            return false;
+        }
+        batch_tokens_.reserve(EMBED_MAX_TOKENS);
+
+        return map_index();
+    }
+
+    bool map_index() {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0) {
+            LOG_ERROR("Failed to open semantic index " << path_ << ": " << strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        bool fresh = fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) != file_size_;
+        if (fresh && ftruncate(fd_, file_size_) != 0) {
+            LOG_ERROR("Failed to size semantic index " << path_ << ": " << strerror(errno));
+            return false;
+        }
+
+        void* base = mmap(nullptr, file_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            LOG_ERROR("Failed to map semantic index " << path_ << ": " << strerror(errno));
+            return false;
+        }
+        base_ = static_cast<char*>(base);
+
+        // A resized or foreign file starts over empty
+        IndexHeader* header = index_header();
+        if (fresh || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+            header->n_embd != static_cast<uint32_t>(n_embd_) || header->capacity != static_cast<uint32_t>(capacity_) ||
+            header->count > header->capacity || header->head >= header->capacity) {
+            memset(header, 0, sizeof(IndexHeader));
+            header->magic = INDEX_MAGIC;
+            header->version = INDEX_VERSION;
+            header->n_embd = n_embd_;
+            header->capacity = capacity_;
+        }
+        return true;
+    }
+
+    std::vector<float> embed(const std::string& text) {
+        std::unique_lock<std::mutex> lock(embed_mutex_);
+        std::vector<float> embedding;
+        if (!ctx_) {
+            return embedding;
+        }
+
+        batch_tokens_ = common_tokenize(llama_model_get_vocab(model_), text, true, false);
+        if (batch_tokens_.size() > static_cast<size_t>(EMBED_MAX_TOKENS)) {
+            batch_tokens_.resize(EMBED_MAX_TOKENS);
+        }
+        if (batch_tokens_.empty()) {
+            return embedding;
+        }
+
+        llama_kv_cache_clear(ctx_);
+        llama_batch batch = llama_batch_init(batch_tokens_.size(), 0, 1);
+        for (size_t i = 0; i < batch_tokens_.size(); i++) {
+            common_batch_add(batch, batch_tokens_[i], i, { 0 }, true);
+        }
+        int ret = llama_decode(ctx_, batch);
+        llama_batch_free(batch);
+        if (ret != 0) {
+            LOG_ERROR("Failed to decode prompt for embedding");
+            return embedding;
+        }
+
+        const float* pooled = llama_get_embeddings_seq(ctx_, 0);
+        if (!pooled) {
+            return embedding;
+        }
+
+        embedding.assign(pooled, pooled + n_embd_);
+        float norm = std::sqrt(dot(embedding.data(), embedding.data(), n_embd_));
+        if (norm > 0.0f) {
+            for (float& x : embedding) {
+                x /= norm;
+            }
+        }
+        return embedding;
+    }
+
+    bool search(const std::vector<float>& embedding, uint64_t& key, float& similarity) const {
+        std::unique_lock<std::mutex> lock(index_mutex_);
+        if (!base_ || embedding.size() != static_cast<size_t>(n_embd_)) {
+            return false;
+        }
+
+        const uint32_t count = index_header()->count;
+        int best = -1;
+        float best_similarity = -2.0f;
+        for (uint32_t i = 0; i < count; i++) {
+            float s = dot(embedding.data(), row(i), n_embd_);
+            if (s > best_similarity) {
+                best_similarity = s;
+                best = i;
+            }
+        }
+        if (best < 0) {
+            return false;
+        }
+
+        key = keys()[best];
+        similarity = best_similarity;
+        return true;
+    }
+
+    void insert(const std::vector<float>& embedding, uint64_t key) {
+        std::unique_lock<std::mutex> lock(index_mutex_);
+        if (!base_ || embedding.size() != static_cast<size_t>(n_embd_)) {
+            return;
+        }
+
+        // Overwrite the existing row for key, else the oldest one
+        IndexHeader* header = index_header();
+        uint32_t target = header->head;
+        bool replace = false;
+        for (uint32_t i = 0; i < header->count; i++) {
+            if (keys()[i] == key) {
+                target = i;
+                replace = true;
+                break;
+            }
+        }
+
+        memcpy(row(target), embedding.data(), n_embd_ * sizeof(float));
+        keys()[target] = key;
+        if (!replace) {
+            header->head = (header->head + 1) % capacity_;
+            if (header->count < static_cast<uint32_t>(capacity_)) {
+                header->count++;
+            }
+        }
+    }
+
+    IndexHeader* index_header() const {
+        return reinterpret_cast<IndexHeader*>(base_);
+    }
+
+    uint64_t* keys() const {
+        return reinterpret_cast<uint64_t*>(base_ + keys_offset_);
+    }
+
+    float* row(uint32_t i) const {
+        return reinterpret_cast<float*>(base_ + rows_offset_) + static_cast<size_t>(i) * n_embd_;
+    }
+
+    llama_model* model_;
+    llama_context* ctx_ = nullptr;
+    std::vector<llama_token> batch_tokens_;
+    std::mutex embed_mutex_;
+
+    int n_embd_;
+    int capacity_;
+    std::string path_;
+    size_t keys_offset_ = 0;
+    size_t rows_offset_ = 0;
+    size_t file_size_ = 0;
+    int fd_ = -1;
+    char* base_ = nullptr;
+    mutable std::mutex index_mutex_;
+};
+
+SemanticCache::SemanticCache(llama_model* model, const std::string& model_path, int capacity)
+    : impl(std::make_unique<Impl>(model, model_path, capacity)) {}
+
+SemanticCache::~SemanticCache() = default;
+
+bool SemanticCache::init() {
+    return impl->init();
+}
+
+std::vector<float> SemanticCache::embed(const std::string& text) {
+    return impl->embed(text);
+}
+
+bool SemanticCache::search(const std::vector<float>& embedding, uint64_t& key, float& similarity) const {
+    return impl->search(embedding, key, similarity);
+}
+
+void SemanticCache::insert(const std::vector<float>& embedding, uint64_t key) {
+    impl->insert(embedding, key);
+}
+
+int SemanticCache::n_embd() const {
+    return impl->n_embd_;
+}
+
+size_t SemanticCache::n_entries() const {
+    std::unique_lock<std::mutex> lock(impl->index_mutex_);
+    return impl->base_ ? impl->index_header()->count : 0;
+}
+
+std::string SemanticCache::file_path() const {
+    return impl->path_;
+}
@@ -0,0 +1,44 @@
+#ifndef LLXD_SEMANTIC_CACHE_H
+#define LLXD_SEMANTIC_CACHE_H
+
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+// Nearest-neighbour index of past prompts for paraphrase cache hits.
+//
+// Prompts are embedded with a small, dedicated context (mean pooled and
+// L2 normalized) on either the serving model or a separate embedding
+// model. Vectors live in a fixed-size ring in a memory-mapped file next
+// to the model, each tagged with the response cache key of the answer it
+// produced. Lookups are a brute-force SIMD dot product scan.
+class SemanticCache {
+public:
+    SemanticCache(llama_model* model, const std::string& model_path, int capacity);
+    ~SemanticCache();
+
+    // Create the embedding context and map the index file
+    bool init();
+
+    // Pooled, normalized embedding of text, empty on failure
+    std::vector<float> embed(const std::string& text);
+
+    // Closest stored entry, returns false when the index is empty
+    bool search(const std::vector<float>& embedding, uint64_t& key, float& similarity) const;
+
+    // Remember embedding as leading to the response stored under key
+    void insert(const std::vector<float>& embedding, uint64_t key);
+
+    int n_embd() const;
+    size_t n_entries() const;
+    std::string file_path() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif // LLXD_SEMANTIC_CACHE_H
@@ -0,0 +1,85 @@
+#include "stop_matcher.h"
+
+#include <algorithm>
+
+StopMatcher::StopMatcher(std::vector<Pattern> patterns)
+    : patterns_(std::move(patterns)) {
+    patterns_.erase(std::remove_if(patterns_.begin(), patterns_.end(),
+                                   [](const Pattern& p) { return p.text.empty(); }),
+                    patterns_.end());
+    n_skipped_.assign(patterns_.size(), 0);
+}
+
+std::vector<StopMatcher::Pattern> StopMatcher::code_block() {
+    // The first fence opens the block, the second one closes it
+    return { { "```", 1, true } };
+}
+
+std::string StopMatcher::feed(const std::string& piece) {
+    if (stopped_) {
+        return std::string();
+    }
+    if (patterns_.empty()) {
+        return piece;
+    }
+
+    held_ += piece;
+
+    // Resolve full matches in order of position, passing skipped ones
+    size_t from = 0;
+    while (true) {
+        size_t best_pos = std::string::npos;
+        size_t best = 0;
+        for (size_t i = 0; i < patterns_.size(); i++) {
+            size_t pos = held_.find(patterns_[i].text, from);
+            if (pos < best_pos) {
+                best_pos = pos;
+                best = i;
+            }
+        }
+        if (best_pos == std::string::npos) {
+            break;
+        }
+
+        const Pattern& pattern = patterns_[best];
+        if (n_skipped_[best] < pattern.skip) {
+            n_skipped_[best]++;
+            from = best_pos + pattern.text.size();
+            continue;
+        }
+
+        stopped_ = true;
+        std::string out = held_.substr(0, best_pos + (pattern.keep ? pattern.text.size() : 0));
+        held_.clear();
+        return out;
+    }
+
+    // Hold back the longest tail that is a proper prefix of some pattern,
+    // but never part of an occurrence that was already passed
+    size_t n_hold = 0;
+    for (const Pattern& pattern : patterns_) {
+        size_t max_len = std::min(pattern.text.size() - 1, held_.size() - from);
+        for (size_t len = max_len; len > n_hold; len--) {
+            if (held_.compare(held_.size() - len, len, pattern.text, 0, len) == 0) {
+                n_hold = len;
+                break;
+            }
+        }
+    }
+
+    std::string out = held_.substr(0, held_.size() - n_hold);
+    held_.erase(0, held_.size() - n_hold);
+    return out;
+}
+
+std::string StopMatcher::flush() {
+    std::string out;
+    out.swap(held_);
+    return stopped_ ? std::string() : out;
+}
+
+void StopMatcher::reset() {
+    n_skipped_.assign(patterns_.size(), 0);
+    held_.clear();
+    stopped_ = false;
+}
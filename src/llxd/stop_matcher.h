@@ -0,0 +1,46 @@
+#ifndef LLXD_STOP_MATCHER_H
+#define LLXD_STOP_MATCHER_H
+
+#include <string>
+#include <vector>
+
+// Incremental multi-pattern stop-sequence matcher for streamed text.
+//
+// Pieces are fed as they are sampled. Text that could still turn into a
+// stop sequence with the next piece is held back, so a stop string split
+// across tokens is never half emitted. A pattern can let a number of
+// occurrences pass before it stops, e.g. the opening fence of a code block.
+class StopMatcher {
+public:
+    struct Pattern {
+        std::string text;
+        int skip = 0;           // Occurrences to pass through before stopping
+        bool keep = false;      // Emit the matched text itself
+    };
+
+    StopMatcher() = default;
+    explicit StopMatcher(std::vector<Pattern> patterns);
+
+    // Stop right after the closing fence of the first code block
+    static std::vector<Pattern> code_block();
+
+    // Feed the next piece, returns the text that is safe to emit now
+    std::string feed(const std::string& piece);
+
+    // Release text held back for a partial match, at end of generation
+    std::string flush();
+
+    // Whether a stop pattern matched, later pieces are dropped
+    bool stopped() const { return stopped_; }
+
+    // Start over for a new generation with the same patterns
+    void reset();
+
+private:
+    std::vector<Pattern> patterns_;
+    std::vector<int> n_skipped_;
+    std::string held_;
+    bool stopped_ = false;
+};
+
+#endif // LLXD_STOP_MATCHER_H
@@ -0,0 +1,271 @@
+#include "trace.h"
+
+#include "ggml.h"
+#include "logging.h"
+
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+static const char* const LOG_CATEGORY = "trace";
+
+namespace llxd_trace {
+
+std::atomic<bool> g_enabled{ false };
+
+namespace {
+
+// Spans kept per thread, 32 bytes each
+constexpr size_t RING_CAPACITY = 16384;
+
+// Rings of exited threads kept for a dump beyond this many are dropped,
+// oldest first
+constexpr size_t MAX_RINGS = 64;
+
+// Spans timed to measure the cost of one
+constexpr int CALIBRATION_SPANS = 10000;
+
+// Fields are relaxed atomics so a dump may read a ring while its thread
+// writes to it, spans overwritten meanwhile are dropped by the reader
+struct Event {
+    std::atomic<const char*> name{ nullptr };
+    std::atomic<int64_t> t_start{ 0 };
+    std::atomic<int64_t> t_end{ 0 };
+    std::atomic<uint64_t> id{ 0 };      // Top bit marks async spans
+};
+
+constexpr uint64_t ASYNC_BIT = uint64_t(1) << 63;
+
+struct Ring {
+    explicit Ring(int tid) : events(RING_CAPACITY), tid(tid) {}
+
+    std::vector<Event> events;
+    std::atomic<uint64_t> head{ 0 };    // Spans ever written
+    const int tid;
+    std::string name;                   // Guarded by the registry mutex
+    std::atomic<bool> exited{ false };  // Its thread is gone, nothing more is written
+
+    void push(const char* span_name, int64_t t_start, int64_t t_end, uint64_t id) {
+        const uint64_t i = head.load(std::memory_order_relaxed);
+        Event& event = events[i % RING_CAPACITY];
+        event.name.store(span_name, std::memory_order_relaxed);
+        event.t_start.store(t_start, std::memory_order_relaxed);
+        event.t_end.store(t_end, std::memory_order_relaxed);
+        event.id.store(id, std::memory_order_relaxed);
+        head.store(i + 1, std::memory_order_release);
+    }
+};
+
+// Rings outlive their threads, so spans of finished threads still dump.
+// A dump releases them afterwards.
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    int next_tid = 1;
+    std::atomic<int64_t> ns_per_span{ 0 };
+};
+
+Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+// The calling thread's ring, created by its first span, and its name
+struct ThreadTrace {
+    std::shared_ptr<Ring> ring;
+    std::string name;
+
+    ~ThreadTrace() {
+        if (ring) {
+            ring->exited.store(true, std::memory_order_release);
+        }
+    }
+};
+
+ThreadTrace& thread_trace() {
+    thread_local ThreadTrace trace;
+    return trace;
+}
+
+Ring& thread_ring() {
+    ThreadTrace& trace = thread_trace();
+    if (!trace.ring) {
+        Registry& reg = registry();
+        std::unique_lock<std::mutex> lock(reg.mutex);
+        trace.ring = std::make_shared<Ring>(reg.next_tid++);
+        trace.ring->name = trace.name;
+
+        // Threads that come and go, such as model loaders, would add a
+        // ring each
+        auto exited = std::find_if(reg.rings.begin(), reg.rings.end(),
+                                   [](const std::shared_ptr<Ring>& ring) { return ring->exited.load(); });
+        if (reg.rings.size() >= MAX_RINGS && exited != reg.rings.end()) {
+            reg.rings.erase(exited);
+        }
+        reg.rings.push_back(trace.ring);
+    }
+    return *trace.ring;
+}
+
+// Time spans against a scratch ring the way callers record them
+int64_t measure_ns_per_span() {
+    Ring scratch(0);
+    const int64_t t_start = now_us();
+    for (int i = 0; i < CALIBRATION_SPANS; i++) {
+        int64_t t_span = now_us();
+        scratch.push("calibration", t_span, now_us(), i);
+    }
+    return (now_us() - t_start) * 1000 / CALIBRATION_SPANS;
+}
+
+void append_event(std::ostream& out, bool& first, const char* name, char phase, int tid, int64_t ts,
+                  int64_t dur, uint64_t id) {
+    out << (first ? "\n" : ",\n");
+    first = false;
+    out << "{\"name\":\"" << name << "\",\"cat\":\"llxd\",\"ph\":\"" << phase << "\",\"pid\":1,\"tid\":" << tid
+        << ",\"ts\":" << ts;
+    if (phase == 'X') {
+        out << ",\"dur\":" << dur;
+    }
+    if (phase == 'b' || phase == 'e') {
+        out << ",\"id\":" << id;
+    }
+    if (id != 0) {
+        out << ",\"args\":{\"request\":" << id << "}";
+    }
+    out << "}";
+}
+
+} // namespace
+
+void enable(bool on) {
+    if (on && !enabled()) {
+        int64_t ns_per_span = measure_ns_per_span();
+        registry().ns_per_span = ns_per_span;
+        LOG_INFO("Tracing enabled, " << ns_per_span << " ns per span");
+    } else if (!on && enabled()) {
+        LOG_INFO("Tracing disabled");
+    }
+    g_enabled.store(on, std::memory_order_relaxed);
+}
+
+int64_t now_us() {
+    return ggml_time_us();
+}
+
+void set_thread_name(const std::string& name) {
+    // The ring waits for the first span, most threads never record one
+    ThreadTrace& trace = thread_trace();
+    std::unique_lock<std::mutex> lock(registry().mutex);
+    trace.name = name;
+    if (trace.ring) {
+        trace.ring->name = name;
+    }
+}
+
+void record(const char* name, int64_t t_start_us, int64_t t_end_us, uint64_t id, bool async) {
+    if (!enabled()) {
+        return;
+    }
+    thread_ring().push(name, t_start_us, t_end_us, async ? (id | ASYNC_BIT) : id);
+}
+
+std::string dump_json() {
+    Registry& reg = registry();
+    std::vector<std::pair<std::shared_ptr<Ring>, std::string>> rings;
+    std::vector<std::shared_ptr<Ring>> exited;     // Complete, released once dumped
+    {
+        std::unique_lock<std::mutex> lock(reg.mutex);
+        for (const auto& ring : reg.rings) {
+            rings.emplace_back(ring, ring->name);
+            if (ring->exited.load(std::memory_order_acquire)) {
+                exited.push_back(ring);
+            }
+        }
+    }
+
+    struct Copy {
+        const char* name;
+        int64_t t_start;
+        int64_t t_end;
+        uint64_t id;
+    };
+
+    std::ostringstream out;
+    bool first = true;
+    uint64_t n_spans = 0;
+    uint64_t n_overwritten = 0;
+    out << "{\"traceEvents\":[";
+    for (const auto& item : rings) {
+        const Ring& ring = *item.first;
+        if (!item.second.empty()) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring.tid
+                << ",\"args\":{\"name\":\"" << item.second << "\"}}";
+        }
+
+        const uint64_t head = ring.head.load(std::memory_order_acquire);
+        const uint64_t begin = head > RING_CAPACITY ? head - RING_CAPACITY : 0;
+        std::vector<Copy> copies;
+        copies.reserve(head - begin);
+        for (uint64_t i = begin; i < head; i++) {
+            const Event& event = ring.events[i % RING_CAPACITY];
+            copies.push_back({ event.name.load(std::memory_order_relaxed),
+                               event.t_start.load(std::memory_order_relaxed),
+                               event.t_end.load(std::memory_order_relaxed),
+                               event.id.load(std::memory_order_relaxed) });
+        }
+
+        // The thread kept writing while we copied, drop the slots it
+        // reused, including the one it may be writing right now
+        const uint64_t head_after = ring.head.load(std::memory_order_acquire);
+        const uint64_t valid = head_after + 1 > RING_CAPACITY ? head_after + 1 - RING_CAPACITY : 0;
+        const size_t n_skip = valid > begin ? std::min<uint64_t>(valid - begin, copies.size()) : 0;
+        n_overwritten += begin + n_skip;
+
+        for (size_t i = n_skip; i < copies.size(); i++) {
+            const Copy& span = copies[i];
+            if (!span.name) {
+                continue;
+            }
+            if (span.id & ASYNC_BIT) {
+                append_event(out, first, span.name, 'b', ring.tid, span.t_start, 0, span.id & ~ASYNC_BIT);
+                append_event(out, first, span.name, 'e', ring.tid, span.t_end, 0, span.id & ~ASYNC_BIT);
+            } else {
+                append_event(out, first, span.name, 'X', ring.tid, span.t_start, span.t_end - span.t_start, span.id);
+            }
+            n_spans++;
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(reg.mutex);
+        for (const auto& ring : exited) {
+            reg.rings.erase(std::remove(reg.rings.begin(), reg.rings.end(), ring), reg.rings.end());
+        }
+    }
+
+    out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"spans\":" << n_spans
+        << ",\"overwritten\":" << n_overwritten << ",\"ns_per_span\":" << reg.ns_per_span.load()
+        << ",\"enabled\":" << (enabled() ? "true" : "false") << "}}\n";
+    return out.str();
+}
+
+bool dump_file(const std::string& path) {
+    std::ofstream file(path, std::ios::trunc);
+    if (!file) {
+        LOG_ERROR("Failed to open trace file: " << path);
+        return false;
+    }
+    file << dump_json();
+    if (!file) {
+        LOG_ERROR("Failed to write trace file: " << path);
+        return false;
+    }
+    return true;
+}
+
+} // namespace llxd_trace
@@ -0,0 +1,67 @@
+#ifndef LLXD_TRACE_H
+#define LLXD_TRACE_H
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+
+// Span tracing, exported as Chrome trace-event JSON for chrome://tracing
+// or Perfetto.
+//
+// Spans go to a ring buffer owned by the recording thread, so recording
+// takes no lock and the oldest spans are overwritten once a ring is full.
+// Off by default: a disabled Span costs one relaxed load and reads no
+// clock. Spans on one thread nest, phases of a request that interleave
+// with other requests are recorded as async spans keyed by request id.
+namespace llxd_trace {
+
+extern std::atomic<bool> g_enabled;
+
+inline bool enabled() {
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+// Start or stop recording. Enabling measures the cost of a span, which
+// is printed and included in dumps.
+void enable(bool on);
+
+// Microseconds on the clock spans are recorded with, ggml_time_us()
+int64_t now_us();
+
+// Name the calling thread in dumps
+void set_thread_name(const std::string& name);
+
+// Record a finished span on the calling thread's ring. id tags the
+// request, 0 for none.
+void record(const char* name, int64_t t_start_us, int64_t t_end_us, uint64_t id = 0, bool async = false);
+
+// Spans still held by every ring, as a trace-event JSON document
+std::string dump_json();
+
+// Write dump_json() to path
+bool dump_file(const std::string& path);
+
+// Records the enclosing scope, name must outlive the trace
+class Span {
+public:
+    explicit Span(const char* name, uint64_t id = 0)
+        : name_(enabled() ? name : nullptr), id_(id), t_start_(name_ ? now_us() : 0) {}
+
+    ~Span() {
+        if (name_) {
+            record(name_, t_start_, now_us(), id_);
+        }
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+private:
+    const char* name_;
+    uint64_t id_;
+    int64_t t_start_;
+};
+
+} // namespace llxd_trace
+
+#endif // LLXD_TRACE_H